@@ -2,6 +2,9 @@
 #define JOINTSURV_MISC_H
 
 #include "VA-joint-config.h"
+#include "ghq-vec-exp.h"
+#include <algorithm>
+#include <cmath>
 
 namespace survival {
 
@@ -15,6 +18,74 @@ struct node_weight {
   vajoint_uint n_nodes;
 };
 
+/**
+ * computes the nodes and weights of the n-point Gauss-Legendre rule on (0, 1).
+ * The roots of the Legendre polynomial are found with Newton's method.
+ */
+inline void gauss_legendre_rule
+  (vajoint_uint const n, double * ns, double * ws) noexcept {
+  constexpr double pi{3.14159265358979323846};
+  for(vajoint_uint i = 0; i < (n + 1) / 2; ++i){
+    double z{std::cos(pi * (i + .75) / (n + .5))}, d_p{};
+    for(int it = 0; it < 100; ++it){
+      // evaluate the Legendre polynomial and its derivative at z
+      double p1{1}, p2{0};
+      for(vajoint_uint j = 0; j < n; ++j){
+        double const p3{p2};
+        p2 = p1;
+        p1 = ((2. * j + 1.) * z * p2 - j * p3) / (j + 1.);
+      }
+      d_p = n * (z * p1 - p2) / (z * z - 1);
+
+      double const step{p1 / d_p};
+      z -= step;
+      if(std::abs(step) < 1e-15)
+        break;
+    }
+
+    ns[i] = .5 - z / 2;
+    ns[n - 1 - i] = .5 + z / 2;
+    ws[i] = 1 / ((1 - z * z) * d_p * d_p);
+    ws[n - 1 - i] = ws[i];
+  }
+}
+
+/**
+ * fills ns and ws with a composite rule for the integral over [lb, ub] mapped
+ * to (0, 1). The interval is split at the sorted break points in (lb, ub) and
+ * nws is applied to each piece. Returns the number of nodes which is at most
+ * (std::distance(breaks_begin, breaks_end) + 1) * nws.n_nodes.
+ */
+inline vajoint_uint split_rule
+  (double const lb, double const ub, double const *breaks_begin,
+   double const *breaks_end, node_weight const &nws, double * ns,
+   double * ws) noexcept {
+  double const * const first{std::upper_bound(breaks_begin, breaks_end, lb)},
+               * const last{std::lower_bound(first, breaks_end, ub)};
+
+  double const len{ub - lb};
+  vajoint_uint n_out{};
+  double piece_lb{lb};
+  for(double const *b = first; ; ++b){
+    double const piece_ub{b == last ? ub : *b},
+                 piece_len{(piece_ub - piece_lb) / len},
+                 offset{(piece_lb - lb) / len};
+    for(vajoint_uint i = 0; i < nws.n_nodes; ++i, ++n_out){
+      ns[n_out] = offset + piece_len * nws.ns[i];
+      ws[n_out] = piece_len * nws.ws[i];
+    }
+
+    if(b == last)
+      break;
+    piece_lb = piece_ub;
+  }
+
+  return n_out;
+}
+
+/// the vectorized exponential function is shared with the ghqCpp namespace
+using ghqCpp::vec_exp;
+
 }
 
 #endif
@@ -9,8 +9,11 @@
 #include <limits>
 #include "survival-term.h"
 #include <array>
+#include <exception>
 #include "prof-vajoint.h"
 #include "ghq-delayed-entry.h"
+#include "integrand-expected-survival.h"
+#include "load-balance.h"
 
 using Rcpp::List;
 using Rcpp::NumericMatrix;
@@ -68,6 +71,58 @@ survival::node_weight node_weight_from_list(List dat){
   return { &nodes[0], &weigths[0], static_cast<vajoint_uint>(nodes.size()) };
 }
 
+/**
+ * returns the tolerance of the heuristic that selects fewer quadrature nodes
+ * per observation with cached expansions. Zero if it is not in the list.
+ */
+double quad_rule_node_selection_tol(List dat){
+  if(!dat.containsElementNamed("node_selection_tol"))
+    return 0;
+  return Rcpp::as<double>(dat["node_selection_tol"]);
+}
+
+/**
+ * returns true if the intervals in the survival terms should be split at the
+ * knots of the bases. False if it is not in the list.
+ */
+bool quad_rule_split_at_knots(List dat){
+  if(!dat.containsElementNamed("split_at_knots"))
+    return false;
+  return Rcpp::as<bool>(dat["split_at_knots"]);
+}
+
+/**
+ * returns the number of Gauss-Legendre nodes to use for each piece when the
+ * intervals are split at the knots. Zero if it is not in the list in which
+ * case the number is scaled down from the quadrature rule.
+ */
+unsigned quad_rule_split_n_nodes(List dat){
+  if(!dat.containsElementNamed("split_n_nodes"))
+    return 0;
+  return Rcpp::as<unsigned>(dat["split_n_nodes"]);
+}
+
+/**
+ * returns true if the cached expansions in the survival terms should be
+ * stored as floats. False if it is not in the list.
+ */
+bool quad_rule_cache_as_float(List dat){
+  if(!dat.containsElementNamed("cache_as_float"))
+    return false;
+  return Rcpp::as<bool>(dat["cache_as_float"]);
+}
+
+/**
+ * returns the maximum number of bytes of the lazy caches of the expansions in
+ * the survival terms. Zero if it is not in the list in which case all the
+ * expansions are cached.
+ */
+size_t quad_rule_cache_max_bytes(List dat){
+  if(!dat.containsElementNamed("cache_max_bytes"))
+    return 0;
+  return static_cast<size_t>(Rcpp::as<double>(dat["cache_max_bytes"]));
+}
+
 ghqCpp::ghq_data gh_node_weight_from_list(List dat){
   NumericVector nodes = dat["node"],
               weigths = dat["weight"];
@@ -77,6 +132,76 @@ ghqCpp::ghq_data gh_node_weight_from_list(List dat){
   return { &nodes[0], &weigths[0], static_cast<vajoint_uint>(nodes.size()) };
 }
 
+/**
+ * returns true if the modes in the delayed entry terms should be used as
+ * starting values in the next evaluation. False if it is not in the list.
+ */
+bool gh_quad_rule_warm_start(List dat){
+  if(!dat.containsElementNamed("warm_start"))
+    return false;
+  return Rcpp::as<bool>(dat["warm_start"]);
+}
+
+/**
+ * returns the tolerance used to decide whether to skip the adaptation in the
+ * delayed entry terms. Minus one if it is not in the list.
+ */
+double gh_quad_rule_warm_start_tol(List dat){
+  if(!dat.containsElementNamed("warm_start_tol"))
+    return -1;
+  return Rcpp::as<double>(dat["warm_start_tol"]);
+}
+
+/**
+ * returns the level of the sparse grids to use in the delayed entry terms.
+ * Zero if it is not in the list in which case the product rules are used.
+ */
+size_t gh_quad_rule_sparse_level(List dat){
+  if(!dat.containsElementNamed("sparse_level"))
+    return 0;
+  return Rcpp::as<size_t>(dat["sparse_level"]);
+}
+
+/**
+ * returns the number of points of the randomized quasi-Monte Carlo method to
+ * use in the delayed entry terms. Zero if it is not in the list.
+ */
+size_t gh_quad_rule_qmc_points(List dat){
+  if(!dat.containsElementNamed("qmc_points"))
+    return 0;
+  return Rcpp::as<size_t>(dat["qmc_points"]);
+}
+
+/**
+ * returns the minimum number of random effects for which the randomized
+ * quasi-Monte Carlo method is used. Five if it is not in the list.
+ */
+size_t gh_quad_rule_qmc_min_vars(List dat){
+  if(!dat.containsElementNamed("qmc_min_vars"))
+    return 5;
+  return Rcpp::as<size_t>(dat["qmc_min_vars"]);
+}
+
+/**
+ * returns the number of threads to use in the delayed entry terms of the
+ * large clusters. One if it is not in the list.
+ */
+unsigned gh_quad_rule_nested_threads(List dat){
+  if(!dat.containsElementNamed("nested_threads"))
+    return 1;
+  return Rcpp::as<unsigned>(dat["nested_threads"]);
+}
+
+/**
+ * returns the minimum number of delayed entries of the clusters for which
+ * multiple threads are used. 100 if it is not in the list.
+ */
+size_t gh_quad_rule_nested_min_obs(List dat){
+  if(!dat.containsElementNamed("nested_min_obs"))
+    return 100;
+  return Rcpp::as<size_t>(dat["nested_min_obs"]);
+}
+
 } // namespace
 
 using cfaad::Number;
@@ -245,8 +370,26 @@ class lower_bound_caller {
   /// set to true if setup() failed
   bool setup_failed;
 
+  survival::delayed_dat const *d_dat;
+  /// the indices of the delayed entry clusters of the terms
+  std::vector<vajoint_uint> delayed_indices;
+  /**
+   * the delayed entry terms only depend on the global parameters so they are
+   * computed for all clusters in batches in setup(). delayed_values has an
+   * element for each cluster and the gradient of the k'th cluster w.r.t. the
+   * global parameters with the full matrices starts at
+   * k * par_vec.size() in delayed_grads.
+   */
+  std::vector<double> delayed_values, delayed_grads;
+  bool has_delayed_values{false}, has_delayed_grads{false};
+
+  /// computes the delayed entry terms and possibly their gradients
+  void setup_delayed(bool const comp_grad);
+
 public:
   static bool optimze_survival;
+  /// the number of threads to use in setup_delayed()
+  static unsigned n_threads;
 
   lower_bound_caller(std::vector<lower_bound_term const*> &);
 
@@ -257,6 +400,132 @@ public:
 };
 
 bool lower_bound_caller::optimze_survival = true;
+unsigned lower_bound_caller::n_threads = 1;
+
+/**
+ * holds the working memory that is required by lower_bound_term::comp and
+ * lower_bound_term::hess. The sizes do not change once the objects for the
+ * terms are constructed so they are only computed once. The sizes are stored
+ * for both the case where only the markers are used and where the survival
+ * terms are used too.
+ *
+ * The delayed entry term uses the memory stack after the mark is set and
+ * does not need any memory from the plan.
+ */
+class lower_bound_wmem_plan {
+  /// memory for the function evaluation
+  std::array<vajoint_uint, 2> n_func_v{};
+  /// memory for the gradient evaluation
+  std::array<vajoint_uint, 2> n_grad_v{};
+  /// memory for the Hessian evaluation
+  std::array<vajoint_uint, 2> n_hess_v{};
+
+public:
+  lower_bound_wmem_plan() = default;
+
+  lower_bound_wmem_plan
+    (subset_params const &par_idx, marker::marker_dat const &m_dat,
+     survival::survival_dat const &s_dat, kl_term const &kl_dat){
+    vajoint_uint const n_rng{par_idx.va_mean_end() - par_idx.va_mean()};
+
+    n_func_v[0] =
+      many_max<vajoint_uint>(log_chol::pd_mat::n_wmem(n_rng),
+                             m_dat.n_wmem_cluster(),
+                             kl_dat.n_wmem());
+    n_func_v[1] =
+      many_max<vajoint_uint>(n_func_v[0],
+                             s_dat.n_wmem()[0] + s_dat.n_wmem()[1]);
+
+    // all terms are computed without the AD tape
+    n_grad_v[0] =
+      many_max<vajoint_uint>
+        (log_chol:: pd_mat::n_wmem(n_rng),
+         log_chol::dpd_mat::n_wmem(n_rng),
+         log_chol::dpd_mat::n_wmem(par_idx.marker_info().size()),
+         log_chol::dpd_mat::n_wmem(par_idx.n_shared_surv()),
+         log_chol::dpd_mat::n_wmem(par_idx.n_shared()),
+         m_dat.n_wmem_cluster(),
+         kl_dat.n_wmem());
+    n_grad_v[1] =
+      many_max<vajoint_uint>(n_grad_v[0], s_dat.n_wmem_grad());
+
+    n_hess_v[0] =
+      many_max<vajoint_uint>
+        (n_grad_v[0],
+         log_chol::d2pd_mat::n_wmem(n_rng),
+         log_chol::d2pd_mat::n_wmem(par_idx.marker_info().size()),
+         log_chol::d2pd_mat::n_wmem(par_idx.n_shared_surv()),
+         log_chol::d2pd_mat::n_wmem(par_idx.n_shared()),
+         m_dat.n_wmem_hess(),
+         kl_dat.n_wmem_hess());
+    n_hess_v[1] =
+      many_max<vajoint_uint>
+        (n_hess_v[0], n_grad_v[1], s_dat.n_wmem_hess());
+  }
+
+  vajoint_uint n_func(bool const with_surv) const {
+    return n_func_v[with_surv];
+  }
+  vajoint_uint n_grad(bool const with_surv) const {
+    return n_grad_v[with_surv];
+  }
+  vajoint_uint n_hess(bool const with_surv) const {
+    return n_hess_v[with_surv];
+  }
+};
+
+/**
+ * computes the derivative of a vector valued function w.r.t. x using
+ * central differences and Richardson extrapolation. comp_diff(h, diff) must
+ * set diff to the difference between the function at x + h and at x - h.
+ * The first step is eps times the absolute value of x (at least eps) and
+ * the following steps are divided by scale. At most n_steps steps are taken
+ * and the extrapolation stops when the relative change of all the elements
+ * is less than tol.
+ *
+ * The result of size n is written to res and wk needs 2 x n x n_steps
+ * elements.
+ */
+template<class F>
+void richardson_diff
+  (F comp_diff, size_t const n, double const x, double const eps,
+   double const scale, double const tol, unsigned const n_steps,
+   double * res, double * wk){
+  // the m'th element in the row of the table has the m'th extrapolation
+  double * prev{wk},
+         * cur{wk + n_steps * n};
+  double h{eps * std::max(1., std::abs(x))};
+
+  for(unsigned l = 0; l < n_steps; ++l, h /= scale){
+    comp_diff(h, cur);
+    for(size_t i = 0; i < n; ++i)
+      cur[i] /= 2 * h;
+
+    double fac{scale * scale};
+    for(unsigned m = 1; m <= l; ++m, fac *= scale * scale){
+      double * const cur_m{cur + m * n};
+      double const * const cur_m1{cur_m - n},
+                   * const prev_m1{prev + (m - 1) * n};
+      for(size_t i = 0; i < n; ++i)
+        cur_m[i] = cur_m1[i] + (cur_m1[i] - prev_m1[i]) / (fac - 1);
+    }
+
+    double const * const est{cur + l * n};
+    std::copy(est, est + n, res);
+
+    bool converged{l > 0};
+    if(converged){
+      double const * const est_prev{prev + (l - 1) * n};
+      for(size_t i = 0; i < n && converged; ++i)
+        converged = std::abs(est[i] - est_prev[i]) <=
+          tol * std::max(1., std::abs(est[i]));
+    }
+    if(converged)
+      break;
+
+    std::swap(prev, cur);
+  }
+}
 
 class lower_bound_term {
   subset_params const &par_idx;
@@ -264,6 +533,7 @@ class lower_bound_term {
   survival::survival_dat const &s_dat;
   kl_term const &kl_dat;
   survival::delayed_dat const &d_dat;
+  lower_bound_wmem_plan const &wmem_plan;
 
   std::vector<vajoint_uint> marker_indices;
   /// indices of survival outcomes stored as (index, type of outcome)
@@ -278,8 +548,10 @@ public:
   lower_bound_term
   (subset_params const &par_idx, marker::marker_dat const &m_dat,
    survival::survival_dat const &s_dat, kl_term const &kl_dat,
-   survival::delayed_dat const &d_dat):
+   survival::delayed_dat const &d_dat,
+   lower_bound_wmem_plan const &wmem_plan):
   par_idx(par_idx), m_dat(m_dat), s_dat(s_dat), kl_dat(kl_dat), d_dat(d_dat),
+  wmem_plan(wmem_plan),
   n_global(par_idx.n_params<true>()),
   n_private{par_idx.n_va_params<true>()}
   { }
@@ -297,6 +569,15 @@ public:
     delayed_entry_idx = idx;
   }
 
+  /**
+   * must be called once all the indices are added. It orders the marker
+   * indices by their missingness pattern as required by
+   * marker_dat::eval_cluster and marker_dat::grad_cluster.
+   */
+  void finalize() {
+    m_dat.sort_by_pattern(marker_indices);
+  }
+
   void shrink_to_fit() {
     marker_indices.shrink_to_fit();
     surv_indices.shrink_to_fit();
@@ -309,47 +590,125 @@ public:
     return n_private;
   }
 
+  /**
+   * returns a rough estimate of the relative time it takes to evaluate the
+   * term. It is used to order the terms such that the threads get about the
+   * same amount of work. n_quad is the number of nodes used for the survival
+   * terms and the delayed entries and n_gh_points is the number of points
+   * used to integrate out the random effects in the delayed entry terms. The
+   * work of the delayed entry terms with at least nested_min_obs entries is
+   * split between nested_threads threads.
+   */
+  double cost(double const n_quad, double const n_gh_points,
+              unsigned const nested_threads,
+              size_t const nested_min_obs) const {
+    double const n_rng{static_cast<double>
+      (par_idx.va_mean_end() - par_idx.va_mean())};
+
+    // the KL term and the variational parameters
+    double out{n_rng * n_rng};
+    out += static_cast<double>(marker_indices.size()) *
+      par_idx.marker_info().size();
+    out += static_cast<double>(surv_indices.size()) * n_quad * n_rng;
+
+    if(has_delayed_entry){
+      // an adaptive quadrature with a product rule over the random effects
+      size_t const n_delayed
+        {d_dat.cluster_infos()[delayed_entry_idx].size()};
+      double const n_vars
+        {static_cast<double>(par_idx.n_shared() + par_idx.n_shared_surv())},
+               n_threads
+        {n_delayed >= nested_min_obs ? static_cast<double>(nested_threads) : 1};
+      out += static_cast<double>(n_delayed) * n_quad * n_vars * n_gh_points /
+        n_threads;
+    }
+
+    return out;
+  }
+
+  /**
+   * fills in the parameter vector with the full matrices using the global
+   * parameters from the caller and the variational parameters in p.
+   */
+  void set_par_vec(double const *p, double *par_vec,
+                   lower_bound_caller const &caller, double *wk_mem) const {
+    vajoint_uint const n_rng{par_idx.va_mean_end() - par_idx.va_mean()};
+
+    // copy the global parameters
+    std::copy(caller.par_vec.begin(), caller.par_vec.end(), par_vec);
+
+    // insert the variational parameters
+    std::copy(p + par_idx.va_mean<true>(), p + par_idx.va_mean_end<true>(),
+              par_vec + par_idx.va_mean<false>());
+    log_chol::pd_mat::get(p + par_idx.va_vcov<true>(), n_rng,
+                          par_vec + par_idx.va_vcov<false>(), wk_mem);
+  }
+
+  /**
+   * computes the lower bound terms and adds the gradient w.r.t. the parameter
+   * vector with the full matrices to par_vec_gr.
+   */
+  double grad_full(double const *par_vec, double *par_vec_gr,
+                   double *inter_mem, bool const with_surv,
+                   lower_bound_caller const &caller) const {
+    double res = kl_dat.grad(par_vec_gr, par_vec, inter_mem);
+    res += m_dat.grad_cluster
+      (par_vec, par_vec_gr, inter_mem, marker_indices.data(),
+       marker_indices.data() + marker_indices.size());
+
+    if(with_surv){
+      for(auto &idx : surv_indices)
+        res += s_dat.grad(par_vec, par_vec_gr, inter_mem, idx[0], idx[1],
+                          *cur_quad_rule);
+
+      if(has_delayed_entry && caller.has_delayed_grads){
+        size_t const n_global_full{caller.par_vec.size()};
+        double const * const delayed_gr
+          {caller.delayed_grads.data() + delayed_entry_idx * n_global_full};
+        for(size_t i = 0; i < n_global_full; ++i)
+          par_vec_gr[i] += delayed_gr[i];
+        res += caller.delayed_values[delayed_entry_idx];
+
+      } else if(has_delayed_entry){
+        ghqCpp::simple_mem_stack<double> &my_stack = wmem::mem_stack();
+        res += d_dat.grad(par_vec, par_vec_gr, my_stack, delayed_entry_idx,
+                          *cur_quad_rule, *cur_gh_quad_rule);
+      }
+    }
+
+    return res;
+  }
+
   double comp(double const *p, double *gr,
               lower_bound_caller const &caller, bool const comp_grad) const {
     if(caller.setup_failed)
       return std::numeric_limits<double>::quiet_NaN();
-    set_my_tape();
 
     vajoint_uint const n_rng{par_idx.va_mean_end() - par_idx.va_mean()};
+    bool const with_surv{lower_bound_caller::optimze_survival};
     wmem::rewind();
 
     if(!comp_grad){
-      // find the required working memory
-      // TODO: do this once
-      vajoint_uint const n_wmem =
-        many_max<vajoint_uint>(log_chol::pd_mat::n_wmem(n_rng),
-                               m_dat.n_wmem(),
-                               kl_dat.n_wmem(),
-                               s_dat.n_wmem()[0] + s_dat.n_wmem()[1]);
-
-      double * const inter_mem{wmem::get_double_mem(n_wmem)};
+      double * const inter_mem
+        {wmem::get_double_mem(wmem_plan.n_func(with_surv))};
       double * const par_vec{wmem::get_double_mem(par_idx.n_params_w_va())};
       auto mem_mark = wmem::mem_stack().set_mark_raii();
 
-      // copy the global parameters
-      std::copy(caller.par_vec.begin(), caller.par_vec.end(), par_vec);
-
-      // insert the variational parameters
-      std::copy(p + par_idx.va_mean<true>(), p + par_idx.va_mean_end<true>(),
-                par_vec + par_idx.va_mean<false>());
-      log_chol::pd_mat::get(p + par_idx.va_vcov<true>(), n_rng,
-                            par_vec + par_idx.va_vcov<false>(), inter_mem);
+      set_par_vec(p, par_vec, caller, inter_mem);
 
       // compute the lower bound terms and return
       double res = kl_dat.eval(par_vec, inter_mem);
-      for(vajoint_uint idx : marker_indices)
-        res += m_dat(par_vec, inter_mem, idx);
-      if(lower_bound_caller::optimze_survival){
+      res += m_dat.eval_cluster
+        (par_vec, inter_mem, marker_indices.data(),
+         marker_indices.data() + marker_indices.size());
+      if(with_surv){
         for(auto &idx : surv_indices)
           res += s_dat(par_vec, inter_mem, idx[0], idx[1],
                        inter_mem + s_dat.n_wmem()[0], *cur_quad_rule);
 
-        if(has_delayed_entry){
+        if(has_delayed_entry && caller.has_delayed_values)
+          res += caller.delayed_values[delayed_entry_idx];
+        else if(has_delayed_entry){
           ghqCpp::simple_mem_stack<double> &my_stack = wmem::mem_stack();
           res += d_dat(par_vec, my_stack, delayed_entry_idx,
                        *cur_quad_rule, *cur_gh_quad_rule);
@@ -359,78 +718,22 @@ public:
       return res;
     }
 
-    // find the required working memory
-    // TODO: compute this once
-    vajoint_uint const n_wmem_num
-      {many_max<vajoint_uint>(m_dat.n_wmem(), s_dat.n_wmem()[0])};
-    vajoint_uint const n_wmem_dub
-      {many_max<vajoint_uint>
-        (log_chol:: pd_mat::n_wmem(n_rng),
-         log_chol::dpd_mat::n_wmem(n_rng),
-         log_chol::dpd_mat::n_wmem(par_idx.marker_info().size()),
-         log_chol::dpd_mat::n_wmem(par_idx.n_shared_surv()),
-         kl_dat.n_wmem(),
-         s_dat.n_wmem()[1])};
-
-    Number * const inter_mem_num{wmem::get_Number_mem(n_wmem_num)};
-    double * const inter_mem_dub{wmem::get_double_mem(n_wmem_dub)};
+    double * const inter_mem
+      {wmem::get_double_mem(wmem_plan.n_grad(with_surv))};
 
     // setup the parameter vectors
-    double * const par_vec_dub
+    double * const par_vec
       {wmem::get_double_mem(par_idx.n_params_w_va<false>())},
            * const par_vec_gr
       {wmem::get_double_mem(par_idx.n_params_w_va<false>())};
-    Number * const par_vec_num
-      {wmem::get_Number_mem(par_idx.n_params_w_va<false>())};
     auto mem_mark = wmem::mem_stack().set_mark_raii();
 
-    Number::tape->rewind();
     std::fill(par_vec_gr, par_vec_gr + par_idx.n_params_w_va<false>(), 0);
+    set_par_vec(p, par_vec, caller, inter_mem);
 
-    // copy the global parameters
-    std::copy(caller.par_vec.begin(), caller.par_vec.end(), par_vec_dub);
-    cfaad::convertCollection
-      (caller.par_vec.begin(), caller.par_vec.end(), par_vec_num);
-
-    // insert the variational parameters
-    std::copy(p + par_idx.va_mean<true>(), p + par_idx.va_mean_end<true>(),
-              par_vec_dub + par_idx.va_mean<false>());
-    cfaad::convertCollection
-      (p + par_idx.va_mean<true>(), p + par_idx.va_mean_end<true>(),
-       par_vec_num + par_idx.va_mean<false>());
-
-    log_chol::pd_mat::get
-      (p + par_idx.va_vcov<true>(), n_rng,
-       par_vec_dub + par_idx.va_vcov<false>(), inter_mem_dub);
-    cfaad::convertCollection
-      (par_vec_dub + par_idx.va_vcov<false>(),
-       par_vec_dub + par_idx.va_vcov<false>() + n_rng * n_rng,
-       par_vec_num + par_idx.va_vcov<false>());
-
-    // compute the lower bound terms.
-    Number res{0};
-    for(vajoint_uint idx : marker_indices)
-      res += m_dat(par_vec_num, inter_mem_num, idx);
-
-    res += kl_dat.grad(par_vec_gr, par_vec_dub, inter_mem_dub);
-
-    if(lower_bound_caller::optimze_survival){
-      for(auto &idx : surv_indices)
-        res += s_dat(par_vec_num, inter_mem_num, idx[0], idx[1],
-                     inter_mem_dub, *cur_quad_rule);
-
-      if(has_delayed_entry){
-        ghqCpp::simple_mem_stack<double> &my_stack = wmem::mem_stack();
-        res += d_dat.grad(par_vec_dub, par_vec_gr, my_stack, delayed_entry_idx,
-                          *cur_quad_rule, *cur_gh_quad_rule);
-      }
-    }
-
-    // compute the gradient and return
-    res.propagateToStart();
-
-    for(vajoint_uint i = 0; i < par_idx.n_params_w_va<false>(); ++i)
-      par_vec_gr[i] += par_vec_num[i].adjoint();
+    // compute the lower bound terms and their gradient
+    double const res
+      {grad_full(par_vec, par_vec_gr, inter_mem, with_surv, caller)};
 
     // the covariance matrix parameters
     std::copy(par_vec_gr, par_vec_gr + par_idx.vcov_start<false>(), gr);
@@ -447,24 +750,170 @@ public:
     log_chol::dpd_mat::get
       (p + par_idx.vcov_marker<true>(), par_idx.marker_info().size(),
        gr + par_idx.vcov_marker<true>(),
-       par_vec_gr + par_idx.vcov_marker<false>(), inter_mem_dub);
+       par_vec_gr + par_idx.vcov_marker<false>(), inter_mem);
 
     log_chol::dpd_mat::get
       (p + par_idx.vcov_surv<true>(), par_idx.n_shared_surv(),
        gr + par_idx.vcov_surv<true>(),
-       par_vec_gr + par_idx.vcov_surv<false>(), inter_mem_dub);
+       par_vec_gr + par_idx.vcov_surv<false>(), inter_mem);
 
     log_chol::dpd_mat::get
       (p + par_idx.vcov_vary<true>(), par_idx.n_shared(),
        gr + par_idx.vcov_vary<true>(),
-       par_vec_gr + par_idx.vcov_vary<false>(), inter_mem_dub);
+       par_vec_gr + par_idx.vcov_vary<false>(), inter_mem);
 
     log_chol::dpd_mat::get
       (p + par_idx.va_vcov<true>(), n_rng,
        gr + par_idx.va_vcov<true>(),
-       par_vec_gr + par_idx.va_vcov<false>(), inter_mem_dub);
+       par_vec_gr + par_idx.va_vcov<false>(), inter_mem);
 
-    return res.value();
+    return res;
+  }
+
+  /**
+   * computes the Hessian of the element function and writes it to hess which
+   * is a square matrix with global_dim() + private_dim() rows. The j'th
+   * column is the directional derivative of the gradient w.r.t. the
+   * parameter vector with the full matrices (see the hess_vec members of the
+   * terms) in the direction of the derivative of that vector w.r.t. the j'th
+   * parameter. The chain rule is then applied as in comp along with the
+   * second derivatives of the log Cholesky decompositions.
+   *
+   * There are no analytic second derivatives of the delayed entry term. Its
+   * directional derivatives are computed with central differences of its
+   * gradient using Richardson extrapolation (see richardson_diff) with the
+   * eps, scale, tol, and n_steps arguments.
+   */
+  void comp_hess
+    (double const *p, double *hess, lower_bound_caller const &caller,
+     double const eps, double const scale, double const tol,
+     unsigned const n_steps) const {
+    size_t const n_ele_par{n_global + n_private};
+    if(caller.setup_failed){
+      std::fill(hess, hess + n_ele_par * n_ele_par,
+                std::numeric_limits<double>::quiet_NaN());
+      return;
+    }
+
+    vajoint_uint const n_rng{par_idx.va_mean_end() - par_idx.va_mean()},
+                    n_full{par_idx.n_params_w_va<false>()};
+    bool const with_surv{lower_bound_caller::optimze_survival},
+           with_delayed{with_surv && has_delayed_entry};
+    wmem::rewind();
+
+    // the covariance matrices and their location in the two parameter vectors
+    struct vcov_block {
+      vajoint_uint idx_theta, idx_full, dim;
+    };
+    std::array<vcov_block, 4> const vcov_blocks
+      {{ { par_idx.vcov_marker<true>(), par_idx.vcov_marker<false>(),
+           static_cast<vajoint_uint>(par_idx.marker_info().size()) },
+         { par_idx.vcov_surv<true>(), par_idx.vcov_surv<false>(),
+           par_idx.n_shared_surv() },
+         { par_idx.vcov_vary<true>(), par_idx.vcov_vary<false>(),
+           par_idx.n_shared() },
+         { par_idx.va_vcov<true>(), par_idx.va_vcov<false>(), n_rng } }};
+    vajoint_uint max_dim{};
+    for(auto &block : vcov_blocks)
+      max_dim = std::max(max_dim, block.dim);
+
+    double * const inter_mem
+      {wmem::get_double_mem(wmem_plan.n_hess(with_surv))},
+           * const par_vec{wmem::get_double_mem(n_full)},
+           * const par_vec_gr{wmem::get_double_mem(n_full)},
+           * const dir{wmem::get_double_mem(n_full)},
+           * const dir_gr{wmem::get_double_mem(n_full)},
+           * const dir_theta{wmem::get_double_mem(dim_tri(max_dim))};
+
+    // memory for the central differences of the delayed entry term
+    vajoint_uint const n_diff_mem{with_delayed ? n_full : 0};
+    double * const par_vec_step{wmem::get_double_mem(n_diff_mem)},
+           * const gr_plus{wmem::get_double_mem(n_diff_mem)},
+           * const gr_minus{wmem::get_double_mem(n_diff_mem)},
+           * const diff_res{wmem::get_double_mem(n_diff_mem)},
+           * const diff_table{wmem::get_double_mem(2 * n_steps * n_diff_mem)};
+    auto mem_mark = wmem::mem_stack().set_mark_raii();
+
+    // the gradient is needed for the second derivatives of the log Cholesky
+    // decompositions
+    std::fill(par_vec_gr, par_vec_gr + n_full, 0);
+    set_par_vec(p, par_vec, caller, inter_mem);
+    grad_full(par_vec, par_vec_gr, inter_mem, with_surv, caller);
+
+    for(size_t j = 0; j < n_ele_par; ++j){
+      // set the derivative of the parameter vector with the full matrices
+      std::fill(dir, dir + n_full, 0);
+      vcov_block const *block_j{nullptr};
+      if(j < par_idx.vcov_start<true>())
+        dir[j] = 1;
+      else if(j >= par_idx.va_mean<true>() && j < par_idx.va_mean_end<true>())
+        dir[par_idx.va_mean<false>() + j - par_idx.va_mean<true>()] = 1;
+      else {
+        for(auto &block : vcov_blocks)
+          if(j >= block.idx_theta && j < block.idx_theta + dim_tri(block.dim))
+            block_j = &block;
+
+        std::fill(dir_theta, dir_theta + dim_tri(block_j->dim), 0);
+        dir_theta[j - block_j->idx_theta] = 1;
+        log_chol::d2pd_mat::dir
+          (p + block_j->idx_theta, block_j->dim, dir_theta,
+           dir + block_j->idx_full, inter_mem);
+      }
+
+      // compute the directional derivative of the gradient
+      std::fill(dir_gr, dir_gr + n_full, 0);
+      kl_dat.hess_vec(dir_gr, par_vec, dir, inter_mem);
+      m_dat.hess_vec_cluster
+        (par_vec, dir, dir_gr, inter_mem, marker_indices.data(),
+         marker_indices.data() + marker_indices.size());
+
+      if(with_surv)
+        for(auto &idx : surv_indices)
+          s_dat.hess_vec(par_vec, dir, dir_gr, inter_mem, idx[0], idx[1],
+                         *cur_quad_rule);
+
+      if(with_delayed){
+        ghqCpp::simple_mem_stack<double> &my_stack = wmem::mem_stack();
+        auto comp_diff = [&](double const h, double *diff){
+          auto comp_gr = [&](double const step, double *gr){
+            for(vajoint_uint i = 0; i < n_full; ++i)
+              par_vec_step[i] = par_vec[i] + step * dir[i];
+            std::fill(gr, gr + n_full, 0);
+            d_dat.grad(par_vec_step, gr, my_stack, delayed_entry_idx,
+                       *cur_quad_rule, *cur_gh_quad_rule);
+          };
+          comp_gr(h, gr_plus);
+          comp_gr(-h, gr_minus);
+
+          for(vajoint_uint i = 0; i < n_full; ++i)
+            diff[i] = gr_plus[i] - gr_minus[i];
+        };
+        richardson_diff
+          (comp_diff, n_full, p[j], eps, scale, tol, n_steps, diff_res,
+           diff_table);
+
+        for(vajoint_uint i = 0; i < n_full; ++i)
+          dir_gr[i] += diff_res[i];
+      }
+
+      // apply the chain rule
+      double * const hess_j{hess + j * n_ele_par};
+      std::fill(hess_j, hess_j + n_ele_par, 0);
+      std::copy(dir_gr, dir_gr + par_idx.vcov_start<false>(), hess_j);
+      std::copy(dir_gr + par_idx.va_mean<false>(),
+                dir_gr + par_idx.va_mean_end<false>(),
+                hess_j + par_idx.va_mean<true>());
+
+      for(auto &block : vcov_blocks)
+        log_chol::dpd_mat::get
+          (p + block.idx_theta, block.dim, hess_j + block.idx_theta,
+           dir_gr + block.idx_full, inter_mem);
+      if(block_j)
+        log_chol::d2pd_mat::get
+          (p + block_j->idx_theta, block_j->dim, dir_theta,
+           hess_j + block_j->idx_theta, par_vec_gr + block_j->idx_full,
+           inter_mem);
+    }
   }
 
   double func(double const *point, lower_bound_caller const &caller) const {
@@ -476,6 +925,20 @@ public:
     return nan_if_fail([&]{ return comp(point, gr, caller, true); });
   }
 
+  /// computes the Hessian (see comp_hess)
+  void hess
+    (double const * point, double * hess, lower_bound_caller const &caller,
+     double const eps, double const scale, double const tol,
+     unsigned const n_steps) const {
+    try {
+      comp_hess(point, hess, caller, eps, scale, tol, n_steps);
+    } catch(...) {
+      size_t const n_ele_par{n_global + n_private};
+      std::fill(hess, hess + n_ele_par * n_ele_par,
+                std::numeric_limits<double>::quiet_NaN());
+    }
+  }
+
   bool thread_safe() const {
     return true;
   }
@@ -513,11 +976,77 @@ void lower_bound_caller::setup(double const *val, bool const comp_grad){
     m_dat->setup(par_vec.data(), wmem);
     kl_dat->setup(par_vec.data(), wmem,
                   optimze_survival ? lb_terms::all : lb_terms::markers);
+
+    has_delayed_values = has_delayed_grads = false;
+    if(optimze_survival && delayed_indices.size() > 0){
+      setup_delayed(comp_grad);
+      has_delayed_values = true;
+      has_delayed_grads = comp_grad;
+    }
   } catch(...){
     setup_failed = true;
   }
 }
 
+void lower_bound_caller::setup_delayed(bool const comp_grad){
+  // the clusters are split into chunks which are integrated together with
+  // delayed_dat::eval_batch
+  size_t const n_clusters{delayed_indices.size()},
+           n_global_full{par_vec.size()},
+           n_threads_use{std::max<size_t>
+             (1, std::min<size_t>(n_threads, n_clusters))},
+              chunk_size{std::min<size_t>
+                (survival::delayed_dat::max_batch,
+                 (n_clusters + n_threads_use - 1) / n_threads_use)},
+                n_chunks{(n_clusters + chunk_size - 1) / chunk_size};
+
+  delayed_values.resize(d_dat->cluster_infos().size());
+  if(comp_grad)
+    delayed_grads.resize(d_dat->cluster_infos().size() * n_global_full);
+  std::exception_ptr failure;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads_use)
+#endif
+  {
+    ghqCpp::simple_mem_stack<double> &my_stack = wmem::mem_stack();
+    std::vector<double> res(chunk_size);
+    std::vector<double*> grs(chunk_size);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for(size_t chunk = 0; chunk < n_chunks; ++chunk){
+      vajoint_uint const * const indices
+        {delayed_indices.data() + chunk * chunk_size};
+      size_t const n_cur{std::min(chunk_size, n_clusters - chunk * chunk_size)};
+      if(comp_grad)
+        for(size_t i = 0; i < n_cur; ++i){
+          grs[i] = delayed_grads.data() + indices[i] * n_global_full;
+          std::fill(grs[i], grs[i] + n_global_full, 0);
+        }
+
+      try {
+        d_dat->eval_batch
+          (par_vec.data(), comp_grad ? grs.data() : nullptr, res.data(),
+           my_stack, indices, n_cur, *cur_quad_rule, *cur_gh_quad_rule);
+      } catch(...) {
+#ifdef _OPENMP
+#pragma omp critical(setup_delayed_failure)
+#endif
+        if(!failure)
+          failure = std::current_exception();
+      }
+
+      for(size_t i = 0; i < n_cur; ++i)
+        delayed_values[indices[i]] = res[i];
+    }
+  }
+
+  if(failure)
+    std::rethrow_exception(failure);
+}
+
 double lower_bound_caller::eval_func
   (lower_bound_term const &obj, double const * val){
   return obj.func(val, *this);
@@ -539,7 +1068,12 @@ lower_bound_caller::lower_bound_caller
   kl_dat
   {terms.size() == 0
     ? nullptr : const_cast<kl_term*>(&terms[0]->kl_dat)},
-  par_vec(par_idx->n_params<false>()) { }
+  par_vec(par_idx->n_params<false>()),
+  d_dat{terms.size() == 0 ? nullptr : &terms[0]->d_dat} {
+  for(auto term : terms)
+    if(term->has_delayed_entry)
+      delayed_indices.emplace_back(term->delayed_entry_idx);
+}
 
 /// psqn class to perform the optimization
 using lb_optim = PSQN::optimizer
@@ -557,11 +1091,51 @@ class problem_data {
   survival::survival_dat s_dat;
   kl_term kl_dat;
   survival::delayed_dat d_dat;
+  lower_bound_wmem_plan wmem_plan;
   std::unique_ptr<lb_optim> optim_obj;
 
+  /**
+   * the element functions may be ordered differently than the ids to balance
+   * the work between the threads. This changes the order of the private
+   * parameters in psqn. The i'th parameter in psqn is the par_order[i]'th
+   * parameter in the order of the ids and par_order_inv is the inverse
+   * permutation.
+   */
+  std::vector<size_t> par_order, par_order_inv;
+
+  /// the Gauss-Legendre rule for each piece when the intervals are split
+  std::vector<double> split_piece_nodes, split_piece_weights;
+
+  /**
+   * returns the index in the order of the ids of the cluster of the k'th
+   * element function in psqn
+   */
+  size_t cluster_index(size_t const k) const {
+    size_t const n_global{par_idx.n_params<true>()},
+                n_private{par_idx.n_va_params<true>()};
+    return (par_order[n_global + k * n_private] - n_global) / n_private;
+  }
+
+  /**
+   * returns an object to evaluate the element functions which is setup with
+   * the global parameters in val
+   */
+  lower_bound_caller setup_caller(double const *val){
+    auto const &ele_funcs = optim().get_ele_funcs();
+    std::vector<lower_bound_term const*> ele_ptrs;
+    ele_ptrs.reserve(ele_funcs.size());
+    for(auto &ele_func : ele_funcs)
+      ele_ptrs.emplace_back(&ele_func);
+
+    lower_bound_caller caller(ele_ptrs);
+    caller.setup(val, true);
+    return caller;
+  }
+
 public:
   problem_data(List markers, List survival_terms,
-               unsigned const max_threads, List delayed_terms) {
+               unsigned const max_threads, List delayed_terms,
+               bool const load_balance, List quad_rule, List gh_quad_rule) {
     // handle the markers
     std::vector<marker::setup_marker_dat_helper> input_dat;
     joint_bases::bases_vector bases_fix;
@@ -775,6 +1349,9 @@ public:
       (bases_fix_surv, bases_rng, d_fixef_design, d_fixef_design_varying_mats,
        d_rng_design_varying_mats, par_idx, delayed_cluster_obs, ders);
 
+    // compute the working memory that is needed by the element functions
+    wmem_plan = lower_bound_wmem_plan(par_idx, m_dat, s_dat, kl_dat);
+
     // create the object to use for optimization
     std::vector<lower_bound_term> ele_funcs;
     ele_funcs.reserve(dat_n_idx.id.size());
@@ -807,7 +1384,7 @@ public:
             cur_id = std::min(*s_indices[i], cur_id);
 
         // add the observation where the id does match
-        ele_funcs.emplace_back(par_idx, m_dat, s_dat, kl_dat, d_dat);
+        ele_funcs.emplace_back(par_idx, m_dat, s_dat, kl_dat, d_dat, wmem_plan);
         auto &ele_func = ele_funcs.back();
         while(id_marker != dat_n_idx.id.end() && *id_marker == cur_id)
           ele_func.add_marker_index
@@ -831,22 +1408,331 @@ public:
           ++delayed_idx;
         }
 
+        ele_func.finalize();
         ele_func.shrink_to_fit();
       }
     }
 
+    // order the element functions such that the threads finish at about the
+    // same time. psqn splits the element functions into contiguous blocks.
+    // The order is for max_threads threads and the passed quadrature rules
+    std::vector<size_t> ele_order(ele_funcs.size());
+    std::iota(ele_order.begin(), ele_order.end(), 0);
+    if(load_balance){
+      NumericVector const quad_nodes = quad_rule["node"],
+                            gh_nodes = gh_quad_rule["node"];
+      double const n_quad{static_cast<double>(quad_nodes.size())};
+
+      // the rule for the delayed entries is selected as in
+      // delayed_dat::apply_quadrature. Only the product rule is split between
+      // threads
+      size_t const n_vars{par_idx.n_shared() + par_idx.n_shared_surv()},
+                   qmc_points{gh_quad_rule_qmc_points(gh_quad_rule)},
+                 sparse_level{gh_quad_rule_sparse_level(gh_quad_rule)};
+      double n_gh_points
+        {std::pow(static_cast<double>(gh_nodes.size()),
+                  static_cast<double>(n_vars))};
+      unsigned nested_threads{gh_quad_rule_nested_threads(gh_quad_rule)};
+      if(qmc_points > 0 && n_vars >= gh_quad_rule_qmc_min_vars(gh_quad_rule)){
+        n_gh_points = static_cast<double>(qmc_points);
+        nested_threads = 1;
+      } else if(sparse_level > 0 && n_vars > 0){
+        n_gh_points = static_cast<double>
+          (ghqCpp::sparse_grid(n_vars, sparse_level).n_points());
+        nested_threads = 1;
+      }
+      size_t const nested_min_obs{gh_quad_rule_nested_min_obs(gh_quad_rule)};
+
+      std::vector<double> costs;
+      costs.reserve(ele_funcs.size());
+      for(auto &ele_func : ele_funcs)
+        costs.emplace_back(ele_func.cost
+          (n_quad, n_gh_points, std::max(nested_threads, 1U),
+           nested_min_obs));
+      ele_order = lpt_order(costs, max_threads);
+
+      std::vector<lower_bound_term> ele_funcs_ordered;
+      ele_funcs_ordered.reserve(ele_funcs.size());
+      for(size_t idx : ele_order)
+        ele_funcs_ordered.emplace_back(ele_funcs[idx]);
+      ele_funcs = std::move(ele_funcs_ordered);
+    }
+
+    {
+      size_t const n_global{par_idx.n_params<true>()},
+                  n_private{par_idx.n_va_params<true>()};
+      par_order.resize(n_global + n_private * ele_order.size());
+      std::iota(par_order.begin(), par_order.begin() + n_global, 0);
+      auto it = par_order.begin() + n_global;
+      for(size_t idx : ele_order)
+        for(size_t i = 0; i < n_private; ++i)
+          *it++ = n_global + idx * n_private + i;
+
+      par_order_inv.resize(par_order.size());
+      for(size_t i = 0; i < par_order.size(); ++i)
+        par_order_inv[par_order[i]] = i;
+    }
+
     ele_funcs.shrink_to_fit();
     optim_obj.reset(new lb_optim(ele_funcs, max_threads));
   }
 
+  /// permutes a parameter vector in the order of the ids to that of psqn
+  std::vector<double> to_psqn_order(double const *val) const {
+    std::vector<double> out(par_order.size());
+    for(size_t i = 0; i < out.size(); ++i)
+      out[i] = val[par_order[i]];
+    return out;
+  }
+
+  /// permutes a parameter vector in the order of psqn to that of the ids
+  void from_psqn_order(double const *val, double *out) const {
+    for(size_t i = 0; i < par_order.size(); ++i)
+      out[par_order[i]] = val[i];
+  }
+
+  /// returns the index in psqn of a parameter in the order of the ids
+  size_t psqn_index(size_t const idx) const {
+    return par_order_inv[idx];
+  }
+
   lb_optim & optim(){
     return *optim_obj;
   }
 
+  /**
+   * computes the element function of each cluster and the gradient of the
+   * element function w.r.t. the global parameters. That is, the Jacobian of
+   * the vector of the element functions. val is in the order of psqn. The
+   * results are in the order of the ids. The k'th column of the
+   * n_global x n_clusters matrix gr is for the k'th cluster and values has an
+   * element for each cluster.
+   */
+  void cluster_gr(double const *val, double *gr, double *values,
+                  unsigned const n_threads){
+    auto const &ele_funcs = optim().get_ele_funcs();
+    size_t const n_global{par_idx.n_params<true>()},
+                n_private{par_idx.n_va_params<true>()},
+                    n_ele{ele_funcs.size()};
+    lower_bound_caller caller{setup_caller(val)};
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+    {
+      std::vector<double> point(n_global + n_private),
+                        gr_point(n_global + n_private);
+      std::copy(val, val + n_global, point.begin());
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for(size_t k = 0; k < n_ele; ++k){
+        double const * const val_k{val + n_global + k * n_private};
+        std::copy(val_k, val_k + n_private, point.begin() + n_global);
+
+        size_t const idx{cluster_index(k)};
+        values[idx] = caller.eval_grad
+          (ele_funcs[k], point.data(), gr_point.data());
+        std::copy(gr_point.begin(), gr_point.begin() + n_global,
+                  gr + idx * n_global);
+      }
+    }
+  }
+
+  /**
+   * computes the Hessian in the order of the ids. val is in the order of psqn.
+   * The Hessian of each element function is computed in parallel with
+   * lower_bound_term::hess. The blocks with the private parameters are added
+   * directly to the sparse matrix and the blocks with only the global
+   * parameters are summed. The remaining arguments are only used for the
+   * central differences of the delayed entry terms.
+   */
+  Eigen::SparseMatrix<double> hess_sparse
+    (double const *val, double const eps, double const scale,
+     double const tol, unsigned const order, unsigned const n_threads){
+    auto const &ele_funcs = optim().get_ele_funcs();
+    size_t const n_global{par_idx.n_params<true>()},
+                n_private{par_idx.n_va_params<true>()},
+                    n_ele{ele_funcs.size()},
+                n_ele_par{n_global + n_private},
+                    n_par{par_order.size()};
+    unsigned const n_steps{std::max(order, 1u)};
+    lower_bound_caller caller{setup_caller(val)};
+
+    // the partial sums of each thread are stored and added in the order of
+    // the threads with a static schedule such that the result is the same in
+    // each call
+    unsigned const n_threads_use
+      {static_cast<unsigned>(std::max<size_t>
+        (1, std::min<size_t>(n_threads, n_ele)))};
+    std::vector<std::vector<Eigen::Triplet<double> > >
+      triplets_threads(n_threads_use);
+    std::vector<double> hess_global_threads
+      (n_threads_use * n_global * n_global, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads_use)
+#endif
+    {
+      std::vector<double> point(n_ele_par), hess_ele(n_ele_par * n_ele_par);
+      size_t const thread_num{static_cast<size_t>(get_thread_num())};
+      std::vector<Eigen::Triplet<double> > &triplets_thread
+        {triplets_threads[thread_num]};
+      double * const hess_global_thread
+        {hess_global_threads.data() + thread_num * n_global * n_global};
+      std::copy(val, val + n_global, point.begin());
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(size_t k = 0; k < n_ele; ++k){
+        double const * const val_k{val + n_global + k * n_private};
+        std::copy(val_k, val_k + n_private, point.begin() + n_global);
+        size_t const private_offset{n_global + cluster_index(k) * n_private};
+
+        ele_funcs[k].hess
+          (point.data(), hess_ele.data(), caller, eps, scale, tol, n_steps);
+
+        // the index in the full Hessian
+        auto full_idx = [&](size_t const i){
+          return i < n_global ? i : private_offset + i - n_global;
+        };
+
+        for(size_t j = 0; j < n_ele_par; ++j)
+          for(size_t i = 0; i < n_ele_par; ++i){
+            double const v
+              {(hess_ele[i + j * n_ele_par] + hess_ele[j + i * n_ele_par]) / 2};
+            if(i < n_global && j < n_global)
+              hess_global_thread[i + j * n_global] += v;
+            else
+              triplets_thread.emplace_back(full_idx(i), full_idx(j), v);
+          }
+      }
+    }
+
+    std::vector<Eigen::Triplet<double> > triplets;
+    std::vector<double> hess_global(n_global * n_global, 0);
+    for(unsigned t = 0; t < n_threads_use; ++t){
+      triplets.insert
+        (triplets.end(), triplets_threads[t].begin(),
+         triplets_threads[t].end());
+      double const * const hess_global_thread
+        {hess_global_threads.data() + t * n_global * n_global};
+      for(size_t i = 0; i < n_global * n_global; ++i)
+        hess_global[i] += hess_global_thread[i];
+    }
+
+    for(size_t j = 0; j < n_global; ++j)
+      for(size_t i = 0; i < n_global; ++i)
+        triplets.emplace_back(i, j, hess_global[i + j * n_global]);
+
+    Eigen::SparseMatrix<double> out(n_par, n_par);
+    out.setFromTriplets(triplets.begin(), triplets.end());
+    return out;
+  }
+
   /// sets the cached expansions for the survival terms
-  void set_cached_expansions(survival::node_weight const &nws){
-    s_dat.set_cached_expansions(nws);
-    d_dat.set_cached_expansions(nws, wmem::mem_stack());
+  void set_cached_expansions
+    (survival::node_weight const &nws, double const node_selection_tol,
+     bool const as_float, unsigned const n_threads){
+    s_dat.set_cached_expansions
+      (nws, node_selection_tol, as_float, n_threads);
+    d_dat.set_cached_expansions
+      (nws, wmem::mem_stack(), as_float, n_threads);
+  }
+
+  /**
+   * sets lazy caches with at most max_bytes bytes for the survival terms. The
+   * delayed entry terms are not cached.
+   */
+  void set_lazy_cache
+    (survival::node_weight const &nws, size_t const max_bytes,
+     unsigned const n_threads){
+    s_dat.set_lazy_cache(nws, max_bytes, n_threads);
+    d_dat.clear_cached_expansions();
+  }
+
+  /**
+   * returns the number of hits, the number of misses, and the number of bytes
+   * used by the lazy caches
+   */
+  std::array<size_t, 3> lazy_cache_stats() const {
+    return s_dat.lazy_cache_stats();
+  }
+
+  /**
+   * splits the intervals in the survival terms at the knots of the bases and
+   * applies a Gauss-Legendre rule with n_piece_nodes to each piece. If
+   * n_piece_nodes is zero then the number of nodes of nws is divided by the
+   * mean number of pieces such that the total number of nodes is about the
+   * same as without splitting. Returns the rule for the pieces which is
+   * valid until the next call.
+   */
+  survival::node_weight set_split_rules
+    (survival::node_weight const &nws, unsigned n_piece_nodes){
+    if(n_piece_nodes == 0)
+      n_piece_nodes = std::max<unsigned>
+        (2, std::ceil(nws.n_nodes / s_dat.mean_n_pieces()));
+
+    if(split_piece_nodes.size() != n_piece_nodes){
+      split_piece_nodes.resize(n_piece_nodes);
+      split_piece_weights.resize(n_piece_nodes);
+      survival::gauss_legendre_rule
+        (n_piece_nodes, split_piece_nodes.data(), split_piece_weights.data());
+    }
+
+    survival::node_weight const piece_rule
+      {split_piece_nodes.data(), split_piece_weights.data(), n_piece_nodes};
+    s_dat.set_split_rules(piece_rule);
+    d_dat.set_split_at_knots(true);
+    // the composite rules need working memory
+    wmem_plan = lower_bound_wmem_plan(par_idx, m_dat, s_dat, kl_dat);
+    return piece_rule;
+  }
+
+  /**
+   * sets whether warm starts are used for the adaptive quadrature in the
+   * delayed entry terms
+   */
+  void set_warm_start(bool const use, double const tol){
+    d_dat.set_warm_start(use, tol);
+  }
+
+  /**
+   * sets the level of the sparse grids used in the delayed entry terms. Zero
+   * implies that the product rules are used
+   */
+  void set_sparse_grid(size_t const level){
+    d_dat.set_sparse_grid(level);
+  }
+
+  /**
+   * sets the number of points of the randomized quasi-Monte Carlo method used
+   * in the delayed entry terms with at least min_vars random effects
+   */
+  void set_rqmc(size_t const n_points, size_t const min_vars){
+    d_dat.set_rqmc(n_points, min_vars);
+  }
+
+  /**
+   * sets the number of threads used in the delayed entry terms of the
+   * clusters with at least min_obs delayed entries
+   */
+  void set_nested_threads(unsigned const n_threads, size_t const min_obs){
+    d_dat.set_nested_threads(n_threads, min_obs);
+  }
+
+  /// returns the number of threads used in the delayed entry terms
+  unsigned nested_threads() const {
+    return d_dat.nested_threads();
+  }
+
+  /// uses one quadrature rule for each interval in the survival terms
+  void clear_split_rules(){
+    s_dat.clear_split_rules();
+    d_dat.set_split_at_knots(false);
+    wmem_plan = lower_bound_wmem_plan(par_idx, m_dat, s_dat, kl_dat);
   }
 
   /***
@@ -881,6 +1767,7 @@ public:
   void set_n_threads(unsigned const n_threads){
     optim().set_n_threads(n_threads);
     wmem::setup_working_memory(n_threads);
+    lower_bound_caller::n_threads = n_threads;
     set_num_tapes(n_threads);
   }
 };
@@ -890,10 +1777,49 @@ inline void check_par_length(problem_data const &obj, NumericVector par){
     throw std::invalid_argument("invalid parameter size");
 }
 
+/**
+ * sets the options for the delayed entry terms in the gh_quad_rule list. The
+ * caller has to keep a nested_parallel_scope while the lower bound is
+ * evaluated if there are nested threads.
+ */
+inline void set_delayed_options(problem_data &dat, List gh_quad_rule){
+  dat.set_warm_start
+    (gh_quad_rule_warm_start(gh_quad_rule),
+     gh_quad_rule_warm_start_tol(gh_quad_rule));
+  dat.set_sparse_grid(gh_quad_rule_sparse_level(gh_quad_rule));
+  dat.set_rqmc
+    (gh_quad_rule_qmc_points(gh_quad_rule),
+     gh_quad_rule_qmc_min_vars(gh_quad_rule));
+  dat.set_nested_threads
+    (gh_quad_rule_nested_threads(gh_quad_rule),
+     gh_quad_rule_nested_min_obs(gh_quad_rule));
+}
+
+/**
+ * sets the split rules and the cached expansions or clears them. nws is
+ * replaced by the rule for each piece if the intervals are split.
+ */
 inline void set_or_clear_cached_expansions
-  (problem_data &dat, survival::node_weight const &nws, bool const do_set){
-  if(do_set)
-    dat.set_cached_expansions(nws);
+  (problem_data &dat, survival::node_weight &nws, List quad_rule,
+   bool const do_set, unsigned const n_threads){
+  if(quad_rule_split_at_knots(quad_rule))
+    nws = dat.set_split_rules(nws, quad_rule_split_n_nodes(quad_rule));
+  else
+    dat.clear_split_rules();
+
+  size_t const max_bytes{quad_rule_cache_max_bytes(quad_rule)};
+  if(do_set && max_bytes > 0){
+    if(quad_rule_node_selection_tol(quad_rule) > 0 ||
+         quad_rule_cache_as_float(quad_rule))
+      throw std::invalid_argument
+        ("node_selection_tol and cache_as_float cannot be used with "
+         "cache_max_bytes");
+    dat.set_lazy_cache(nws, max_bytes, n_threads);
+  }
+  else if(do_set)
+    dat.set_cached_expansions
+      (nws, quad_rule_node_selection_tol(quad_rule),
+       quad_rule_cache_as_float(quad_rule), n_threads);
   else
     dat.clear_cached_expansions();
 }
@@ -902,11 +1828,13 @@ inline void set_or_clear_cached_expansions
 // [[Rcpp::export(".joint_ms_ptr", rng = false)]]
 SEXP joint_ms_ptr
   (List markers, List survival_terms, unsigned const max_threads,
-   List delayed_terms){
+   List delayed_terms, bool const load_balance, List quad_rule,
+   List gh_quad_rule){
   profiler pp(".joint_ms_ptr");
 
   return Rcpp::XPtr<problem_data>
-    (new problem_data(markers, survival_terms, max_threads, delayed_terms));
+    (new problem_data(markers, survival_terms, max_threads, delayed_terms,
+                      load_balance, quad_rule, gh_quad_rule));
 }
 
 /// returns the number of lower bound terms of different types
@@ -926,6 +1854,19 @@ List joint_ms_n_terms(SEXP ptr){
     Rcpp::_("Number of clusters") = obj->optim().get_ele_funcs().size());
 }
 
+/// returns the number of hits and misses of the lazy caches of the expansions
+// [[Rcpp::export(".joint_ms_cache_stats", rng = false)]]
+NumericVector joint_ms_cache_stats(SEXP ptr){
+  Rcpp::XPtr<problem_data> obj(ptr);
+
+  auto const stats = obj->lazy_cache_stats();
+  NumericVector out = NumericVector::create
+    (static_cast<double>(stats[0]), static_cast<double>(stats[1]),
+     static_cast<double>(stats[2]));
+  out.names() = Rcpp::CharacterVector::create("hits", "misses", "bytes");
+  return out;
+}
+
 /// evaluates the lower bound
 // [[Rcpp::export(rng = false)]]
 double joint_ms_eval_lb
@@ -940,10 +1881,14 @@ double joint_ms_eval_lb
   cur_quad_rule = &quad_rule_use;
   ghqCpp::ghq_data gh_quad_rule_use{gh_node_weight_from_list(gh_quad_rule)};
   cur_gh_quad_rule = &gh_quad_rule_use;
+  set_delayed_options(*obj, gh_quad_rule);
+  nested_parallel_scope const nested_scope{obj->nested_threads() > 1};
 
-  set_or_clear_cached_expansions(*obj, quad_rule_use, cache_expansions);
+  set_or_clear_cached_expansions
+    (*obj, quad_rule_use, quad_rule, cache_expansions, n_threads);
   obj->set_n_threads(n_threads);
-  double const out{obj->optim().eval(&val[0], nullptr, false)};
+  std::vector<double> const val_psqn{obj->to_psqn_order(&val[0])};
+  double const out{obj->optim().eval(val_psqn.data(), nullptr, false)};
   wmem::rewind_all();
 
   return out;
@@ -963,12 +1908,51 @@ NumericVector joint_ms_eval_lb_gr
   cur_quad_rule = &quad_rule_use;
   ghqCpp::ghq_data gh_quad_rule_use{gh_node_weight_from_list(gh_quad_rule)};
   cur_gh_quad_rule = &gh_quad_rule_use;
+  set_delayed_options(*obj, gh_quad_rule);
+  nested_parallel_scope const nested_scope{obj->nested_threads() > 1};
 
-  set_or_clear_cached_expansions(*obj, quad_rule_use, cache_expansions);
+  set_or_clear_cached_expansions
+    (*obj, quad_rule_use, quad_rule, cache_expansions, n_threads);
 
   NumericVector grad(val.size());
   obj->set_n_threads(n_threads);
-  grad.attr("value") = obj->optim().eval(&val[0], &grad[0], true);
+  std::vector<double> const val_psqn{obj->to_psqn_order(&val[0])};
+  std::vector<double> grad_psqn(val.size());
+  grad.attr("value") =
+    obj->optim().eval(val_psqn.data(), grad_psqn.data(), true);
+  obj->from_psqn_order(grad_psqn.data(), &grad[0]);
+  wmem::rewind_all();
+
+  return grad;
+}
+
+/// computes the gradient of each cluster's term w.r.t. the global parameters
+// [[Rcpp::export(rng = false)]]
+NumericMatrix joint_ms_eval_lb_cluster_gr
+  (NumericVector val, SEXP ptr, unsigned const n_threads, List quad_rule,
+   bool const cache_expansions, List gh_quad_rule){
+  profiler pp("joint_ms_eval_lb_cluster_gr");
+
+  Rcpp::XPtr<problem_data> obj(ptr);
+  check_par_length(*obj, val);
+
+  survival::node_weight quad_rule_use{node_weight_from_list(quad_rule)};
+  cur_quad_rule = &quad_rule_use;
+  ghqCpp::ghq_data gh_quad_rule_use{gh_node_weight_from_list(gh_quad_rule)};
+  cur_gh_quad_rule = &gh_quad_rule_use;
+  set_delayed_options(*obj, gh_quad_rule);
+  nested_parallel_scope const nested_scope{obj->nested_threads() > 1};
+
+  set_or_clear_cached_expansions
+    (*obj, quad_rule_use, quad_rule, cache_expansions, n_threads);
+
+  size_t const n_clusters{obj->optim().get_ele_funcs().size()};
+  NumericMatrix grad(obj->params().n_params<true>(), n_clusters);
+  NumericVector values(n_clusters);
+  obj->set_n_threads(n_threads);
+  std::vector<double> const val_psqn{obj->to_psqn_order(&val[0])};
+  obj->cluster_gr(val_psqn.data(), &grad[0], &values[0], n_threads);
+  grad.attr("value") = values;
   wmem::rewind_all();
 
   return grad;
@@ -979,7 +1963,9 @@ NumericVector joint_ms_eval_lb_gr
 Eigen::SparseMatrix<double> joint_ms_hess
   (NumericVector val, SEXP ptr,  List quad_rule, bool const cache_expansions,
    double const eps, double const scale, double const tol,
-   unsigned const order, List gh_quad_rule){
+   unsigned const order, List gh_quad_rule, unsigned const n_threads){
+  profiler pp("joint_ms_hess");
+
   Rcpp::XPtr<problem_data> obj(ptr);
   check_par_length(*obj, val);
 
@@ -987,10 +1973,19 @@ Eigen::SparseMatrix<double> joint_ms_hess
   cur_quad_rule = &quad_rule_use;
   ghqCpp::ghq_data gh_quad_rule_use{gh_node_weight_from_list(gh_quad_rule)};
   cur_gh_quad_rule = &gh_quad_rule_use;
+  set_delayed_options(*obj, gh_quad_rule);
+  nested_parallel_scope const nested_scope{obj->nested_threads() > 1};
+
+  set_or_clear_cached_expansions
+    (*obj, quad_rule_use, quad_rule, cache_expansions, n_threads);
 
-  set_or_clear_cached_expansions(*obj, quad_rule_use, cache_expansions);
+  obj->set_n_threads(n_threads);
+  std::vector<double> const val_psqn{obj->to_psqn_order(&val[0])};
+  Eigen::SparseMatrix<double> out
+    {obj->hess_sparse(val_psqn.data(), eps, scale, tol, order, n_threads)};
+  wmem::rewind_all();
 
-  return obj->optim().true_hess_sparse(&val[0], eps, scale, tol, order);
+  return out;
 }
 
 /// returns the names of the parameters
@@ -1114,13 +2109,18 @@ NumericVector opt_priv
   cur_quad_rule = &quad_rule_use;
   ghqCpp::ghq_data gh_quad_rule_use{gh_node_weight_from_list(gh_quad_rule)};
   cur_gh_quad_rule = &gh_quad_rule_use;
+  set_delayed_options(*obj, gh_quad_rule);
+  nested_parallel_scope const nested_scope{obj->nested_threads() > 1};
 
-  set_or_clear_cached_expansions(*obj, quad_rule_use, cache_expansions);
+  set_or_clear_cached_expansions
+    (*obj, quad_rule_use, quad_rule, cache_expansions, n_threads);
 
   NumericVector par = clone(val);
   obj->set_n_threads(n_threads);
+  std::vector<double> par_psqn{obj->to_psqn_order(&val[0])};
   double const res = obj->optim().
-    optim_priv(&par[0], rel_eps, max_it, c1, c2, gr_tol);
+    optim_priv(par_psqn.data(), rel_eps, max_it, c1, c2, gr_tol);
+  obj->from_psqn_order(par_psqn.data(), &par[0]);
   par.attr("value") = res;
   wmem::rewind_all();
 
@@ -1147,7 +2147,13 @@ List joint_ms_opt_lb
   Rcpp::XPtr<problem_data> obj(ptr);
   check_par_length(*obj, val);
 
-  obj->optim().set_masked(mask.begin(), mask.end());
+  {
+    std::vector<size_t> mask_psqn;
+    mask_psqn.reserve(mask.size());
+    for(int idx : mask)
+      mask_psqn.emplace_back(obj->psqn_index(idx));
+    obj->optim().set_masked(mask_psqn.begin(), mask_psqn.end());
+  }
   struct clear_masked {
     problem_data &dat;
     clear_masked(problem_data &dat): dat{dat} { }
@@ -1158,15 +2164,20 @@ List joint_ms_opt_lb
   cur_quad_rule = &quad_rule_use;
   ghqCpp::ghq_data gh_quad_rule_use{gh_node_weight_from_list(gh_quad_rule)};
   cur_gh_quad_rule = &gh_quad_rule_use;
+  set_delayed_options(*obj, gh_quad_rule);
+  nested_parallel_scope const nested_scope{obj->nested_threads() > 1};
 
-  set_or_clear_cached_expansions(*obj, quad_rule_use, cache_expansions);
+  set_or_clear_cached_expansions
+    (*obj, quad_rule_use, quad_rule, cache_expansions, n_threads);
 
   NumericVector par = clone(val);
   obj->set_n_threads(n_threads);
-  auto res = obj->optim().optim(&par[0], rel_eps, max_it, c1, c2,
+  std::vector<double> par_psqn{obj->to_psqn_order(&val[0])};
+  auto res = obj->optim().optim(par_psqn.data(), rel_eps, max_it, c1, c2,
                                 use_bfgs, trace, cg_tol, strong_wolfe, max_cg,
                                 static_cast<PSQN::precondition>(pre_method),
                                 gr_tol);
+  obj->from_psqn_order(par_psqn.data(), &par[0]);
 
   NumericVector counts = NumericVector::create(
     res.n_eval, res.n_grad,  res.n_cg);
@@ -1367,3 +2378,73 @@ NumericVector ph_grad
     comp_obj->gr(&par[0], &out[0], node_weight_from_list(quad_rule), va_var);
   return out;
 }
+
+/**
+ * sets whether the AD tape keeps its memory when it is cleared such that the
+ * memory is not returned to the allocator between gradient evaluations. The
+ * memory is freed when the arena mode is turned off. The peak number of bytes
+ * of all the tapes is reset.
+ */
+// [[Rcpp::export(".set_tape_arena", rng = false)]]
+void set_tape_arena(bool const use){
+  cfaad::Number::tape->resetPeakBytes();
+  cfaad::Number::tape->setArena(use);
+  for(auto &tape : number_tapes){
+    tape.resetPeakBytes();
+    tape.setArena(use);
+  }
+}
+
+/**
+ * returns the peak number of bytes used by a recording on the AD tape since
+ * the arena mode was set and the number of bytes allocated by the tape
+ */
+// [[Rcpp::export(".tape_stats", rng = false)]]
+NumericVector tape_stats(){
+  cfaad::Tape &tape = *cfaad::Number::tape;
+  NumericVector out = NumericVector::create
+    (static_cast<double>(tape.peakBytes()),
+     static_cast<double>(tape.allocatedBytes()));
+  out.names() = Rcpp::CharacterVector::create("peak", "allocated");
+  return out;
+}
+
+/**
+ * approximates the expected survival term
+ *
+ *   E(exp(-sum_i ws[i] exp(eta[i] + M[i, ] U))), U ~ N(0, Sigma)
+ *
+ * with the adaptive Gauss-Hermite quadrature and possibly the gradient. It is
+ * used to benchmark the integrand.
+ */
+// [[Rcpp::export(".expected_survival_ghq", rng = false)]]
+NumericVector expected_survival_ghq
+  (NumericVector eta, NumericVector ws, NumericMatrix M, NumericMatrix Sigma,
+   List gh_quad_rule, bool const gradient, unsigned const target_size){
+  if(eta.size() != ws.size() || eta.size() != M.nrow())
+    throw std::invalid_argument("invalid eta, ws, or M");
+  else if(Sigma.nrow() != M.ncol() || Sigma.ncol() != M.ncol())
+    throw std::invalid_argument("invalid Sigma");
+
+  arma::vec const eta_vec(&eta[0], eta.size()),
+                   ws_vec(&ws[0], ws.size());
+  arma::mat const M_mat(&M[0], M.nrow(), M.ncol()),
+              Sigma_mat(&Sigma[0], Sigma.nrow(), Sigma.ncol());
+  ghqCpp::ghq_data const ghq_dat{gh_node_weight_from_list(gh_quad_rule)};
+  ghqCpp::simple_mem_stack<double> mem;
+
+  auto run = [&](auto const &surv_term){
+    ghqCpp::adaptive_problem prob(surv_term, mem);
+    NumericVector out(prob.n_out());
+    ghqCpp::ghq(&out[0], ghq_dat, prob, mem, target_size);
+    return out;
+  };
+
+  if(gradient){
+    ghqCpp::expected_survival_term<true> surv_term(eta_vec, ws_vec, M_mat);
+    return run(ghqCpp::rescale_problem<true>(Sigma_mat, surv_term));
+  }
+
+  ghqCpp::expected_survival_term<false> surv_term(eta_vec, ws_vec, M_mat);
+  return run(ghqCpp::rescale_problem<false>(Sigma_mat, surv_term));
+}
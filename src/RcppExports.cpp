@@ -38,15 +38,18 @@ BEGIN_RCPP
 END_RCPP
 }
 // joint_ms_ptr
-SEXP joint_ms_ptr(List markers, List survival_terms, unsigned const max_threads, List delayed_terms);
-RcppExport SEXP _VAJointSurv_joint_ms_ptr(SEXP markersSEXP, SEXP survival_termsSEXP, SEXP max_threadsSEXP, SEXP delayed_termsSEXP) {
+SEXP joint_ms_ptr(List markers, List survival_terms, unsigned const max_threads, List delayed_terms, bool const load_balance, List quad_rule, List gh_quad_rule);
+RcppExport SEXP _VAJointSurv_joint_ms_ptr(SEXP markersSEXP, SEXP survival_termsSEXP, SEXP max_threadsSEXP, SEXP delayed_termsSEXP, SEXP load_balanceSEXP, SEXP quad_ruleSEXP, SEXP gh_quad_ruleSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::traits::input_parameter< List >::type markers(markersSEXP);
     Rcpp::traits::input_parameter< List >::type survival_terms(survival_termsSEXP);
     Rcpp::traits::input_parameter< unsigned const >::type max_threads(max_threadsSEXP);
     Rcpp::traits::input_parameter< List >::type delayed_terms(delayed_termsSEXP);
-    rcpp_result_gen = Rcpp::wrap(joint_ms_ptr(markers, survival_terms, max_threads, delayed_terms));
+    Rcpp::traits::input_parameter< bool const >::type load_balance(load_balanceSEXP);
+    Rcpp::traits::input_parameter< List >::type quad_rule(quad_ruleSEXP);
+    Rcpp::traits::input_parameter< List >::type gh_quad_rule(gh_quad_ruleSEXP);
+    rcpp_result_gen = Rcpp::wrap(joint_ms_ptr(markers, survival_terms, max_threads, delayed_terms, load_balance, quad_rule, gh_quad_rule));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -60,6 +63,16 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// joint_ms_cache_stats
+NumericVector joint_ms_cache_stats(SEXP ptr);
+RcppExport SEXP _VAJointSurv_joint_ms_cache_stats(SEXP ptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type ptr(ptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(joint_ms_cache_stats(ptr));
+    return rcpp_result_gen;
+END_RCPP
+}
 // joint_ms_eval_lb
 double joint_ms_eval_lb(NumericVector val, SEXP ptr, unsigned const n_threads, List quad_rule, bool const cache_expansions, List gh_quad_rule);
 RcppExport SEXP _VAJointSurv_joint_ms_eval_lb(SEXP valSEXP, SEXP ptrSEXP, SEXP n_threadsSEXP, SEXP quad_ruleSEXP, SEXP cache_expansionsSEXP, SEXP gh_quad_ruleSEXP) {
@@ -90,9 +103,24 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// joint_ms_eval_lb_cluster_gr
+NumericMatrix joint_ms_eval_lb_cluster_gr(NumericVector val, SEXP ptr, unsigned const n_threads, List quad_rule, bool const cache_expansions, List gh_quad_rule);
+RcppExport SEXP _VAJointSurv_joint_ms_eval_lb_cluster_gr(SEXP valSEXP, SEXP ptrSEXP, SEXP n_threadsSEXP, SEXP quad_ruleSEXP, SEXP cache_expansionsSEXP, SEXP gh_quad_ruleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type val(valSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type ptr(ptrSEXP);
+    Rcpp::traits::input_parameter< unsigned const >::type n_threads(n_threadsSEXP);
+    Rcpp::traits::input_parameter< List >::type quad_rule(quad_ruleSEXP);
+    Rcpp::traits::input_parameter< bool const >::type cache_expansions(cache_expansionsSEXP);
+    Rcpp::traits::input_parameter< List >::type gh_quad_rule(gh_quad_ruleSEXP);
+    rcpp_result_gen = Rcpp::wrap(joint_ms_eval_lb_cluster_gr(val, ptr, n_threads, quad_rule, cache_expansions, gh_quad_rule));
+    return rcpp_result_gen;
+END_RCPP
+}
 // joint_ms_hess
-Eigen::SparseMatrix<double> joint_ms_hess(NumericVector val, SEXP ptr, List quad_rule, bool const cache_expansions, double const eps, double const scale, double const tol, unsigned const order, List gh_quad_rule);
-RcppExport SEXP _VAJointSurv_joint_ms_hess(SEXP valSEXP, SEXP ptrSEXP, SEXP quad_ruleSEXP, SEXP cache_expansionsSEXP, SEXP epsSEXP, SEXP scaleSEXP, SEXP tolSEXP, SEXP orderSEXP, SEXP gh_quad_ruleSEXP) {
+Eigen::SparseMatrix<double> joint_ms_hess(NumericVector val, SEXP ptr, List quad_rule, bool const cache_expansions, double const eps, double const scale, double const tol, unsigned const order, List gh_quad_rule, unsigned const n_threads);
+RcppExport SEXP _VAJointSurv_joint_ms_hess(SEXP valSEXP, SEXP ptrSEXP, SEXP quad_ruleSEXP, SEXP cache_expansionsSEXP, SEXP epsSEXP, SEXP scaleSEXP, SEXP tolSEXP, SEXP orderSEXP, SEXP gh_quad_ruleSEXP, SEXP n_threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::traits::input_parameter< NumericVector >::type val(valSEXP);
@@ -104,7 +132,8 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< double const >::type tol(tolSEXP);
     Rcpp::traits::input_parameter< unsigned const >::type order(orderSEXP);
     Rcpp::traits::input_parameter< List >::type gh_quad_rule(gh_quad_ruleSEXP);
-    rcpp_result_gen = Rcpp::wrap(joint_ms_hess(val, ptr, quad_rule, cache_expansions, eps, scale, tol, order, gh_quad_rule));
+    Rcpp::traits::input_parameter< unsigned const >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(joint_ms_hess(val, ptr, quad_rule, cache_expansions, eps, scale, tol, order, gh_quad_rule, n_threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -227,17 +256,53 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// set_tape_arena
+void set_tape_arena(bool const use);
+RcppExport SEXP _VAJointSurv_set_tape_arena(SEXP useSEXP) {
+BEGIN_RCPP
+    Rcpp::traits::input_parameter< bool const >::type use(useSEXP);
+    set_tape_arena(use);
+    return R_NilValue;
+END_RCPP
+}
+// tape_stats
+NumericVector tape_stats();
+RcppExport SEXP _VAJointSurv_tape_stats() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    rcpp_result_gen = Rcpp::wrap(tape_stats());
+    return rcpp_result_gen;
+END_RCPP
+}
+// expected_survival_ghq
+NumericVector expected_survival_ghq(NumericVector eta, NumericVector ws, NumericMatrix M, NumericMatrix Sigma, List gh_quad_rule, bool const gradient, unsigned const target_size);
+RcppExport SEXP _VAJointSurv_expected_survival_ghq(SEXP etaSEXP, SEXP wsSEXP, SEXP MSEXP, SEXP SigmaSEXP, SEXP gh_quad_ruleSEXP, SEXP gradientSEXP, SEXP target_sizeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type ws(wsSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type M(MSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type Sigma(SigmaSEXP);
+    Rcpp::traits::input_parameter< List >::type gh_quad_rule(gh_quad_ruleSEXP);
+    Rcpp::traits::input_parameter< bool const >::type gradient(gradientSEXP);
+    Rcpp::traits::input_parameter< unsigned const >::type target_size(target_sizeSEXP);
+    rcpp_result_gen = Rcpp::wrap(expected_survival_ghq(eta, ws, M, Sigma, gh_quad_rule, gradient, target_size));
+    return rcpp_result_gen;
+END_RCPP
+}
 
 RcppExport SEXP run_testthat_tests(SEXP);
 
 static const R_CallMethodDef CallEntries[] = {
     {"_VAJointSurv_expansion_object", (DL_FUNC) &_VAJointSurv_expansion_object, 1},
     {"_VAJointSurv_eval_expansion", (DL_FUNC) &_VAJointSurv_eval_expansion, 5},
-    {"_VAJointSurv_joint_ms_ptr", (DL_FUNC) &_VAJointSurv_joint_ms_ptr, 4},
+    {"_VAJointSurv_joint_ms_ptr", (DL_FUNC) &_VAJointSurv_joint_ms_ptr, 7},
     {"_VAJointSurv_joint_ms_n_terms", (DL_FUNC) &_VAJointSurv_joint_ms_n_terms, 1},
+    {"_VAJointSurv_joint_ms_cache_stats", (DL_FUNC) &_VAJointSurv_joint_ms_cache_stats, 1},
     {"_VAJointSurv_joint_ms_eval_lb", (DL_FUNC) &_VAJointSurv_joint_ms_eval_lb, 6},
     {"_VAJointSurv_joint_ms_eval_lb_gr", (DL_FUNC) &_VAJointSurv_joint_ms_eval_lb_gr, 6},
-    {"_VAJointSurv_joint_ms_hess", (DL_FUNC) &_VAJointSurv_joint_ms_hess, 9},
+    {"_VAJointSurv_joint_ms_eval_lb_cluster_gr", (DL_FUNC) &_VAJointSurv_joint_ms_eval_lb_cluster_gr, 6},
+    {"_VAJointSurv_joint_ms_hess", (DL_FUNC) &_VAJointSurv_joint_ms_hess, 10},
     {"_VAJointSurv_joint_ms_parameter_names", (DL_FUNC) &_VAJointSurv_joint_ms_parameter_names, 1},
     {"_VAJointSurv_joint_ms_parameter_indices", (DL_FUNC) &_VAJointSurv_joint_ms_parameter_indices, 1},
     {"_VAJointSurv_joint_ms_n_params", (DL_FUNC) &_VAJointSurv_joint_ms_n_params, 1},
@@ -246,6 +311,9 @@ static const R_CallMethodDef CallEntries[] = {
     {"_VAJointSurv_ph_ll", (DL_FUNC) &_VAJointSurv_ph_ll, 6},
     {"_VAJointSurv_ph_eval", (DL_FUNC) &_VAJointSurv_ph_eval, 4},
     {"_VAJointSurv_ph_grad", (DL_FUNC) &_VAJointSurv_ph_grad, 4},
+    {"_VAJointSurv_set_tape_arena", (DL_FUNC) &_VAJointSurv_set_tape_arena, 1},
+    {"_VAJointSurv_tape_stats", (DL_FUNC) &_VAJointSurv_tape_stats, 0},
+    {"_VAJointSurv_expected_survival_ghq", (DL_FUNC) &_VAJointSurv_expected_survival_ghq, 7},
     {"run_testthat_tests", (DL_FUNC) &run_testthat_tests, 1},
     {NULL, NULL, 0}
 };
@@ -17,6 +17,34 @@ inline int get_thread_num() noexcept {
 #endif
 }
 
+/**
+ * allows for one level of nested parallel regions while the object is alive
+ * if enable is true. The previous maximum number of active levels is restored
+ * by the destructor.
+ */
+class nested_parallel_scope {
+#ifdef _OPENMP
+  int const max_active_levels_org{omp_get_max_active_levels()};
+#endif
+
+public:
+  nested_parallel_scope(bool const enable){
+#ifdef _OPENMP
+    if(enable && max_active_levels_org < 2)
+      omp_set_max_active_levels(2);
+#endif
+  }
+
+  ~nested_parallel_scope(){
+#ifdef _OPENMP
+    omp_set_max_active_levels(max_active_levels_org);
+#endif
+  }
+
+  nested_parallel_scope(nested_parallel_scope const &) = delete;
+  nested_parallel_scope& operator=(nested_parallel_scope const &) = delete;
+};
+
 /// returns the number of non-zero elements of a triangular matrix
 template<class T>
 constexpr T dim_tri(T const x){
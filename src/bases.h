@@ -88,6 +88,13 @@ public:
       lower_limit = x;
   }
 
+  /**
+   * appends the points on the original time scale at which the basis
+   * functions or their derivatives may not be smooth (e.g. the knots of a
+   * spline). The points need not be sorted or unique.
+   */
+  virtual void break_points(std::vector<double> &out) const { }
+
   basisMixin(bool const use_log = default_use_log):
     use_log{use_log} {
       set_lower_limit(use_log ? std::numeric_limits<double>::epsilon() : 0);
@@ -102,6 +109,12 @@ protected:
 
 using bases_vector = std::vector<std::unique_ptr<basisMixin> >;
 
+/// sorts the break points and removes duplicates
+inline void sort_unique_break_points(std::vector<double> &x){
+  std::sort(x.begin(), x.end());
+  x.erase(std::unique(x.begin(), x.end()), x.end());
+}
+
 /// simple function clone bases
 inline bases_vector clone_bases(const bases_vector &bases){
   std::vector<std::unique_ptr<basisMixin> > out;
@@ -168,6 +181,11 @@ public:
        [&](std::unique_ptr<basisMixin> &bas) { bas->set_lower_limit(x); });
   }
 
+  void break_points(std::vector<double> &out) const override {
+    for(auto &bas : my_basis)
+      bas->break_points(out);
+  }
+
   void operator()
     (double *out, double *wk_mem, double const x, double const *weights,
      int const ders = default_ders) const{
@@ -342,6 +360,12 @@ public:
     return ncoef;
   }
 
+  void break_points(std::vector<double> &out) const override {
+    for(vajoint_uint i = 0; i < knots.n_elem; ++i)
+      if(i == 0 || knots[i] != knots[i - 1])
+        out.emplace_back(use_log ? std::exp(knots[i]) : knots[i]);
+  }
+
   size_t n_wmem() const override {
     return n_wmem_v;
   }
@@ -734,6 +758,14 @@ public:
     s_basis.set_lower_limit(x);
   }
 
+  void break_points(std::vector<double> &out) const override {
+    size_t const n_old{out.size()};
+    s_basis.break_points(out);
+    if(use_log)
+      for(size_t i = n_old; i < out.size(); ++i)
+        out[i] = std::exp(out[i]);
+  }
+
   using basisMixin::operator();
 
   void operator()
@@ -791,6 +823,10 @@ public:
     bspline.set_lower_limit(x);
   }
 
+  void break_points(std::vector<double> &out) const override {
+    bspline.break_points(out);
+  }
+
   using basisMixin::operator();
   void operator()
     (double *out, double *wk_mem, double const x, double const *,
@@ -866,6 +902,10 @@ public:
     bspline.set_lower_limit(x);
   }
 
+  void break_points(std::vector<double> &out) const override {
+    bspline.break_points(out);
+  }
+
   using basisMixin::operator();
   void operator()
     (double *out, double *wk_mem, double const x, double const *,
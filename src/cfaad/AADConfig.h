@@ -35,7 +35,8 @@
 #define AADET true
 #endif
 
-// makes it possible to have multiple derivatives at once
+// makes it possible to have multiple derivatives at once. See
+// setNumResultsForAAD. The CI has a build with this set to true
 #ifndef AADMULTIOUT
 #define AADMULTIOUT false
 #endif
@@ -925,7 +925,7 @@ class Number : public Expression<Number>, public vectorOps<Number>
     {
 #if AADMULTIOUT
         myNode->pAdjPtrs[i] = Tape::multi
-            ? other.Adjoints
+            ? other.pAdjoints
             : &other.mAdjoint;
 #else
         myNode->pAdjPtrs[i] = &other.mAdjoint;
@@ -1141,6 +1141,22 @@ public:
         }
         it->propagateAll();
     }
+
+    //  Sets the i'th adjoint of the i'th output to one and propagates all
+    //  the adjoints from the last node on the tape to the start in one
+    //  pass. The outputs and all their inputs must be recorded after
+    //  setNumResultsForAAD has been called with the number of outputs.
+    //  The adjoint(i) member of the inputs is then the derivative of the
+    //  i'th output
+    template<class I>
+    static void propagateMultiToStart(I outBegin, I outEnd)
+    {
+        for (size_t i = 0; outBegin != outEnd; ++outBegin, ++i)
+        {
+            outBegin->adjoint(i) = 1.0;
+        }
+        propagateAdjointsMulti(std::prev(tape->end()), tape->begin());
+    }
 #endif
 
     //  Unary operators
@@ -37,9 +37,14 @@ namespace cfaad {
 //  AAD.cpp
 
 #if AADMULTIOUT
+#ifdef _OPENMP
+thread_local size_t Node::numAdj = 1;
+thread_local bool Tape::multi = false;
+#else
 size_t Node::numAdj = 1;
 bool Tape::multi = false;
 #endif
+#endif
 
 Tape globalTape;
 #ifdef _OPENMP
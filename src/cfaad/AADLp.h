@@ -52,6 +52,15 @@ public:
     factorization{mem.get()},
     inverse{comp_inv ? factorization + (n * (n + 1))/2 : nullptr}
     {
+        update(begin);
+    }
+
+    /**
+     * recomputes the factorization, and the inverse if it is computed, of a
+     * new matrix with the same dimension. No memory is allocated.
+     */
+    template<class I>
+    void update(I begin){
         {
             double * f{factorization};
             for(int j = 0; j < n; ++j)
@@ -68,7 +77,7 @@ public:
             throw std::runtime_error
                 ("dpptrf failed with code " + std::to_string(info));
 
-        if(!comp_inv)
+        if(!has_inverse())
             return;
 
         // compute the inverse
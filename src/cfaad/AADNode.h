@@ -68,8 +68,12 @@ class Node
 
 #if AADMULTIOUT
     //  Number of adjoints (results) to propagate, usually 1
-    //  See chapter 14
+    //  See chapter 14. It is per thread as the tapes
+#ifdef _OPENMP
+    static thread_local size_t numAdj;
+#else
     static size_t   numAdj;
+#endif
 #endif
 
     //  Number of childs (arguments)
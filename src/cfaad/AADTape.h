@@ -39,6 +39,7 @@
 #include "blocklist.h"
 #include "AADNode.h"
 #include "AADConfig.h"
+#include <algorithm>
 
 namespace cfaad {
 
@@ -49,8 +50,13 @@ constexpr size_t DATASIZE   = 65536;		//	Data in bytes
 class Tape
 {
 #if AADMULTIOUT
-	//	Working with multiple results / adjoints?
+	//	Working with multiple results / adjoints? It is per thread as the
+	//	tapes
+#ifdef _OPENMP
+	static thread_local bool			multi;
+#else
 	static bool							multi;
+#endif
 
 	//  Storage for adjoints in multi-dimensional case (chapter 14)
     blocklist<double, ADJSIZE>			myAdjointsMulti;
@@ -66,9 +72,21 @@ class Tape
     //  Storage for working memory
     blocklist<double, DATASIZE>         myWKMem;
 
+    //  Arena mode: clear() keeps the blocks for the next recording
+    bool                                myArena{false};
+
+    //  The largest number of bytes used since the last reset
+    size_t                              myPeakBytes{0};
+
 	//	Padding so tapes in a vector don't interfere
     char                                myPad[64];
 
+    //  Updates the largest number of bytes used
+    void updatePeakBytes()
+    {
+        myPeakBytes = std::max(myPeakBytes, usedBytes());
+    }
+
 #if AADMULTIOUT
     friend auto setNumResultsForAAD(const bool, const size_t);
     friend struct numResultsResetterForAAD;
@@ -150,9 +168,16 @@ public:
         }
 	}
 
-    //  Clear
+    //  Clear. The memory is kept in arena mode
     void clear()
     {
+        updatePeakBytes();
+        if (myArena)
+        {
+            rewindBlocks();
+            return;
+        }
+
 #if AADMULTIOUT
         myAdjointsMulti.clear();
 #endif
@@ -176,6 +201,16 @@ public:
 #else
         //  In release mode, rewind and reuse
 
+        updatePeakBytes();
+        rewindBlocks();
+
+#endif
+
+    }
+
+    //  Rewind and keep all blocks
+    void rewindBlocks()
+    {
 #if AADMULTIOUT
 		if (multi)
 		{
@@ -186,9 +221,66 @@ public:
 		myArgPtrs.rewind();
 		myNodes.rewind();
         myWKMem.rewind();
+    }
 
+    //  Sets whether the tape is in arena mode where clear() keeps the
+    //  memory. Thus, the memory is only allocated when the tape grows
+    //  beyond its high-water mark. The memory is freed when the arena mode
+    //  is turned off
+    void setArena(const bool arena)
+    {
+        myArena = arena;
+        if (!arena)
+        {
+            clear();
+        }
+    }
+
+    bool arena() const
+    {
+        return myArena;
+    }
+
+    //  Number of bytes used by the current recording
+    size_t usedBytes() const
+    {
+        size_t out{myNodes.used() * sizeof(Node) +
+            myDers.used() * sizeof(double) +
+            myArgPtrs.used() * sizeof(double*) +
+            myWKMem.used() * sizeof(double)};
+#if AADMULTIOUT
+        if (multi)
+        {
+            out += myAdjointsMulti.used() * sizeof(double);
+        }
 #endif
+        return out;
+    }
+
+    //  Number of bytes allocated by the tape
+    size_t allocatedBytes() const
+    {
+        size_t out{myNodes.allocated() * sizeof(Node) +
+            myDers.allocated() * sizeof(double) +
+            myArgPtrs.allocated() * sizeof(double*) +
+            myWKMem.allocated() * sizeof(double)};
+#if AADMULTIOUT
+        out += myAdjointsMulti.allocated() * sizeof(double);
+#endif
+        return out;
+    }
 
+    //  The largest number of bytes used by a recording since the last
+    //  reset. The recordings end when the tape is rewound or cleared
+    size_t peakBytes()
+    {
+        updatePeakBytes();
+        return myPeakBytes;
+    }
+
+    void resetPeakBytes()
+    {
+        myPeakBytes = 0;
     }
 
     //  Set mark
@@ -209,6 +301,7 @@ public:
     //  Rewind to mark
     void rewindToMark()
     {
+        updatePeakBytes();
 #if AADMULTIOUT
         if (multi)
         {
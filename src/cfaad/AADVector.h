@@ -483,6 +483,74 @@ struct vectorOps {
         res.myValue *= 2;
         return res;
     }
+
+    /**
+     * computes w * exp(y^T.X.y / 2 + y^T.m + f) where X is a symmetric n x n
+     * matrix of which only the upper triangle is used like in
+     * quad_form_sym_both. X, y, m, and f are Ts and a single node is recorded
+     * instead of the nodes for the quadratic form, the dot product, the sums,
+     * the exponential, and the product.
+     */
+    template<class I1, class I2, class I3>
+    static T exp_quad_mean
+    (double const w, T const &f, I1 x, I2 yf, I2 ye, I3 m){
+        static_assert(is_it_value_type<I1, T>::value,
+                      "First iterator is not to Ts");
+        static_assert(is_it_value_type<I2, T>::value,
+                      "Second iterator is not to Ts");
+        static_assert(is_it_value_type<I3, T>::value,
+                      "Third iterator is not to Ts");
+
+        const size_t n{static_cast<size_t>(std::distance(yf, ye))};
+        T res;
+        res.createNode(n * n + 2 * n + 1);
+        double *derivs{T::tape->getWKMem(n)};
+        std::fill(derivs, derivs + n, 0);
+
+        // compute the argument to the exponential and X.y
+        double arg{f.value()};
+        for(size_t j = 0; j < n; ++j){
+            for(size_t i = 0; i < j; ++i){
+                arg += x[i + j * n].value() * yf[i].value() * yf[j].value();
+                derivs[i] += x[i + j * n].value() * yf[j].value();
+                derivs[j] += x[i + j * n].value() * yf[i].value();
+            }
+
+            arg += .5 * x[j + j * n].value() * yf[j].value() * yf[j].value();
+            derivs[j] += x[j + j * n].value() * yf[j].value();
+            arg += yf[j].value() * m[j].value();
+        }
+
+        res.myValue = w * std::exp(arg);
+
+        // set the partial derivatives
+        double const val{res.myValue};
+        for(size_t j = 0; j < n; ++j){
+            for(size_t i = 0; i < j; ++i){
+                double const d_x{.5 * val * yf[i].value() * yf[j].value()};
+                res.setpAdjPtrs    (i + j * n, x[i + j * n]);
+                res.setpDerivatives(i + j * n, d_x);
+                res.setpAdjPtrs    (j + i * n, x[j + i * n]);
+                res.setpDerivatives(j + i * n, d_x);
+            }
+
+            res.setpAdjPtrs    (j + j * n, x[j + j * n]);
+            res.setpDerivatives
+                (j + j * n, .5 * val * yf[j].value() * yf[j].value());
+        }
+
+        for(size_t i = 0; i < n; ++i){
+            res.setpAdjPtrs    (i + n * n, yf[i]);
+            res.setpDerivatives(i + n * n, val * (derivs[i] + m[i].value()));
+            res.setpAdjPtrs    (i + n * (n + 1), m[i]);
+            res.setpDerivatives(i + n * (n + 1), val * yf[i].value());
+        }
+
+        res.setpAdjPtrs    (n * (n + 2), f);
+        res.setpDerivatives(n * (n + 2), val);
+
+        return res;
+    }
     
 #if AADLAPACK
 
@@ -3,6 +3,7 @@
 #include "AADNumWrapper.h"
 #include <numeric>
 #include <algorithm>
+#include <cmath>
 
 namespace cfaad {
 // sum function
@@ -240,6 +241,49 @@ void triMatVecProd(I1 xf, I2 af, I2 al, I3 of,
     (xf, af, al, of, trans);
 }
 
+// the weighted exponential of a quadratic form, a linear term, and a constant
+
+namespace implementation {
+template<class I1, class I2, class I3, class V>
+struct expQuadMeanOp {
+    /// the general case
+    static V exp_quad_mean(double const w, V const &f, I1 x, I2 yf, I2 ye,
+                           I3 m){
+        const size_t n{static_cast<size_t>(std::distance(yf, ye))};
+
+        V arg{f};
+        for(size_t j = 0; j < n; ++j){
+            for(size_t i = 0; i < j; ++i)
+                arg += x[i + j * n] * yf[i] * yf[j];
+            arg += .5 * x[j + j * n] * yf[j] * yf[j];
+            arg += yf[j] * m[j];
+        }
+
+        return w * std::exp(arg);
+    }
+};
+
+template<class I1, class I2, class I3>
+struct expQuadMeanOp<I1, I2, I3, Number> {
+    /// special case where all the arguments are Ts
+    static Number exp_quad_mean(double const w, Number const &f, I1 x, I2 yf,
+                                I2 ye, I3 m){
+        return Number::exp_quad_mean(w, f, x, yf, ye, m);
+    }
+};
+} // namespace implementation
+
+/**
+ * computes w * exp(y^T.X.y / 2 + y^T.m + f) using the upper triangle of the
+ * symmetric matrix X like in quadFormSym.
+ */
+template<class I1, class I2, class I3>
+it_value_type<I2> expQuadMean
+    (double const w, it_value_type<I2> const &f, I1 x, I2 yf, I2 ye, I3 m){
+    return implementation::expQuadMeanOp<I1, I2, I3, it_value_type<I2> >
+        ::exp_quad_mean(w, f, x, yf, ye, m);
+}
+
 #if AADLAPACK
 // the quadratic form a^TB^{-1}a
 
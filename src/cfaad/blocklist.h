@@ -121,6 +121,21 @@ public:
     }
   }
 
+  //  Number of used elements. All elements are used in this version
+  size_t used() const
+  {
+    size_t out{};
+    for (auto& arr : data)
+      out += std::distance(arr.begin(), arr.end());
+    return out;
+  }
+
+  //  Number of allocated elements
+  size_t allocated() const
+  {
+    return used();
+  }
+
   template<typename ...Args>
   T* emplace_back(Args&& ...args)
   {
@@ -283,8 +298,9 @@ class blocklist
     using list_iter = decltype(data.begin());
     using block_iter = decltype(data.back().begin());
 
-    //  Current block
+    //  Current block and its index
     list_iter           cur_block;
+    size_t              cur_block_idx{};
 
 	//  Last block
 	list_iter			last_block;
@@ -298,12 +314,14 @@ class blocklist
     //  Mark
     list_iter           marked_block;
     block_iter          marked_space;
+    size_t              marked_block_idx{};
 
     //  Create new array
     void newblock()
     {
         data.emplace_back();
         cur_block = last_block = std::prev(data.end());
+        cur_block_idx = data.size() - 1;
         next_space = cur_block->begin();
         last_space = cur_block->end();
     }
@@ -319,6 +337,7 @@ class blocklist
         else
         {
             ++cur_block;
+            ++cur_block_idx;
             next_space = cur_block->begin();
             last_space = cur_block->end();
         }
@@ -343,6 +362,7 @@ public:
     void rewind()
     {
         cur_block = data.begin();
+        cur_block_idx = 0;
         next_space = cur_block->begin();
         last_space = cur_block->end();
     }
@@ -356,6 +376,20 @@ public:
 		}
 	}
 
+    //  Number of used elements including the unused space at the end of
+    //  the blocks before the current block
+    size_t used() const
+    {
+        return cur_block_idx * block_size +
+            std::distance(cur_block->begin(), next_space);
+    }
+
+    //  Number of allocated elements
+    size_t allocated() const
+    {
+        return data.size() * block_size;
+    }
+
     //  Construct object of type T in place
     //      in the next free space and return a pointer on it
     //  Implements perfect forwarding of constructor arguments
@@ -458,6 +492,7 @@ public:
         }
 
         marked_block = cur_block;
+        marked_block_idx = cur_block_idx;
         marked_space = next_space;
     }
 
@@ -465,6 +500,7 @@ public:
     void rewind_to_mark()
     {
         cur_block = marked_block;
+        cur_block_idx = marked_block_idx;
         next_space = marked_space;
 		last_space = cur_block->end();
     }
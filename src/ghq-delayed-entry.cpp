@@ -1,5 +1,7 @@
 #include "ghq-delayed-entry.h"
 #include "integrand-expected-survival.h"
+#include <map>
+#include <memory>
 #include <numeric>
 #include <set>
 
@@ -71,6 +73,16 @@ delayed_dat::delayed_dat
           throw std::invalid_argument
           ("obs.index >= rng_design_varying_mats[obs.type].n_cols()");
 
+    // find the break points of the bases
+    break_points_v.resize(bases_fix.size());
+    for(size_t type = 0; type < bases_fix.size(); ++type){
+      auto &breaks = break_points_v[type];
+      bases_fix[type]->break_points(breaks);
+      for(auto &b : bases_rng)
+        b->break_points(breaks);
+      joint_bases::sort_unique_break_points(breaks);
+    }
+
     for(size_t i = 0; i < ders.size(); ++i){
       if(ders[i].size() != bases_rng_in.size())
         throw std::invalid_argument("ders_i.size() != bases_rng_in.size()");
@@ -82,15 +94,32 @@ delayed_dat::delayed_dat
     }
   }
 
-delayed_dat::eval_data::eval_data
+template<class S>
+delayed_dat::eval_data<S>::eval_data
   (delayed_dat const &dat, node_weight const &nws,
    delayed_dat::cluster_info const &info,
    ghqCpp::simple_mem_stack<double> &mem){
   vajoint_uint const n_outcomes = info.size(),
-                           n_gl = nws.n_nodes,
-                  n_gl_outcomes{n_gl * n_outcomes},
                       n_markers = dat.n_markers();
 
+  // find the rule for each outcome. All outcomes use the same number of nodes
+  // so the rules are padded with zero weights if the intervals are split
+  std::vector<node_weight> rules(n_outcomes, nws);
+  n_nodes = nws.n_nodes;
+  if(dat.split_at_knots_v)
+    for(vajoint_uint i = 0; i < n_outcomes; ++i){
+      auto const &breaks = dat.break_points_v[info[i].type];
+      double * const ns{mem.get(2 * (breaks.size() + 1) * nws.n_nodes)},
+             * const ws{ns + (breaks.size() + 1) * nws.n_nodes};
+      rules[i] = { ns, ws, split_rule
+        (0, info[i].entry_time, breaks.data(), breaks.data() + breaks.size(),
+         nws, ns, ws) };
+      n_nodes = std::max(n_nodes, rules[i].n_nodes);
+    }
+
+  vajoint_uint const n_gl{n_nodes},
+            n_gl_outcomes{n_gl * n_outcomes};
+
   // set the quadrature weights for the cumulative hazards and the time points
   // at which we evaluate the bases
   double * const time_points(mem.get(n_gl_outcomes));
@@ -98,11 +127,18 @@ delayed_dat::eval_data::eval_data
 
   {
     double *time_points_i{time_points};
-    for(auto &obs : info)
-      for(vajoint_uint i = 0; i < n_gl; ++i){
-        *time_points_i++ = obs.entry_time * nws.ns[i];
-        quad_weights.emplace_back(obs.entry_time * nws.ws[i]);
-      }
+    for(vajoint_uint j = 0; j < n_outcomes; ++j){
+      double const entry_time{info[j].entry_time};
+      node_weight const &rule = rules[j];
+      for(vajoint_uint i = 0; i < n_gl; ++i)
+        if(i < rule.n_nodes){
+          *time_points_i++ = entry_time * rule.ns[i];
+          quad_weights.emplace_back(entry_time * rule.ws[i]);
+        } else {
+          *time_points_i++ = entry_time * rule.ns[0];
+          quad_weights.emplace_back(0);
+        }
+    }
   }
 
   // fill in the design matrix for the time-varying fixed effects
@@ -130,14 +166,22 @@ delayed_dat::eval_data::eval_data
     }
   }
 
-  // fill in the design matrix for the random effects
-  rng_basis.reserve(n_markers);
+  // fill in the design matrix for the random effects. First, find the offsets
+  // and allocate the memory
+  n_outcomes_v = n_outcomes;
+  rng_basis_offsets.resize(n_markers * n_outcomes);
+  {
+    size_t n_ele{};
+    for(vajoint_uint mark = 0; mark < n_markers; ++mark)
+      for(vajoint_uint obs_idx = 0; obs_idx < n_outcomes; ++obs_idx){
+        rng_basis_offsets[mark * n_outcomes + obs_idx] = n_ele;
+        n_ele += dat.ders_v[info[obs_idx].type][mark].size() * n_gl *
+          dat.bases_rng[mark]->n_basis();
+      }
+    rng_basis.resize(n_ele);
+  }
 
   for(vajoint_uint mark = 0; mark < n_markers; ++mark){
-    rng_basis.emplace_back();
-    std::vector<std::vector<simple_mat<double> > > &marker_k{rng_basis.back()};
-    marker_k.reserve(n_outcomes);
-
     auto const &rng_base = dat.bases_rng[mark];
     auto const n_basis = rng_base->n_basis();
     double * const basis_mem{mem.get(rng_base->n_wmem() + n_basis)},
@@ -149,11 +193,10 @@ delayed_dat::eval_data::eval_data
       auto &obs = info[obs_idx];
 
       auto &ders_kl = dat.ders_v[obs.type][mark];
-      marker_k.emplace_back(ders_kl.size(), simple_mat<double>{n_gl, n_basis});
-      std::vector<simple_mat<double> > &marker_kl{marker_k.back()};
-
       for(size_t der = 0; der < ders_kl.size(); ++der){
-        auto &simple_mat_i = marker_kl[der];
+        S * const block
+          {rng_basis.data() + rng_basis_offsets[mark * n_outcomes + obs_idx] +
+            der * n_gl * n_basis};
         for(size_t h = 0; h < n_gl; ++h){
           (*rng_base)
             (basis_mem, basis_mem_wk, time_points_i[h],
@@ -163,7 +206,7 @@ delayed_dat::eval_data::eval_data
 
           // copy the transpose
           for(vajoint_uint j = 0; j < n_basis; ++j)
-            simple_mat_i.col(j)[h] = basis_mem[j];
+            block[h + j * n_gl] = basis_mem[j];
         }
       }
     }
@@ -187,13 +230,17 @@ delayed_dat::eval_data::eval_data
   }
 }
 
+template struct delayed_dat::eval_data<double>;
+template struct delayed_dat::eval_data<float>;
+
 void delayed_dat::set_cached_expansions
-  (node_weight const &nws, ghqCpp::simple_mem_stack<double> &mem){
+  (node_weight const &nws, ghqCpp::simple_mem_stack<double> &mem,
+   bool const as_float, unsigned const n_threads){
   if(has_cached_expansions()){
     /// check if we already use the same quadrature rule
     bool is_same_rule
       {nws.n_nodes == cached_nodes.size() &&
-        nws.n_nodes == cached_weights.size()};
+        nws.n_nodes == cached_weights.size() && as_float == cache_as_float};
     for(vajoint_uint i = 0; i < nws.n_nodes && is_same_rule; ++i)
       is_same_rule &= nws.ns[i] == cached_nodes[i] &&
         nws.ws[i] == cached_weights[i];
@@ -208,18 +255,144 @@ void delayed_dat::set_cached_expansions
   cached_nodes.resize(n_nodes);
   std::copy(nws.ns, nws.ns + n_nodes, cached_nodes.begin());
 
+  cache_as_float = as_float;
+
   cached_expansions.clear();
-  cached_expansions.reserve(cluster_info().size());
+  cached_expansions_float.clear();
+  size_t const n_clusters{cluster_infos().size()};
+  if(as_float)
+    cached_expansions_float.resize(n_clusters);
+  else
+    cached_expansions.resize(n_clusters);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+  {
+    ghqCpp::simple_mem_stack<double> thread_mem;
+    ghqCpp::simple_mem_stack<double> &mem_use
+      {get_thread_num() == 0 ? mem : thread_mem};
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+    for(size_t i = 0; i < n_clusters; ++i){
+      mem_use.reset_to_mark();
+      if(as_float)
+        cached_expansions_float[i] =
+          eval_data<float>{*this, nws, cluster_infos()[i], mem_use};
+      else
+        cached_expansions[i] =
+          eval_data<double>{*this, nws, cluster_infos()[i], mem_use};
+    }
+  }
+}
+
+void delayed_dat::set_split_at_knots(bool const split){
+  if(split == split_at_knots_v)
+    return;
 
-  for(auto &info : cluster_infos()){
-    mem.reset_to_mark();
-    cached_expansions.emplace_back(*this, nws, info, mem);
+  clear_cached_expansions();
+  split_at_knots_v = split;
+}
+
+void delayed_dat::set_warm_start(bool const use, double const tol){
+  warm_start_tol_v = tol;
+  if(!use){
+    warm_start_states.clear();
+    warm_start_states.shrink_to_fit();
+  } else if(!use_warm_start())
+    warm_start_states.resize(cluster_infos().size());
+}
+
+void delayed_dat::set_sparse_grid(size_t const level){
+  if(level == sparse_level_v)
+    return;
+
+  sparse_level_v = level;
+  sparse_grids.clear();
+  if(level < 1){
+    sparse_grids.shrink_to_fit();
+    return;
   }
+
+  size_t const max_n_rng{par_idx.n_shared() + par_idx.n_shared_surv()};
+  sparse_grids.reserve(max_n_rng);
+  for(size_t i = 1; i <= max_n_rng; ++i)
+    sparse_grids.emplace_back(i, level);
+}
+
+void delayed_dat::set_rqmc(size_t const n_points, size_t const min_vars){
+  if(n_points > 0 &&
+     par_idx.n_shared() + par_idx.n_shared_surv() > ghqCpp::rqmc_max_vars)
+    throw std::invalid_argument("too many random effects for rqmc");
+
+  rqmc_points_v = n_points;
+  rqmc_min_vars_v = min_vars;
+}
+
+void delayed_dat::set_nested_threads
+  (unsigned const n_threads, size_t const min_obs){
+  nested_threads_v = std::max(n_threads, 1U);
+  nested_min_obs_v = min_obs;
+}
+
+void delayed_dat::apply_quadrature
+  (double *res, ghqCpp::ghq_problem const &problem,
+   ghqCpp::ghq_data const &ghq_dat, ghqCpp::simple_mem_stack<double> &mem,
+   vajoint_uint const cluster_index) const {
+  if(rqmc_points_v > 0 && problem.n_vars() >= rqmc_min_vars_v)
+    ghqCpp::rqmc(res, nullptr, problem, mem, rqmc_points_v, 1, 1, 200);
+  else if(sparse_grids.size() > 0)
+    ghqCpp::ghq
+      (res, sparse_grids[problem.n_vars() - 1], problem, mem, 200);
+  else {
+    bool const is_large
+      {cluster_infos()[cluster_index].size() >= nested_min_obs_v};
+    ghqCpp::ghq
+      (res, ghq_dat, problem, mem, 200, is_large ? nested_threads_v : 1);
+  }
+}
+
+ghqCpp::adaptive_problem delayed_dat::get_adaptive_problem
+  (vajoint_uint const cluster_index, double const *inputs,
+   size_t const n_inputs, ghqCpp::ghq_problem const &problem,
+   ghqCpp::simple_mem_stack<double> &mem) const {
+  if(!use_warm_start())
+    return ghqCpp::adaptive_problem(problem, mem, 1e-6);
+
+  warm_start_state &state = warm_start_states[cluster_index];
+  size_t const n_vars{problem.n_vars()};
+  bool const has_state
+    {state.inputs.size() == n_inputs && state.mode.size() == n_vars};
+
+  // the result depends on the previous calls unless the inputs are the same
+  // which is required with warm_start_tol_v equal to zero
+  if(has_state && warm_start_tol_v >= 0){
+    bool is_close{true};
+    for(size_t i = 0; i < n_inputs && is_close; ++i)
+      is_close = std::abs(inputs[i] - state.inputs[i]) <=
+        warm_start_tol_v * (1 + std::abs(state.inputs[i]));
+
+    if(is_close)
+      return ghqCpp::adaptive_problem
+        (problem, state.mode.data(), state.chol.data());
+  }
+
+  ghqCpp::adaptive_problem out
+    (problem, mem, has_state ? state.mode.data() : nullptr, 1e-6);
+  state.inputs.assign(inputs, inputs + n_inputs);
+  state.mode.assign(out.mode().begin(), out.mode().end());
+  state.chol.assign(out.chol().begin(), out.chol().end());
+  return out;
 }
 
 void delayed_dat::clear_cached_expansions(){
   cached_expansions.clear();
   cached_expansions.shrink_to_fit();
+  cached_expansions_float.clear();
+  cached_expansions_float.shrink_to_fit();
+  cache_as_float = false;
 
   cached_nodes.clear();
   cached_nodes.shrink_to_fit();
@@ -228,15 +401,15 @@ void delayed_dat::clear_cached_expansions(){
   cached_weights.shrink_to_fit();
 }
 
+template<class S>
 struct delayed_dat::impl {
   delayed_dat const &dat;
   delayed_dat::cluster_info const &info;
-  node_weight const &nws;
-  eval_data const &e_dat;
+  eval_data<S> const &e_dat;
   ghqCpp::simple_mem_stack<double> &mem;
 
   vajoint_uint const n_outcomes = info.size(),
-                     n_gl = nws.n_nodes,
+                     n_gl = e_dat.n_nodes,
                      n_gl_outcomes{n_gl * n_outcomes},
                      n_shared{dat.par_idx.n_shared()},
                      n_rng = n_shared + e_dat.n_active_frailties();
@@ -249,10 +422,15 @@ struct delayed_dat::impl {
   ghqCpp::simple_mem_stack<double>::return_memory_handler mem_mark
     {mem.set_mark_raii()};
 
+  /// the number of inputs to the integrand which start at etas
+  size_t n_inputs() const {
+    return n_gl_outcomes + n_gl_outcomes * n_rng + n_rng * n_rng;
+  }
+
   impl(delayed_dat const &dat, delayed_dat::cluster_info const &info,
-       node_weight const &nws, eval_data const &e_dat,
+       eval_data<S> const &e_dat,
        ghqCpp::simple_mem_stack<double> &mem, double const *param):
-    dat{dat}, info{info}, nws{nws}, e_dat{e_dat}, mem{mem} {
+    dat{dat}, info{info}, e_dat{e_dat}, mem{mem} {
     	// setup the eta offsets. These consists of time-varying and fixed part
       for(vajoint_uint i = 0; i < n_outcomes; ++i){
         // start with the fixed part
@@ -283,15 +461,11 @@ struct delayed_dat::impl {
         double * rng_design_k{rng_design};
         for(vajoint_uint k = 0; k < dat.n_markers();
             rng_design_k += dat.rng_n_basis(k) * n_gl_outcomes, ++k){
-          std::vector<std::vector<simple_mat<double> > > const &marker_k =
-            e_dat.rng_basis[k];
-
           size_t const n_basis = dat.rng_n_basis(k);
 
           double * rng_design_kl{rng_design_k};
           for(size_t l = 0; l < info.size(); ++l, rng_design_kl += n_gl){
             auto &obs = info[l];
-            auto const &rng_basis_kl = marker_k[l];
             double const * association{param + dat.par_idx.association(obs.type)};
 
             // find the right association parameters
@@ -299,12 +473,13 @@ struct delayed_dat::impl {
             for(size_t kk = 0; kk < k; ++kk)
               association += ders_l[kk].size();
 
-            for(size_t v = 0; v < rng_basis_kl.size(); ++v){
-              auto const &rng_basis_klv = rng_basis_kl[v];
+            for(size_t v = 0; v < ders_l[k].size(); ++v){
+              S const * const rng_basis_klv
+                {e_dat.rng_basis_block(k, l, v, n_basis)};
               for(size_t j = 0; j < n_basis; ++j)
                 for(size_t i = 0; i < n_gl; ++i)
                   rng_design_kl[i + j * n_gl_outcomes] +=
-                    association[v] * rng_basis_klv.col(j)[i];
+                    association[v] * rng_basis_klv[i + j * n_gl];
             }
           }
         }
@@ -349,22 +524,14 @@ struct delayed_dat::impl {
     }
 };
 
-double delayed_dat::operator()
+template<class S>
+double delayed_dat::eval_cluster
   (double const *param, ghqCpp::simple_mem_stack<double> &mem,
-   const vajoint_uint cluster_index, node_weight const &nws,
+   const vajoint_uint cluster_index, eval_data<S> const &e_dat,
    ghqCpp::ghq_data const &ghq_dat) const {
   // use the helper to set up the objects need for the quadrature
   auto const &info{cluster_infos()[cluster_index]};
-
-  std::unique_ptr<eval_data> local_eval_data;
-  if(!has_cached_expansions())
-    local_eval_data.reset(new eval_data{*this, nws, info, mem});
-  eval_data const &e_dat
-    {has_cached_expansions()
-      ? cached_expansions[cluster_index]
-      : *local_eval_data.get()};
-
-  impl im{*this, info, nws, e_dat, mem, param};
+  impl<S> im{*this, info, e_dat, mem, param};
 
   // apply the quadrature
   double * const etas{im.etas},
@@ -382,29 +549,23 @@ double delayed_dat::operator()
   ghqCpp::expected_survival_term<false> surv_term_inner
     (etas_vec, ws_vec, rng_design_mat);
   ghqCpp::rescale_problem<false> surv_term(vcov_mat, surv_term_inner);
-  ghqCpp::adaptive_problem prob(surv_term, mem, 1e-6);
+  ghqCpp::adaptive_problem prob
+    {get_adaptive_problem
+      (cluster_index, etas, im.n_inputs(), surv_term, mem)};
 
   double res{};
-  ghqCpp::ghq(&res, ghq_dat, prob, mem, 200);
+  apply_quadrature(&res, prob, ghq_dat, mem, cluster_index);
   return std::log(res);
 }
 
-double delayed_dat::grad
+template<class S>
+double delayed_dat::grad_cluster
   (double const *param, double *gr, ghqCpp::simple_mem_stack<double> &mem,
-   const vajoint_uint cluster_index, node_weight const &nws,
+   const vajoint_uint cluster_index, eval_data<S> const &e_dat,
    ghqCpp::ghq_data const &ghq_dat) const {
   // use the helper to set up the objects need for the quadrature
   auto const &info{cluster_infos()[cluster_index]};
-
-  std::unique_ptr<eval_data> local_eval_data;
-  if(!has_cached_expansions())
-    local_eval_data.reset(new eval_data{*this, nws, info, mem});
-  eval_data const &e_dat
-    {has_cached_expansions()
-      ? cached_expansions[cluster_index]
-      : *local_eval_data.get()};
-
-  impl im{*this, info, nws, e_dat, mem, param};
+  impl<S> im{*this, info, e_dat, mem, param};
 
   // apply the quadrature
   double * const etas{im.etas},
@@ -412,10 +573,7 @@ double delayed_dat::grad
          * const vcov{im.vcov};
 
   vajoint_uint const n_gl_outcomes{im.n_gl_outcomes},
-                             n_rng{im.n_rng},
-                        n_outcomes{im.n_outcomes},
-                              n_gl{im.n_gl},
-                          n_shared{im.n_shared};
+                             n_rng{im.n_rng};
 
   arma::vec ws_vec
       (const_cast<double*>(&e_dat.quad_weights[0]), n_gl_outcomes, false),
@@ -425,12 +583,28 @@ double delayed_dat::grad
   ghqCpp::expected_survival_term<true> surv_term_inner
     (etas_vec, ws_vec, rng_design_mat);
   ghqCpp::rescale_problem<true> surv_term(vcov_mat, surv_term_inner);
-  ghqCpp::adaptive_problem prob(surv_term, mem, 1e-6);
+  ghqCpp::adaptive_problem prob
+    {get_adaptive_problem
+      (cluster_index, etas, im.n_inputs(), surv_term, mem)};
 
   size_t const n_res{prob.n_out()};
   double * __restrict__ res{mem.get(n_res)};
   auto mem_mark = mem.set_mark_raii();
-  ghqCpp::ghq(res, ghq_dat, prob, mem, 200);
+  apply_quadrature(res, prob, ghq_dat, mem, cluster_index);
+  return add_grad(gr, res, n_res, im);
+}
+
+template<class S>
+double delayed_dat::add_grad
+  (double *gr, double *res, size_t const n_res, impl<S> const &im) const {
+  auto const &info = im.info;
+  auto const &e_dat = im.e_dat;
+  vajoint_uint const n_gl_outcomes{im.n_gl_outcomes},
+                             n_rng{im.n_rng},
+                        n_outcomes{im.n_outcomes},
+                              n_gl{im.n_gl},
+                          n_shared{im.n_shared};
+
   double const fn_exp{res[0]},
                fn{std::log(fn_exp)};
 
@@ -471,15 +645,11 @@ double delayed_dat::grad
     double const * d_rng_design_k{d_rng_design};
     for(vajoint_uint k = 0; k < n_markers();
         d_rng_design_k += rng_n_basis(k) * n_gl_outcomes, ++k){
-      std::vector<std::vector<simple_mat<double> > > const &marker_k =
-        e_dat.rng_basis[k];
-
       size_t const n_basis = rng_n_basis(k);
 
       double const * d_rng_design_kl{d_rng_design_k};
       for(size_t l = 0; l < info.size(); ++l, d_rng_design_kl += n_gl){
         auto &obs = info[l];
-        auto const &rng_basis_kl = marker_k[l];
         double * outcome{gr + par_idx.association(obs.type)};
 
         // find the right association parameters
@@ -487,12 +657,13 @@ double delayed_dat::grad
         for(size_t kk = 0; kk < k; ++kk)
           outcome += ders_l[kk].size();
 
-        for(size_t v = 0; v < rng_basis_kl.size(); ++v){
-          auto const &rng_basis_klv = rng_basis_kl[v];
+        for(size_t v = 0; v < ders_l[k].size(); ++v){
+          S const * const rng_basis_klv
+            {e_dat.rng_basis_block(k, l, v, n_basis)};
           for(size_t j = 0; j < n_basis; ++j)
             for(size_t i = 0; i < n_gl; ++i)
               outcome[v] += d_rng_design_kl[i + j * n_gl_outcomes] *
-                rng_basis_klv.col(j)[i];
+                rng_basis_klv[i + j * n_gl];
         }
       }
     }
@@ -520,4 +691,184 @@ double delayed_dat::grad
 
   return fn;
 }
+
+template<class S, bool comp_grad>
+struct delayed_dat::batch_cluster {
+  impl<S> im;
+  arma::vec ws_vec, etas_vec;
+  arma::mat rng_design_mat, vcov_mat;
+  ghqCpp::expected_survival_term<comp_grad> surv_term_inner;
+  ghqCpp::rescale_problem<comp_grad> surv_term;
+  ghqCpp::adaptive_problem prob;
+
+  batch_cluster
+    (delayed_dat const &dat, double const *param,
+     ghqCpp::simple_mem_stack<double> &mem, vajoint_uint const cluster_index,
+     eval_data<S> const &e_dat):
+    im{dat, dat.cluster_infos()[cluster_index], e_dat, mem, param},
+    ws_vec(const_cast<double*>(&e_dat.quad_weights[0]), im.n_gl_outcomes,
+           false),
+    etas_vec(im.etas, im.n_gl_outcomes, false),
+    rng_design_mat(im.rng_design, im.n_gl_outcomes, im.n_rng, false),
+    vcov_mat(im.vcov, im.n_rng, im.n_rng, false),
+    surv_term_inner(etas_vec, ws_vec, rng_design_mat),
+    surv_term(vcov_mat, surv_term_inner),
+    prob{dat.get_adaptive_problem
+          (cluster_index, im.etas, im.n_inputs(), surv_term, mem)} { }
+};
+
+bool delayed_dat::can_batch
+  (vajoint_uint const cluster_index, size_t const n_vars) const {
+  if(sparse_grids.size() > 0 ||
+       (rqmc_points_v > 0 && n_vars >= rqmc_min_vars_v))
+    return false;
+  return nested_threads_v < 2 ||
+    cluster_infos()[cluster_index].size() < nested_min_obs_v;
+}
+
+template<class S>
+void delayed_dat::eval_batch_data
+  (double const *param, double * const *grs, double *res,
+   ghqCpp::simple_mem_stack<double> &mem, vajoint_uint const *cluster_indices,
+   std::vector<eval_data<S> const *> const &e_dats,
+   ghqCpp::ghq_data const &ghq_dat) const {
+  if(grs)
+    integrate_batch<S, true>
+      (param, grs, res, mem, cluster_indices, e_dats, ghq_dat);
+  else
+    integrate_batch<S, false>
+      (param, grs, res, mem, cluster_indices, e_dats, ghq_dat);
+}
+
+template<class S, bool comp_grad>
+void delayed_dat::integrate_batch
+  (double const *param, double * const *grs, double *res,
+   ghqCpp::simple_mem_stack<double> &mem, vajoint_uint const *cluster_indices,
+   std::vector<eval_data<S> const *> const &e_dats,
+   ghqCpp::ghq_data const &ghq_dat) const {
+  // group the clusters by the number of random effects. The clusters which
+  // cannot be integrated in a batch are handled right away
+  std::map<size_t, std::vector<size_t> > groups;
+  for(size_t i = 0; i < e_dats.size(); ++i){
+    size_t const n_vars{par_idx.n_shared() + e_dats[i]->n_active_frailties()};
+    if(can_batch(cluster_indices[i], n_vars))
+      groups[n_vars].emplace_back(i);
+    else if(comp_grad)
+      res[i] = grad_cluster
+        (param, grs[i], mem, cluster_indices[i], *e_dats[i], ghq_dat);
+    else
+      res[i] = eval_cluster
+        (param, mem, cluster_indices[i], *e_dats[i], ghq_dat);
+  }
+
+  std::vector<std::unique_ptr<batch_cluster<S, comp_grad> > > batch;
+  std::vector<ghqCpp::ghq_problem const *> problems;
+  for(auto const &group : groups)
+    for(size_t start = 0; start < group.second.size(); start += max_batch){
+      size_t const n_batch{std::min(max_batch, group.second.size() - start)};
+
+      problems.clear();
+      size_t n_res{};
+      for(size_t i = start; i < start + n_batch; ++i){
+        size_t const idx{group.second[i]};
+        batch.emplace_back(new batch_cluster<S, comp_grad>
+          (*this, param, mem, cluster_indices[idx], *e_dats[idx]));
+        problems.emplace_back(&batch.back()->prob);
+        n_res += problems.back()->n_out();
+      }
+
+      {
+        double * const res_batch{mem.get(n_res)};
+        auto mem_mark = mem.set_mark_raii();
+        ghqCpp::ghq(res_batch, ghq_dat, problems, mem, 200);
+
+        double * res_i{res_batch};
+        for(size_t i = 0; i < n_batch; ++i){
+          size_t const idx{group.second[start + i]},
+                     n_out{problems[i]->n_out()};
+          res[idx] = comp_grad
+            ? add_grad(grs[idx], res_i, n_out, batch[i]->im)
+            : std::log(*res_i);
+          res_i += n_out;
+        }
+      }
+
+      // destruct the objects in the reverse order to turn back the memory
+      while(!batch.empty())
+        batch.pop_back();
+    }
+}
+
+double delayed_dat::operator()
+  (double const *param, ghqCpp::simple_mem_stack<double> &mem,
+   const vajoint_uint cluster_index, node_weight const &nws,
+   ghqCpp::ghq_data const &ghq_dat) const {
+  if(!has_cached_expansions()){
+    eval_data<double> const e_dat
+      {*this, nws, cluster_infos()[cluster_index], mem};
+    return eval_cluster(param, mem, cluster_index, e_dat, ghq_dat);
+  }
+
+  if(cache_as_float)
+    return eval_cluster
+      (param, mem, cluster_index, cached_expansions_float[cluster_index],
+       ghq_dat);
+  return eval_cluster
+    (param, mem, cluster_index, cached_expansions[cluster_index], ghq_dat);
+}
+
+double delayed_dat::grad
+  (double const *param, double *gr, ghqCpp::simple_mem_stack<double> &mem,
+   const vajoint_uint cluster_index, node_weight const &nws,
+   ghqCpp::ghq_data const &ghq_dat) const {
+  if(!has_cached_expansions()){
+    eval_data<double> const e_dat
+      {*this, nws, cluster_infos()[cluster_index], mem};
+    return grad_cluster(param, gr, mem, cluster_index, e_dat, ghq_dat);
+  }
+
+  if(cache_as_float)
+    return grad_cluster
+      (param, gr, mem, cluster_index, cached_expansions_float[cluster_index],
+       ghq_dat);
+  return grad_cluster
+    (param, gr, mem, cluster_index, cached_expansions[cluster_index],
+     ghq_dat);
+}
+
+void delayed_dat::eval_batch
+  (double const *param, double * const *grs, double *res,
+   ghqCpp::simple_mem_stack<double> &mem, vajoint_uint const *cluster_indices,
+   size_t const n_clusters, node_weight const &nws,
+   ghqCpp::ghq_data const &ghq_dat) const {
+  auto mem_mark = mem.set_mark_raii();
+  if(!has_cached_expansions()){
+    std::vector<std::unique_ptr<eval_data<double> const> > e_dats_mem;
+    std::vector<eval_data<double> const *> e_dats;
+    e_dats_mem.reserve(n_clusters);
+    e_dats.reserve(n_clusters);
+    for(size_t i = 0; i < n_clusters; ++i){
+      e_dats_mem.emplace_back(new eval_data<double>
+        (*this, nws, cluster_infos()[cluster_indices[i]], mem));
+      e_dats.emplace_back(e_dats_mem.back().get());
+    }
+    eval_batch_data(param, grs, res, mem, cluster_indices, e_dats, ghq_dat);
+    return;
+  }
+
+  if(cache_as_float){
+    std::vector<eval_data<float> const *> e_dats;
+    e_dats.reserve(n_clusters);
+    for(size_t i = 0; i < n_clusters; ++i)
+      e_dats.emplace_back(&cached_expansions_float[cluster_indices[i]]);
+    eval_batch_data(param, grs, res, mem, cluster_indices, e_dats, ghq_dat);
+    return;
+  }
+
+  std::vector<eval_data<double> const *> e_dats;
+  e_dats.reserve(n_clusters);
+  for(size_t i = 0; i < n_clusters; ++i)
+    e_dats.emplace_back(&cached_expansions[cluster_indices[i]]);
+  eval_batch_data(param, grs, res, mem, cluster_indices, e_dats, ghq_dat);
+}
 } // namespace survival
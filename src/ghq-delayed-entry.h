@@ -85,10 +85,17 @@ private:
    */
   std::vector<vajoint_uint> frailty_map;
 
-  /// helper class to evaluate the expected hazard and to compute gradient of it
-  struct eval_data;
-  friend class eval_data;
+  /**
+   * helper class to evaluate the expected hazard and to compute gradient of it.
+   * The basis expansions are stored as S which is either double or float
+   */
+  template<class S>
   struct eval_data {
+    /**
+     * the number of quadrature nodes for each survival outcome in the cluster.
+     * Some weights are zero if the intervals are split at the break points
+     */
+    vajoint_uint n_nodes;
     /// the scaled quadrature weights for each survival outcome in the cluster
     std::vector<double> quad_weights;
 
@@ -117,7 +124,7 @@ private:
      * are of different types. Thus, we store the blocks as a vector of
      * matrices.
      */
-    std::vector<simple_mat<double> > fixef_vary_basis;
+    std::vector<simple_mat<S> > fixef_vary_basis;
 
     /**
      * input to construct the random effect design matrix. The random effect
@@ -142,20 +149,32 @@ private:
      *    ~~~~~~~~~~~~~~~~~~~~~~~~~~
      *
      * Each of the l x k blocks consist of the sum of rows of basis expansions
-     * scaled by the association parameters. Thus, we have to store each block
-     * which as
-     *
-     * vector <-- marker 1 to k
-     *   vector <-- outcome 1 to l
-     *     vector <-- the associations for outcome l and marker k
-     *       matrix <-- blocks for each type of association. Dimensions are
-     *                  <n quadrature nodes> <dimension of the basis>
-     *
-     * TODO: a multidimensional arrays will likely be more efficient. All but
-     *       the association dimension are equal and that dimension could be
-     *       dealt with using some zero padding.
+     * scaled by the association parameters. Thus, we have to store a matrix
+     * for each type of association for each block. The matrices have
+     * dimensions <n quadrature nodes> x <dimension of the basis> and are stored
+     * contiguously in one array. Those of marker k and outcome l start at
+     * rng_basis_offsets[k * n_outcomes_v + l] and are followed by those for
+     * the other types of associations. Use rng_basis_block to get a pointer to
+     * a matrix.
      */
-    std::vector<std::vector<std::vector<simple_mat<double> > > > rng_basis;
+    std::vector<S> rng_basis;
+    /// the offsets into rng_basis of the matrices of each marker and outcome
+    std::vector<size_t> rng_basis_offsets;
+    /// the number of survival outcomes in the cluster
+    vajoint_uint n_outcomes_v;
+
+    /**
+     * returns a pointer to the matrix for marker k, outcome l, and association
+     * type v given the dimension of the basis of marker k
+     */
+    S const * rng_basis_block
+      (size_t const k, size_t const l, size_t const v,
+       size_t const n_basis) const {
+      return rng_basis.data() + rng_basis_offsets[k * n_outcomes_v + l] +
+        v * n_nodes * n_basis;
+    }
+
+    eval_data() = default;
 
     eval_data
       (delayed_dat const &dat, node_weight const &nws,
@@ -177,19 +196,149 @@ private:
   vajoint_uint n_markers() const { return bases_rng.size(); }
 
   /// struct to hide parts of the implementation
+  template<class S>
   struct impl;
-  friend class impl;
+  template<class S>
+  friend struct impl;
+
+  /// holds the objects needed to integrate a cluster in a batch
+  template<class S, bool comp_grad>
+  struct batch_cluster;
 
   /// holds memory for the cached data
-  std::vector<eval_data> cached_expansions;
+  std::vector<eval_data<double> > cached_expansions;
+  /// holds memory for the cached data if it is stored as floats
+  std::vector<eval_data<float> > cached_expansions_float;
+  /// true if the cached data is stored as floats
+  bool cache_as_float{false};
 
   /// the cached quadrature nodes and weights
   std::vector<double> cached_nodes, cached_weights;
 
+  /// the sorted break points of the bases for each type of outcome
+  std::vector<std::vector<double> > break_points_v;
+
+  /**
+   * true if the intervals are split at the break points and the quadrature
+   * rule is applied to each piece
+   */
+  bool split_at_knots_v{false};
+
+  /**
+   * the mode, the Cholesky decomposition, and the input to the integrand (the
+   * offsets, the design matrix, and the covariance matrix) from the last
+   * adaptation for a cluster
+   */
+  struct warm_start_state {
+    std::vector<double> mode, chol, inputs;
+  };
+  /// the warm start states for each cluster if they are used
+  mutable std::vector<warm_start_state> warm_start_states;
+  /// the tolerance used to decide whether to skip the adaptation
+  double warm_start_tol_v{-1};
+
+  bool use_warm_start() const {
+    return warm_start_states.size() > 0;
+  }
+
+  /**
+   * the sparse grids to use instead of the product rules if any. The i'th
+   * element is for the integrals with i + 1 random effects
+   */
+  std::vector<ghqCpp::sparse_grid> sparse_grids;
+  /// the level of the sparse grids
+  size_t sparse_level_v{};
+
+  /**
+   * the number of points of the randomized quasi-Monte Carlo method and the
+   * minimum number of random effects for which it is used. The method is not
+   * used if the number of points is zero
+   */
+  size_t rqmc_points_v{}, rqmc_min_vars_v{};
+
+  /**
+   * the number of threads used in the sweep over the quadrature nodes for the
+   * clusters with at least nested_min_obs_v delayed entries
+   */
+  unsigned nested_threads_v{1};
+  size_t nested_min_obs_v{};
+
+  /**
+   * applies the randomized quasi-Monte Carlo method, the sparse grid, or the
+   * product rule for the given cluster
+   */
+  void apply_quadrature
+    (double *res, ghqCpp::ghq_problem const &problem,
+     ghqCpp::ghq_data const &ghq_dat, ghqCpp::simple_mem_stack<double> &mem,
+     vajoint_uint const cluster_index) const;
+
+  /**
+   * returns the adaptive problem for a cluster. The mode from the previous
+   * call is used as the starting value with warm starts. The previous mode
+   * and Cholesky decomposition are re-used if the inputs to the integrand
+   * have not changed by more than the tolerance. n_inputs is the number of
+   * inputs which start at inputs.
+   */
+  ghqCpp::adaptive_problem get_adaptive_problem
+    (vajoint_uint const cluster_index, double const *inputs,
+     size_t const n_inputs, ghqCpp::ghq_problem const &problem,
+     ghqCpp::simple_mem_stack<double> &mem) const;
+
   bool has_cached_expansions() const {
-    return cached_expansions.size() > 0;
+    return cached_expansions.size() > 0 || cached_expansions_float.size() > 0;
   }
 
+  /// evaluates the delayed entry term given the data for a cluster
+  template<class S>
+  double eval_cluster
+    (double const *param, ghqCpp::simple_mem_stack<double> &mem,
+     const vajoint_uint cluster_index, eval_data<S> const &e_dat,
+     ghqCpp::ghq_data const &ghq_dat) const;
+
+  /// computes the gradient given the data for a cluster
+  template<class S>
+  double grad_cluster
+    (double const *param, double *gr, ghqCpp::simple_mem_stack<double> &mem,
+     const vajoint_uint cluster_index, eval_data<S> const &e_dat,
+     ghqCpp::ghq_data const &ghq_dat) const;
+
+  /**
+   * adds the gradient of a cluster to gr given the n_res results of the
+   * quadrature in res which are overwritten. Returns the log of the integral.
+   */
+  template<class S>
+  double add_grad
+    (double *gr, double *res, size_t const n_res, impl<S> const &im) const;
+
+  /**
+   * returns true if a cluster with n_vars random effects is integrated with
+   * the product rule without nested threads. These can be integrated in a
+   * batch.
+   */
+  bool can_batch
+    (vajoint_uint const cluster_index, size_t const n_vars) const;
+
+  /**
+   * evaluates the delayed entry terms of multiple clusters given the data for
+   * each cluster (see eval_batch)
+   */
+  template<class S>
+  void eval_batch_data
+    (double const *param, double * const *grs, double *res,
+     ghqCpp::simple_mem_stack<double> &mem,
+     vajoint_uint const *cluster_indices,
+     std::vector<eval_data<S> const *> const &e_dats,
+     ghqCpp::ghq_data const &ghq_dat) const;
+
+  /// the implementation of eval_batch_data with or without the gradient
+  template<class S, bool comp_grad>
+  void integrate_batch
+    (double const *param, double * const *grs, double *res,
+     ghqCpp::simple_mem_stack<double> &mem,
+     vajoint_uint const *cluster_indices,
+     std::vector<eval_data<S> const *> const &e_dats,
+     ghqCpp::ghq_data const &ghq_dat) const;
+
 public:
   delayed_dat() = default;
 
@@ -202,12 +351,69 @@ public:
               std::vector<cluster_info> const &cluster_infos,
               std::vector<std::vector<std::vector<int> > > &ders);
 
+  /**
+   * sets the cached expansions. They are stored as floats if as_float is true.
+   * This halves the memory but the results are only accurate to roughly
+   * single precision. The clusters are handled by n_threads threads. The
+   * first thread uses mem and the other threads use their own memory.
+   */
   void set_cached_expansions
-    (node_weight const &nws, ghqCpp::simple_mem_stack<double> &mem);
+    (node_weight const &nws, ghqCpp::simple_mem_stack<double> &mem,
+     bool const as_float = false, unsigned const n_threads = 1);
 
   /// clears the cached expansions
   void clear_cached_expansions();
 
+  /**
+   * sets whether [0, entry time] is split at the break points (e.g. the knots)
+   * of the bases and the quadrature rule is applied to each piece. The cached
+   * expansions are cleared if the value changes.
+   */
+  void set_split_at_knots(bool const split);
+
+  /**
+   * sets whether the modes of the integrands of each cluster are saved and
+   * used as starting values in the next evaluation. The mode and the Cholesky
+   * decomposition are re-used without any adaptation if the absolute change of
+   * each input to the integrand is less than or equal to tol times one plus
+   * the absolute value of the previous input. A negative tol implies that the
+   * adaptation is always performed.
+   */
+  void set_warm_start(bool const use, double const tol = -1);
+
+  /**
+   * sets the level of the sparse grids which are used instead of the product
+   * rules. Zero implies that the product rules are used.
+   */
+  void set_sparse_grid(size_t const level);
+
+  /**
+   * sets the number of points of the randomized quasi-Monte Carlo method
+   * which is used instead of the other quadrature rules for the clusters with
+   * at least min_vars random effects. The same scrambled Sobol sequence is used
+   * in every evaluation. Zero points implies that the method is not used.
+   */
+  void set_rqmc(size_t const n_points, size_t const min_vars = 5);
+
+  /**
+   * sets the number of threads used in the sweep over the product rule
+   * quadrature nodes for the clusters with at least min_obs delayed entries.
+   * This is to avoid that a few large clusters are handled by one thread while
+   * the other threads are idle. One thread implies that the clusters are
+   * handled by one thread.
+   *
+   * The clusters are evaluated within the parallel region of the element
+   * functions so the caller has to enable nested parallelism, e.g. with a
+   * nested_parallel_scope. Each of the outer threads may start n_threads
+   * threads so up to the product of the two may be active.
+   */
+  void set_nested_threads(unsigned const n_threads, size_t const min_obs);
+
+  /// returns the number of threads set with set_nested_threads
+  unsigned nested_threads() const {
+    return nested_threads_v;
+  }
+
   /// returns information about each cluster
   std::vector<cluster_info> const & cluster_infos() const {
     return v_cluster_infos;
@@ -227,6 +433,24 @@ public:
     (double const *param, double *gr, ghqCpp::simple_mem_stack<double> &mem,
      const vajoint_uint cluster_index, node_weight const &nws,
      ghqCpp::ghq_data const &ghq_dat) const;
+
+  /// the maximum number of clusters which are integrated in one sweep
+  static constexpr size_t max_batch{64};
+
+  /**
+   * evaluates the delayed entry terms of n_clusters clusters and writes them
+   * to res. The gradient of the i'th term is added to grs[i] if grs is not a
+   * nullptr. The clusters with the same number of random effects are
+   * integrated in batches of at most max_batch clusters in one sweep over the
+   * Gauss-Hermite quadrature nodes. This reduces the overhead when there are
+   * many small clusters. The clusters are integrated one at a time if a
+   * sparse grid, randomized quasi-Monte Carlo, or nested threads are used.
+   */
+  void eval_batch
+    (double const *param, double * const *grs, double *res,
+     ghqCpp::simple_mem_stack<double> &mem,
+     vajoint_uint const *cluster_indices, size_t const n_clusters,
+     node_weight const &nws, ghqCpp::ghq_data const &ghq_dat) const;
 };
 
 } // namespace survival
@@ -21,6 +21,12 @@ extern "C" {
      double const *beta, double *y, int const *incy,
      size_t);
 
+  void F77_NAME(dgemm)
+    (char const *transa, char const *transb, int const *m, int const *n,
+     int const *k, double const *alpha, double const *A, int const *lda,
+     double const *B, int const *ldb, double const *beta, double *C,
+     int const *ldc, size_t, size_t);
+
   void F77_NAME(dger)
     (int const *m, int const *n, double const *alpha, double const *x,
      int const *incx, double const *y, int const *incy, double const *A,
@@ -0,0 +1,102 @@
+#ifndef GHQ_VEC_EXP_H
+#define GHQ_VEC_EXP_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace ghqCpp {
+
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_bit_cast)
+#define GHQ_HAS_BUILTIN_BIT_CAST
+#endif
+#endif
+
+/**
+ * reinterprets the bits of an object like std::bit_cast in C++20. The builtin
+ * is used if available as memcpy prevents vectorization with some compilers
+ */
+template<class To, class From>
+inline To bit_cast(From const &x){
+  static_assert(sizeof(To) == sizeof(From), "sizes differ");
+#ifdef GHQ_HAS_BUILTIN_BIT_CAST
+  return __builtin_bit_cast(To, x);
+#else
+  To out;
+  std::memcpy(&out, &x, sizeof(To));
+  return out;
+#endif
+}
+
+/**
+ * computes the exponential function of the n elements in x and stores the
+ * result in out which may be x. The main loop has no branches or function
+ * calls so it can be vectorized by the compiler. The argument is reduced with
+ * x = k log(2) + r where |r| <= log(2) / 2 and exp(r) is approximated with a
+ * Taylor polynomial of degree 12. The relative error is a few ULPs. std::exp
+ * is used if any argument is not in the range where the result is a finite
+ * normal number (or is NaN) which is rare in practice.
+ */
+inline void vec_exp(double const *x, double *out, size_t const n){
+  constexpr double log2e{1.4426950408889634074},
+                  ln2_hi{6.93147180369123816490e-01},
+                  ln2_lo{1.90821492927058770002e-10},
+                   // within the log of the largest and smallest normal
+                   // number such that 2^k is a normal number
+                   x_max{709},
+                   x_min{-708},
+                   // adding and subtracting this number rounds to an integer
+                   round_shift{6755399441055744.};
+  constexpr std::uint64_t round_shift_bits{0x4338000000000000};
+
+  // check the range. The comparisons are false for NaN
+  bool in_range{true};
+  for(size_t i = 0; i < n; ++i)
+    in_range &= x[i] >= x_min && x[i] <= x_max;
+
+  if(!in_range){
+    for(size_t i = 0; i < n; ++i)
+      out[i] = std::exp(x[i]);
+    return;
+  }
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for(size_t i = 0; i < n; ++i){
+    double const xi{x[i]},
+                  t{xi * log2e + round_shift},
+                  k{t - round_shift},
+                  r{(xi - k * ln2_hi) - k * ln2_lo};
+
+    double p{1. / 479001600.};
+    p = p * r + 1. / 39916800.;
+    p = p * r + 1. / 3628800.;
+    p = p * r + 1. / 362880.;
+    p = p * r + 1. / 40320.;
+    p = p * r + 1. / 5040.;
+    p = p * r + 1. / 720.;
+    p = p * r + 1. / 120.;
+    p = p * r + 1. / 24.;
+    p = p * r + 1. / 6.;
+    p = p * r + .5;
+    p = p * r + 1.;
+    p = p * r + 1.;
+
+    // the lower bits of t contain k
+    std::uint64_t const two_k_bits
+      {(bit_cast<std::uint64_t>(t) - round_shift_bits + 1023) << 52};
+    out[i] = p * bit_cast<double>(two_k_bits);
+  }
+}
+
+/// computes the exponential function in place for n elements
+inline void vec_exp(double *x, size_t const n){
+  vec_exp(x, x, n);
+}
+
+} // namespace ghqCpp
+
+#endif
@@ -1,5 +1,16 @@
 #include "ghq.h"
 #include "ghq-lp-utils.h"
+#include <bitset>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <map>
+#include <random>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace ghqCpp {
 
@@ -35,10 +46,21 @@ adaptive_problem::adaptive_problem
   (ghq_problem const &problem, simple_mem_stack<double> &mem,
    double const rel_eps, PSQN::psqn_uint const max_it, double const c1,
    double const c2, double const gr_tol):
+  adaptive_problem
+    (problem, mem, nullptr, rel_eps, max_it, c1, c2, gr_tol) { }
+
+adaptive_problem::adaptive_problem
+  (ghq_problem const &problem, simple_mem_stack<double> &mem,
+   double const *mode_start, double const rel_eps,
+   PSQN::psqn_uint const max_it, double const c1, double const c2,
+   double const gr_tol):
   problem{problem} {
     // attempt to find the mode
     mode_problem my_mode_problem(problem, mem);
-    mu.zeros(n_vars());
+    if(mode_start)
+      mu = arma::vec(mode_start, n_vars());
+    else
+      mu.zeros(n_vars());
 
     double *bfgs_mem{mem.get(PSQN::bfgs_n_wmem(n_vars()))};
     auto bfgs_marker = mem.set_mark_raii();
@@ -75,6 +97,15 @@ adaptive_problem::adaptive_problem
     }
   }
 
+adaptive_problem::adaptive_problem
+  (ghq_problem const &problem, double const *mode, double const *chol):
+  problem{problem}, C(chol, problem.n_vars(), problem.n_vars()),
+  mu(mode, problem.n_vars()) {
+    sq_C_deter = 1;
+    for(arma::uword i = 0; i < C.n_cols; ++i)
+      sq_C_deter *= C(i, i);
+  }
+
 void adaptive_problem::eval
   (double const *points, size_t const n_points, double * __restrict__ outs,
    simple_mem_stack<double> &mem) const {
@@ -152,25 +183,42 @@ void ghq_fill_fixed
     ghq_fill_fixed(lvl - 1, points + n_points, weights, n_points, dat);
 }
 
-void ghq_inner
+/**
+ * evaluates the integrands of the problems and adds the weighted sum to res.
+ * The outputs of the problems are stored in one n_points x n_res matrix and
+ * res is the concatenation of the results of the problems.
+ */
+void ghq_leaf
   (double * __restrict__ res, size_t const n_res, double * const outs,
-   size_t const lvl, size_t const idx_fix, size_t const n_points,
-   size_t const n_vars, double * const points, double const * weights,
-   ghq_problem const &problem, ghq_data const &dat,
+   size_t const n_points, double const * points, double const * weights,
+   ghq_problem const * const * problems, size_t const n_problems,
    simple_mem_stack<double> &mem){
-  if(lvl == idx_fix){
-    // evaluate the integrand and add the result
-    problem.eval(points, n_points, outs, mem);
+  // evaluate the integrands and add the result
+  double * outs_i{outs};
+  for(size_t i = 0; i < n_problems; ++i){
+    problems[i]->eval(points, n_points, outs_i, mem);
     mem.reset_to_mark();
+    outs_i += n_points * problems[i]->n_out();
+  }
 
-    char const trans{'T'};
-    int const i_n_points = n_points, i_n_res = n_res, incxy{1};
-    double const alpha{1};
+  char const trans{'T'};
+  int const i_n_points = n_points, i_n_res = n_res, incxy{1};
+  double const alpha{1};
 
-    F77_CALL(dgemv)
-      (&trans, &i_n_points, &i_n_res, &alpha, outs, &i_n_points, weights,
-       &incxy, &alpha, res, &incxy, size_t(1));
+  F77_CALL(dgemv)
+    (&trans, &i_n_points, &i_n_res, &alpha, outs, &i_n_points, weights,
+     &incxy, &alpha, res, &incxy, size_t(1));
+}
 
+void ghq_inner
+  (double * __restrict__ res, size_t const n_res, double * const outs,
+   size_t const lvl, size_t const idx_fix, size_t const n_points,
+   size_t const n_vars, double * const points, double const * weights,
+   ghq_problem const * const * problems, size_t const n_problems,
+   ghq_data const &dat, simple_mem_stack<double> &mem){
+  if(lvl == idx_fix){
+    ghq_leaf(res, n_res, outs, n_points, points, weights, problems,
+             n_problems, mem);
     return;
   }
 
@@ -188,18 +236,114 @@ void ghq_inner
 
     // run the next level
     ghq_inner(res, n_res, outs, lvl - 1, idx_fix, n_points, n_vars, points,
-              weights_scaled, problem, dat, mem);
+              weights_scaled, problems, n_problems, dat, mem);
   }
 }
-} // namespace
 
-void ghq
+/**
+ * the same as ghq_inner at the top level but the work is split between the
+ * threads. The fixed block of n_points points is split into n_chunks chunks
+ * and each pair of a chunk and one of the n_configs configurations of the
+ * nodes of the first n_vars - idx_fix variables is a unit of work. Thus, the
+ * points are split when there are few configurations. Each thread has its own
+ * memory, points, and result which are added in the order of the threads at
+ * the end. The points and weights passed are those of the fixed part.
+ */
+void ghq_inner_parallel
+  (double * __restrict__ res, size_t const n_res, size_t const idx_fix,
+   size_t const n_points, size_t const n_vars, double const * points_fixed,
+   double const * weights_fixed, ghq_problem const * const * problems,
+   size_t const n_problems, ghq_data const &dat, size_t const n_configs,
+   unsigned const n_threads){
+  size_t const n_nodes{dat.n_nodes},
+               n_vary{n_vars - idx_fix},
+               n_chunks
+                 {std::min<size_t>
+                   (n_points, (n_threads + n_configs - 1) / n_configs)},
+               chunk_size{(n_points + n_chunks - 1) / n_chunks},
+               n_work{n_configs * n_chunks};
+  unsigned const n_threads_use
+    {static_cast<unsigned>(std::min<size_t>(n_threads, n_work))};
+  std::vector<double> res_threads(n_threads_use * n_res, 0);
+  std::exception_ptr failure;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads_use)
+#endif
+  {
+    simple_mem_stack<double> mem;
+    double * const points{mem.get(chunk_size * (n_vars + n_res + 1))},
+           * const outs{points + chunk_size * n_vars},
+           * const weights{outs + chunk_size * n_res};
+    auto mem_marker = mem.set_mark_raii();
+
+#ifdef _OPENMP
+    double * const res_thread
+      {res_threads.data() + omp_get_thread_num() * n_res};
+#pragma omp for schedule(static)
+#else
+    double * const res_thread{res_threads.data()};
+#endif
+    for(size_t work = 0; work < n_work; ++work){
+      size_t const config{work / n_chunks},
+                   start{(work % n_chunks) * chunk_size},
+                   n_cur{std::min(chunk_size, n_points - start)};
+
+      // the first variable changes the slowest as in ghq_inner
+      size_t rem{config};
+      double weight{1};
+      for(size_t k = n_vary; k-- > 0; rem /= n_nodes){
+        size_t const node{rem % n_nodes};
+        std::fill(points + k * n_cur, points + (k + 1) * n_cur,
+                  dat.nodes[node]);
+        weight *= dat.weights[node];
+      }
+      for(size_t k = 0; k < idx_fix; ++k)
+        std::copy
+          (points_fixed + k * n_points + start,
+           points_fixed + k * n_points + start + n_cur,
+           points + (n_vary + k) * n_cur);
+      for(size_t i = 0; i < n_cur; ++i)
+        weights[i] = weight * weights_fixed[start + i];
+
+      try {
+        ghq_leaf(res_thread, n_res, outs, n_cur, points, weights, problems,
+                 n_problems, mem);
+      } catch(...) {
+#ifdef _OPENMP
+#pragma omp critical(ghq_inner_parallel_failure)
+#endif
+        if(!failure)
+          failure = std::current_exception();
+      }
+    }
+  }
+
+  if(failure)
+    std::rethrow_exception(failure);
+
+  for(unsigned i = 0; i < n_threads_use; ++i)
+    for(size_t j = 0; j < n_res; ++j)
+      res[j] += res_threads[i * n_res + j];
+}
+
+/// performs the quadrature for one or more problems (see the ghq overloads)
+void ghq_problems
   (double * __restrict__ res, ghq_data const &ghq_data_in,
-   ghq_problem const &problem, simple_mem_stack<double> &mem,
-   size_t const target_size){
+   ghq_problem const * const * problems, size_t const n_problems,
+   simple_mem_stack<double> &mem, size_t const target_size,
+   unsigned const n_threads){
+  if(n_problems < 1)
+    return;
+
   size_t const n_nodes{ghq_data_in.n_nodes},
-               n_vars{problem.n_vars()},
-               n_out{problem.n_out()};
+               n_vars{problems[0]->n_vars()};
+  size_t n_out{};
+  for(size_t i = 0; i < n_problems; ++i){
+    if(problems[i]->n_vars() != n_vars)
+      throw std::invalid_argument("n_vars differs between the problems");
+    n_out += problems[i]->n_out();
+  }
 
   // checks
   if(n_out < 1)
@@ -242,10 +386,439 @@ void ghq
     (idx_fix, points + n_points * (n_vars - idx_fix), weights, n_points,
      ghq_data_use);
 
-  ghq_inner(res, n_out, outs, n_vars, idx_fix, n_points, n_vars, points,
-            weights, problem, ghq_data_use, mem);
+  // the number of configurations of the nodes which are not fixed
+  size_t n_configs{1};
+  for(size_t i = idx_fix; i < n_vars; ++i)
+    n_configs *= n_nodes;
+
+  if(n_threads > 1 && n_configs * n_points > 1)
+    ghq_inner_parallel
+      (res, n_out, idx_fix, n_points, n_vars,
+       points + n_points * (n_vars - idx_fix), weights, problems, n_problems,
+       ghq_data_use, n_configs, n_threads);
+  else
+    ghq_inner(res, n_out, outs, n_vars, idx_fix, n_points, n_vars, points,
+              weights, problems, n_problems, ghq_data_use, mem);
+
+  for(size_t i = 0; i < n_problems; ++i){
+    problems[i]->post_process(res, mem);
+    res += problems[i]->n_out();
+  }
+}
+} // namespace
+
+void ghq
+  (double * __restrict__ res, ghq_data const &ghq_data_in,
+   ghq_problem const &problem, simple_mem_stack<double> &mem,
+   size_t const target_size, unsigned const n_threads){
+  ghq_problem const * const problem_ptr{&problem};
+  ghq_problems
+    (res, ghq_data_in, &problem_ptr, 1, mem, target_size, n_threads);
+}
+
+void ghq
+  (double * __restrict__ res, ghq_data const &ghq_data_in,
+   std::vector<ghq_problem const *> const &problems,
+   simple_mem_stack<double> &mem, size_t const target_size,
+   unsigned const n_threads){
+  ghq_problems
+    (res, ghq_data_in, problems.data(), problems.size(), mem, target_size,
+     n_threads);
+}
+
+void gauss_hermite_rule(size_t const n, double *nodes, double *weights){
+  if(n < 1)
+    throw std::invalid_argument("n < 1");
+
+  // the eigenvalues of the Jacobi matrix are the nodes and the weights are
+  // the squared first elements of the normalized eigenvectors
+  arma::mat jacobi(n, n, arma::fill::zeros);
+  for(size_t i = 0; i + 1 < n; ++i)
+    jacobi(i, i + 1) = jacobi(i + 1, i) = std::sqrt(static_cast<double>(i + 1));
+
+  arma::vec vals;
+  arma::mat vecs;
+  if(!arma::eig_sym(vals, vecs, jacobi))
+    throw std::runtime_error("eig_sym failed");
+
+  // make the rule exactly symmetric
+  for(size_t i = 0; i < n / 2; ++i){
+    double const node{(vals[n - 1 - i] - vals[i]) / 2},
+               weight{(vecs(0, i) * vecs(0, i) +
+                       vecs(0, n - 1 - i) * vecs(0, n - 1 - i)) / 2};
+    nodes[i] = -node;
+    nodes[n - 1 - i] = node;
+    weights[i] = weights[n - 1 - i] = weight;
+  }
+  if(n % 2 == 1){
+    nodes[n / 2] = 0;
+    weights[n / 2] = vecs(0, n / 2) * vecs(0, n / 2);
+  }
+}
+
+sparse_grid::sparse_grid(size_t const n_vars, size_t const level):
+  v_n_vars{n_vars} {
+  if(n_vars < 1)
+    throw std::invalid_argument("n_vars < 1");
+  else if(level < 1)
+    throw std::invalid_argument("level < 1");
+
+  // the one-dimensional rules with 1, 3, ..., 2 x level - 1 nodes
+  std::vector<std::vector<double> > nodes_1d(level), weights_1d(level);
+  for(size_t l = 0; l < level; ++l){
+    nodes_1d[l].resize(2 * l + 1);
+    weights_1d[l].resize(2 * l + 1);
+    gauss_hermite_rule(2 * l + 1, nodes_1d[l].data(), weights_1d[l].data());
+  }
+
+  auto binom = [](size_t const n, size_t const k){
+    double out{1};
+    for(size_t i = 1; i <= k; ++i)
+      out *= static_cast<double>(n - k + i) / static_cast<double>(i);
+    return out;
+  };
+
+  // add the tensor product rules of Smolyak's formula. The zero-based
+  // indices, i, of the one-dimensional rules satisfy
+  // level - n_vars <= |i| <= level - 1 and the coefficients are
+  // (-1)^(level - 1 - |i|) x choose(n_vars - 1, level - 1 - |i|). The same
+  // points are merged
+  std::map<std::vector<double>, double> point_weights;
+  std::vector<size_t> idx(n_vars), node_idx(n_vars);
+  std::vector<double> point(n_vars);
+  size_t const q{level - 1};
+
+  auto add_tensor_rule = [&](size_t const sum_idx){
+    size_t const diff{q - sum_idx};
+    double const coef
+      {(diff % 2 == 0 ? 1. : -1.) * binom(n_vars - 1, diff)};
+
+    std::fill(node_idx.begin(), node_idx.end(), 0);
+    for(;;){
+      double weight{coef};
+      for(size_t j = 0; j < n_vars; ++j){
+        point[j] = nodes_1d[idx[j]][node_idx[j]];
+        weight *= weights_1d[idx[j]][node_idx[j]];
+      }
+      point_weights[point] += weight;
+
+      // move to the next node
+      size_t j{};
+      for(; j < n_vars; ++j){
+        if(++node_idx[j] < nodes_1d[idx[j]].size())
+          break;
+        node_idx[j] = 0;
+      }
+      if(j == n_vars)
+        break;
+    }
+  };
+
+  // loops over the indices with |i| <= q in the order of the first index
+  std::function<void(size_t, size_t)> add_indices =
+    [&](size_t const dim, size_t const sum_idx){
+      if(dim == n_vars){
+        if(sum_idx + n_vars > q)
+          add_tensor_rule(sum_idx);
+        return;
+      }
+
+      for(size_t i = 0; sum_idx + i <= q; ++i){
+        idx[dim] = i;
+        add_indices(dim + 1, sum_idx + i);
+      }
+    };
+  add_indices(0, 0);
+
+  // store the points and weights
+  v_n_points = point_weights.size();
+  v_points.resize(v_n_points * n_vars);
+  v_weights.resize(v_n_points);
+  size_t i{};
+  for(auto const &pw : point_weights){
+    for(size_t j = 0; j < n_vars; ++j)
+      v_points[i + j * v_n_points] = pw.first[j];
+    v_weights[i++] = pw.second;
+  }
+}
+
+void ghq
+  (double * __restrict__ res, sparse_grid const &grid,
+   ghq_problem const &problem, simple_mem_stack<double> &mem,
+   size_t const target_size){
+  size_t const n_vars{problem.n_vars()},
+               n_out{problem.n_out()},
+            n_points{grid.n_points()};
+
+  // checks
+  if(n_out < 1)
+    return;
+  else if(grid.n_vars() != n_vars)
+    throw std::invalid_argument("grid.n_vars() != n_vars");
+
+  size_t const n_batch
+    {std::min(std::max<size_t>(target_size, 1), n_points)};
+  double * const points{mem.get(n_batch * (n_vars + n_out))},
+         * const outs{points + n_batch * n_vars};
+  auto mem_marker = mem.set_mark_raii();
+
+  std::fill(res, res + n_out, 0);
+  for(size_t start = 0; start < n_points; start += n_batch){
+    size_t const n_cur{std::min(n_batch, n_points - start)};
+    for(size_t j = 0; j < n_vars; ++j)
+      std::copy
+        (grid.points() + j * n_points + start,
+         grid.points() + j * n_points + start + n_cur, points + j * n_cur);
+
+    // evaluate the integrand and add the result
+    problem.eval(points, n_cur, outs, mem);
+    mem.reset_to_mark();
+
+    char const trans{'T'};
+    int const i_n_points = n_cur, i_n_res = n_out, incxy{1};
+    double const alpha{1};
+
+    F77_CALL(dgemv)
+      (&trans, &i_n_points, &i_n_res, &alpha, outs, &i_n_points,
+       grid.weights() + start, &incxy, &alpha, res, &incxy, size_t(1));
+  }
+
+  problem.post_process(res, mem);
+}
+
+namespace {
+/**
+ * the degree, the coefficients of the primitive polynomial, and the initial
+ * direction numbers from Joe and Kuo (2008) for the second and the following
+ * dimensions of the Sobol sequence
+ */
+struct sobol_init {
+  unsigned s, a, m[7];
+};
+
+constexpr sobol_init sobol_inits[]
+  {{1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}, {3, 2, {1, 1, 1}},
+   {4, 1, {1, 1, 3, 3}}, {4, 4, {1, 3, 5, 13}}, {5, 2, {1, 1, 5, 5, 17}},
+   {5, 4, {1, 1, 5, 5, 5}}, {5, 7, {1, 1, 7, 11, 19}},
+   {5, 11, {1, 1, 5, 1, 1}}, {5, 13, {1, 1, 1, 3, 11}},
+   {5, 14, {1, 3, 5, 5, 31}}, {6, 1, {1, 3, 3, 9, 7, 49}},
+   {6, 13, {1, 1, 1, 15, 21, 21}}, {6, 16, {1, 3, 1, 13, 27, 49}},
+   {6, 19, {1, 1, 1, 15, 7, 5}}, {6, 22, {1, 3, 1, 15, 13, 25}},
+   {6, 25, {1, 1, 5, 5, 19, 61}}, {7, 1, {1, 3, 7, 11, 23, 15, 103}},
+   {7, 4, {1, 3, 7, 13, 13, 15, 69}}};
+
+static_assert
+  (sizeof(sobol_inits) / sizeof(sobol_init) + 1 == rqmc_max_vars,
+   "rqmc_max_vars does not match the number of direction numbers");
+
+constexpr unsigned sobol_bits{32};
+
+/**
+ * the quantile function of the standard normal distribution using the
+ * algorithm by Acklam with one step of Halley's method
+ */
+double qnorm_std(double const p){
+  constexpr double a[]{-3.969683028665376e+01, 2.209460984245205e+02,
+                       -2.759285104469687e+02, 1.383577518672690e+02,
+                       -3.066479806614716e+01, 2.506628277459239e+00},
+                   b[]{-5.447609879822406e+01, 1.615858368580409e+02,
+                       -1.556989798598866e+02, 6.680131188771972e+01,
+                       -1.328068155288572e+01},
+                   c[]{-7.784894002430293e-03, -3.223964580411365e-01,
+                       -2.400758277161838e+00, -2.549732539343734e+00,
+                       4.374664141464968e+00, 2.938163982698783e+00},
+                   d[]{7.784695709041462e-03, 3.224671290700398e-01,
+                       2.445134137142996e+00, 3.754408661907416e+00},
+               p_low{0.02425};
+
+  double x;
+  if(p < p_low){
+    double const q{std::sqrt(-2 * std::log(p))};
+    x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+      ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+  } else if(p <= 1 - p_low){
+    double const q{p - .5},
+                 r{q * q};
+    x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) *
+      q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+  } else {
+    double const q{std::sqrt(-2 * std::log1p(-p))};
+    x = -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+      ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+  }
+
+  // refine the solution
+  constexpr double sqrt_2pi{2.506628274631000502415765284811},
+                  sqrt_half{0.707106781186547524400844362105};
+  double const e{.5 * std::erfc(-x * sqrt_half) - p},
+               u{e * sqrt_2pi * std::exp(x * x / 2)};
+  return x - u / (1 + x * u / 2);
+}
+
+/**
+ * a Sobol sequence with a random linear matrix scrambling and a random
+ * digital shift. The points are generated in Gray code order.
+ */
+class scrambled_sobol {
+  size_t n_vars;
+  /// the n_vars x sobol_bits scrambled direction numbers
+  std::vector<uint32_t> directions;
+  /// the current point before the digital shift and the shifts
+  std::vector<uint32_t> cur, shifts;
+  /// the index of the next point
+  uint32_t idx{};
+
+public:
+  scrambled_sobol(size_t const n_vars, std::mt19937 &gen):
+  n_vars{n_vars}, directions(n_vars * sobol_bits), cur(n_vars),
+  shifts(n_vars) {
+    if(n_vars > rqmc_max_vars)
+      throw std::invalid_argument("n_vars > rqmc_max_vars");
+
+    std::vector<uint32_t> dirs(sobol_bits), lower(sobol_bits);
+    for(size_t j = 0; j < n_vars; ++j){
+      // the direction numbers of the unscrambled sequence
+      if(j == 0)
+        for(unsigned k = 0; k < sobol_bits; ++k)
+          dirs[k] = uint32_t{1} << (sobol_bits - 1 - k);
+      else {
+        sobol_init const &init = sobol_inits[j - 1];
+        for(unsigned k = 0; k < init.s; ++k)
+          dirs[k] = init.m[k] << (sobol_bits - 1 - k);
+        for(unsigned k = init.s; k < sobol_bits; ++k){
+          dirs[k] = dirs[k - init.s] ^ (dirs[k - init.s] >> init.s);
+          for(unsigned i = 1; i < init.s; ++i)
+            if((init.a >> (init.s - 1 - i)) & 1)
+              dirs[k] ^= dirs[k - i];
+        }
+      }
+
+      // the rows of a random lower triangular matrix with ones in the
+      // diagonal where the first row is the most significant bit
+      for(unsigned i = 0; i < sobol_bits; ++i){
+        uint32_t const upper_bits
+          {i == 0 ? uint32_t{} : ~uint32_t{} << (sobol_bits - i)};
+        lower[i] = (uint32_t{1} << (sobol_bits - 1 - i)) |
+          (static_cast<uint32_t>(gen()) & upper_bits);
+      }
+
+      uint32_t * const dirs_j{directions.data() + j * sobol_bits};
+      for(unsigned k = 0; k < sobol_bits; ++k){
+        dirs_j[k] = 0;
+        for(unsigned i = 0; i < sobol_bits; ++i)
+          if(std::bitset<sobol_bits>(dirs[k] & lower[i]).count() % 2)
+            dirs_j[k] |= uint32_t{1} << (sobol_bits - 1 - i);
+      }
+
+      shifts[j] = static_cast<uint32_t>(gen());
+    }
+  }
+
+  /**
+   * writes the next point transformed to the standard normal distribution to
+   * point[0], point[stride], ..., point[(n_vars - 1) * stride]
+   */
+  void next(double *point, size_t const stride){
+    if(idx > 0){
+      unsigned c{};
+      for(uint32_t i = idx; !(i & 1); i >>= 1)
+        ++c;
+      for(size_t j = 0; j < n_vars; ++j)
+        cur[j] ^= directions[c + j * sobol_bits];
+    }
+    ++idx;
+
+    constexpr double scale{1. / 4294967296.};
+    for(size_t j = 0; j < n_vars; ++j, point += stride)
+      *point = qnorm_std
+        ((static_cast<double>(cur[j] ^ shifts[j]) + .5) * scale);
+  }
+};
+
+} // namespace
+
+void rqmc
+  (double * __restrict__ res, double * __restrict__ std_err,
+   ghq_problem const &problem, simple_mem_stack<double> &mem,
+   size_t const n_points, size_t const n_replicates, unsigned const seed,
+   size_t const target_size){
+  size_t const n_vars{problem.n_vars()},
+               n_out{problem.n_out()};
 
+  // checks
+  if(n_out < 1)
+    return;
+  else if(n_vars > rqmc_max_vars)
+    throw std::invalid_argument("n_vars > rqmc_max_vars");
+  else if(n_points < 1)
+    throw std::invalid_argument("n_points < 1");
+  else if(n_replicates < 1)
+    throw std::invalid_argument("n_replicates < 1");
+
+  size_t const n_batch
+    {std::min(std::max<size_t>(target_size, 1), n_points)};
+  double * const points
+    {mem.get(n_batch * (n_vars + n_out + 1) + n_replicates * n_out)},
+         * const outs{points + n_batch * n_vars},
+         * const weights{outs + n_batch * n_out},
+         * const rep_res{weights + n_batch};
+  auto mem_marker = mem.set_mark_raii();
+  std::fill(weights, weights + n_batch, 1. / static_cast<double>(n_points));
+
+  // compute the estimate of each replicate
+  std::mt19937 gen{seed};
+  for(size_t r = 0; r < n_replicates; ++r){
+    double * const res_r{rep_res + r * n_out};
+    std::fill(res_r, res_r + n_out, 0);
+    scrambled_sobol seq(n_vars, gen);
+
+    for(size_t start = 0; start < n_points; start += n_batch){
+      size_t const n_cur{std::min(n_batch, n_points - start)};
+      for(size_t i = 0; i < n_cur; ++i)
+        seq.next(points + i, n_cur);
+
+      // evaluate the integrand and add the result
+      problem.eval(points, n_cur, outs, mem);
+      mem.reset_to_mark();
+
+      char const trans{'T'};
+      int const i_n_points = n_cur, i_n_res = n_out, incxy{1};
+      double const alpha{1};
+
+      F77_CALL(dgemv)
+        (&trans, &i_n_points, &i_n_res, &alpha, outs, &i_n_points,
+         weights, &incxy, &alpha, res_r, &incxy, size_t(1));
+    }
+  }
+
+  // compute the estimate
+  std::fill(res, res + n_out, 0);
+  for(size_t r = 0; r < n_replicates; ++r)
+    for(size_t i = 0; i < n_out; ++i)
+      res[i] += rep_res[i + r * n_out] / static_cast<double>(n_replicates);
   problem.post_process(res, mem);
+
+  if(!std_err)
+    return;
+  else if(n_replicates < 2){
+    std::fill
+      (std_err, std_err + n_out, std::numeric_limits<double>::quiet_NaN());
+    return;
+  }
+
+  // estimate the standard errors from the post processed replicates
+  double const n_rep_dbl = n_replicates;
+  std::fill(std_err, std_err + n_out, 0);
+  for(size_t r = 0; r < n_replicates; ++r){
+    double * const res_r{rep_res + r * n_out};
+    problem.post_process(res_r, mem);
+    for(size_t i = 0; i < n_out; ++i){
+      double const diff{res_r[i] - res[i]};
+      std_err[i] += diff * diff;
+    }
+  }
+  for(size_t i = 0; i < n_out; ++i)
+    std_err[i] = std::sqrt(std_err[i] / ((n_rep_dbl - 1) * n_rep_dbl));
 }
 
 combined_problem::combined_problem
@@ -86,12 +86,37 @@ struct ghq_data {
  * integrands to simultaneously process. However, at least the number of
  * quadrature nodes is simultaneously processed.
  *
+ * The sweep over the quadrature nodes is split between n_threads threads if
+ * n_threads is greater than one. The block of points is split as well so all
+ * the threads are used even when all the nodes fit in one block. The eval
+ * member function of the problem must then be thread-safe. Each thread uses
+ * its own memory and mem is only used for the post-processing. A nested
+ * parallel region is used if the function is called within a parallel region
+ * so nested parallelism must be enabled for this to have an effect. Each
+ * thread of the enclosing team may then start n_threads threads.
+ *
  * The res pointer needs to have enough memory for problem.n_out().
  */
 void ghq
   (double * __restrict__ res, ghq_data const &ghq_data_in,
    ghq_problem const &problem, simple_mem_stack<double> &mem,
-   size_t const target_size = 128);
+   size_t const target_size = 128, unsigned const n_threads = 1);
+
+/**
+ * performs the quadrature for multiple independent problems with the same
+ * number of variables in one sweep over the quadrature nodes. The outputs of
+ * all the problems are stored in one matrix such that the weighted sum is
+ * computed with one dgemv call for each block of points. This reduces the
+ * overhead when there are many problems with few variables.
+ *
+ * The res pointer needs to have enough memory for the sum of n_out() of the
+ * problems. The results of each problem follow those of the previous problem.
+ */
+void ghq
+  (double * __restrict__ res, ghq_data const &ghq_data_in,
+   std::vector<ghq_problem const *> const &problems,
+   simple_mem_stack<double> &mem, size_t const target_size = 128,
+   unsigned const n_threads = 1);
 
 /// overload where the user does not pre-allocated memory
 inline std::vector<double> ghq
@@ -102,6 +127,87 @@ inline std::vector<double> ghq
   return out;
 }
 
+/**
+ * computes the n-point Gauss-Hermite rule for the integral
+ *
+ *   int phi(x)f(x)dx
+ *
+ * where phi is the standard normal density. The Golub-Welsch algorithm is
+ * used.
+ */
+void gauss_hermite_rule(size_t const n, double *nodes, double *weights);
+
+/**
+ * sparse grid rule for the integral
+ *
+ *   int phi(x)g(x)dx
+ *
+ * where phi(x) is a given dimensional standard multivariate normal
+ * distribution. The rule is constructed with Smolyak's formula from
+ * Gauss-Hermite rules with 1, 3, ..., 2 x level - 1 nodes. It is exact for
+ * polynomials with a total degree up to 2 x level - 1 and the number of points
+ * grows polynomially rather than exponentially in the dimension. Some weights
+ * are negative.
+ */
+class sparse_grid {
+  size_t v_n_vars{}, v_n_points{};
+  /// the n_points x n_vars matrix with the points
+  std::vector<double> v_points;
+  std::vector<double> v_weights;
+
+public:
+  sparse_grid() = default;
+  sparse_grid(size_t const n_vars, size_t const level);
+
+  size_t n_vars() const { return v_n_vars; }
+  size_t n_points() const { return v_n_points; }
+  double const * points() const { return v_points.data(); }
+  double const * weights() const { return v_weights.data(); }
+};
+
+/**
+ * performs the quadrature with a sparse grid rule. The target_size is the
+ * maximum number of integrands to simultaneously process.
+ *
+ * The res pointer needs to have enough memory for problem.n_out().
+ */
+void ghq
+  (double * __restrict__ res, sparse_grid const &grid,
+   ghq_problem const &problem, simple_mem_stack<double> &mem,
+   size_t const target_size = 128);
+
+/// overload where the user does not pre-allocated memory
+inline std::vector<double> ghq
+  (sparse_grid const &grid, ghq_problem const &problem,
+   simple_mem_stack<double> &mem, size_t const target_size = 128){
+  std::vector<double> out(problem.n_out());
+  ghq(out.data(), grid, problem, mem, target_size);
+  return out;
+}
+
+/// the maximum number of variables supported by rqmc
+constexpr size_t rqmc_max_vars{21};
+
+/**
+ * performs randomized quasi-Monte Carlo integration with scrambled Sobol
+ * sequences. n_replicates independently scrambled sequences with n_points
+ * points each are used and powers of two are preferable for n_points. The
+ * sequences are scrambled with a random linear matrix scrambling and a random
+ * digital shift using a pseudo-random number generator with the passed seed.
+ * Thus, the result is deterministic given the seed.
+ *
+ * The estimate is written to res. The standard errors estimated from the
+ * replicates are written to std_err if it is not a nullptr. They are NaN if
+ * n_replicates is one. Both pointers need to have enough memory for
+ * problem.n_out(). The target_size is the maximum number of integrands to
+ * simultaneously process.
+ */
+void rqmc
+  (double * __restrict__ res, double * __restrict__ std_err,
+   ghq_problem const &problem, simple_mem_stack<double> &mem,
+   size_t const n_points, size_t const n_replicates = 8,
+   unsigned const seed = 1, size_t const target_size = 128);
+
 /**
  * Takes the integral
  *
@@ -157,9 +263,32 @@ public:
      double const rel_eps = 1e-6, PSQN::psqn_uint const max_it = 1000L,
      double const c1 = .0001, double const c2 = .9, double const gr_tol = -1);
 
+  /**
+   * the same as the other constructor but the search for the mode starts at
+   * mode_start if it is not a nullptr. This is useful when the mode of a
+   * similar problem is known.
+   */
+  adaptive_problem
+    (ghq_problem const &problem, simple_mem_stack<double> &mem,
+     double const *mode_start, double const rel_eps = 1e-6,
+     PSQN::psqn_uint const max_it = 1000L, double const c1 = .0001,
+     double const c2 = .9, double const gr_tol = -1);
+
+  /**
+   * uses the passed mode and upper triangular Cholesky decomposition, e.g.
+   * from a previous adaptive_problem, rather than finding them.
+   */
+  adaptive_problem
+    (ghq_problem const &problem, double const *mode, double const *chol);
+
   size_t n_vars() const { return v_n_vars; }
   size_t n_out() const { return v_n_out; }
 
+  /// returns the mode that is used
+  arma::vec const & mode() const { return mu; }
+  /// returns the upper triangular Cholesky decomposition that is used
+  arma::mat const & chol() const { return C; }
+
   void eval
   (double const *points, size_t const n_points, double * __restrict__ outs,
    simple_mem_stack<double> &mem) const;
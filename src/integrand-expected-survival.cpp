@@ -1,5 +1,6 @@
 #include "integrand-expected-survival.h"
 #include "ghq-lp-utils.h"
+#include "ghq-vec-exp.h"
 
 namespace ghqCpp {
 
@@ -18,25 +19,64 @@ void expected_survival_term<comp_grad>::eval
   (double const *points, size_t const n_points, double * __restrict__ outs,
    simple_mem_stack<double> &mem) const {
   size_t const n_lps = M.n_rows;
-  double * const __restrict__ lps{comp_grad ? outs + n_points
-                                            : mem.get(n_lps * n_points)};
-  auto mem_mark = mem.set_mark_raii();
+  if constexpr(!comp_grad){
+    // work with chunks of the linear predictors so the memory does not grow
+    // with the number of linear predictors
+    size_t const n_chunk{std::min<size_t>(n_lps, n_lps_chunk)};
+    double * const __restrict__ lps{mem.get(n_chunk * n_points)};
+    auto mem_mark = mem.set_mark_raii();
+
+    std::fill(outs, outs + n_points, 0);
+    for(size_t start = 0; start < n_lps; start += n_chunk){
+      size_t const n_lps_i{std::min(n_chunk, n_lps - start)};
+
+      for(size_t i = 0; i < n_lps_i; ++i)
+        std::fill(lps + i * n_points, lps + (i + 1) * n_points,
+                  eta[start + i]);
+
+      if(n_vars() > 0){
+        int const i_n_points = n_points, i_n_lps_i = n_lps_i,
+                  i_n_vars = n_vars(), i_n_lps = n_lps;
+        constexpr double d_ONE{1};
+        constexpr char trans_a{'N'}, trans_b{'T'};
+
+        F77_CALL(dgemm)
+          (&trans_a, &trans_b, &i_n_points, &i_n_lps_i, &i_n_vars, &d_ONE,
+           points, &i_n_points, M.begin() + start, &i_n_lps, &d_ONE, lps,
+           &i_n_points, size_t(1), size_t(1));
+      }
+
+      vec_exp(lps, n_points * n_lps_i);
+
+      // add the weighted terms
+      for(size_t i = 0; i < n_lps_i; ++i)
+        for(size_t j = 0; j < n_points; ++j)
+          outs[j] -= weights[start + i] * lps[j + i * n_points];
+    }
+
+    vec_exp(outs, n_points);
+    return;
+  }
+
+  double * const __restrict__ lps{outs + n_points};
 
   // add the offset
   for(size_t i = 0; i < n_lps; ++i)
     std::fill(lps + i * n_points, lps + (i + 1) * n_points, eta[i]);
 
-  // add the terms from the random effects
-  {
-    double const * m{M.begin()};
-    for(size_t k = 0; k < n_vars(); ++k)
-      for(size_t i = 0; i < n_lps; ++i)
-        for(size_t j = 0; j < n_points; ++j)
-          lps[j + i * n_points] += m[i + k * n_lps] * points[j + k * n_points];
+  // add the terms from the random effects. That is, points x M^T
+  if(n_vars() > 0){
+    int const i_n_points = n_points, i_n_lps = n_lps, i_n_vars = n_vars();
+    constexpr double d_ONE{1};
+    constexpr char trans_a{'N'}, trans_b{'T'};
+
+    F77_CALL(dgemm)
+      (&trans_a, &trans_b, &i_n_points, &i_n_lps, &i_n_vars, &d_ONE, points,
+       &i_n_points, M.begin(), &i_n_lps, &d_ONE, lps, &i_n_points, size_t(1),
+       size_t(1));
   }
 
-  for(size_t ij = 0; ij < n_points * n_lps; ++ij)
-    lps[ij] = std::exp(lps[ij]);
+  vec_exp(lps, n_points * n_lps);
 
   // weight the points
   for(size_t i = 0; i < n_lps; ++i)
@@ -48,30 +88,26 @@ void expected_survival_term<comp_grad>::eval
   for(size_t i = 0; i < n_lps; ++i)
     for(size_t j = 0; j < n_points; ++j)
       outs[j] += lps[j + i * n_points];
-  for(size_t j = 0; j < n_points; ++j)
-    outs[j] = std::exp(outs[j]);
-
-  if constexpr(comp_grad){
-    double * const __restrict__ d_lps{outs + n_points};
+  vec_exp(outs, n_points);
 
-    // finish the computation of the derivatives w.r.t. each linear predictor
-    for(size_t i = 0; i < n_lps; ++i)
-      for(size_t j = 0; j < n_points; ++j)
-        d_lps[j + i * n_points] *= outs[j];
+  double * const __restrict__ d_lps{outs + n_points};
 
-    // the derivatives w.r.t. eta are already set
-    outs += n_points;
+  // finish the computation of the derivatives w.r.t. each linear predictor
+  for(size_t i = 0; i < n_lps; ++i)
+    for(size_t j = 0; j < n_points; ++j)
+      d_lps[j + i * n_points] *= outs[j];
 
-    // compute the derivatives w.r.t. M
-    outs += n_points * n_lps;
+  // the derivatives w.r.t. eta are already set
+  outs += n_points;
 
-    for(size_t k = 0; k < n_vars(); ++k)
-      for(size_t i = 0; i < n_lps; ++i)
-        for(size_t j = 0; j < n_points; ++j)
-          outs[j + i * n_points + k * n_points * n_lps] =
-            d_lps[j + i * n_points] * points[j + k * n_points];
+  // compute the derivatives w.r.t. M
+  outs += n_points * n_lps;
 
-  }
+  for(size_t k = 0; k < n_vars(); ++k)
+    for(size_t i = 0; i < n_lps; ++i)
+      for(size_t j = 0; j < n_points; ++j)
+        outs[j + i * n_points + k * n_points * n_lps] =
+          d_lps[j + i * n_points] * points[j + k * n_points];
 }
 
 template<bool comp_grad>
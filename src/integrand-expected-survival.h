@@ -12,7 +12,9 @@ namespace ghqCpp {
  *
  * given n weights and offsets w and eta and a matrix M of dimension n x R.
  *
- * The derivatives are computed w.r.t. the vector eta and the matrix M
+ * The derivatives are computed w.r.t. the vector eta and the matrix M.
+ * Without the derivatives, the linear predictors are computed in chunks of
+ * n_lps_chunk such that the working memory does not grow with n.
  */
 template<bool comp_grad = false>
 class expected_survival_term final : public ghq_problem {
@@ -24,6 +26,9 @@ class expected_survival_term final : public ghq_problem {
     {comp_grad ? 1  + eta.n_elem + M.n_elem : 1};
 
 public:
+  /// the maximum number of linear predictors to compute at a time
+  static constexpr size_t n_lps_chunk{256};
+
   expected_survival_term
   (arma::vec const &eta, arma::vec const &weights, arma::mat const &M);
 
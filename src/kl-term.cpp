@@ -209,3 +209,95 @@ double kl_term::grad(double *g, double const *param, double *wk_mem) const {
 
   return eval(param, wk_mem);
 }
+
+void kl_term::hess_vec(double *res, double const *param, double const *dir,
+                       double *wk_mem) const {
+  if(!has_vcov and !has_vcov_surv)
+    return;
+
+  double const * const va_mean = param + idx.va_mean(),
+               * const va_vcov = param + idx.va_vcov(),
+               * const d_va_mean = dir + idx.va_mean(),
+               * const d_va_vcov = dir + idx.va_vcov();
+
+  vajoint_uint const n_shared = idx.n_shared(),
+                n_shared_surv = idx.n_shared_surv();
+
+  // the term from the log determinant of the VA covariance matrix
+  auto handle_sub_part = [&](vajoint_uint const offset, vajoint_uint const dim){
+    arma::mat va_cov_mat(wk_mem, dim, dim, false),
+              inv_mat   (va_cov_mat.end(), dim, dim, false),
+              d_va_cov_mat(inv_mat.end(), dim, dim, false),
+              term      (d_va_cov_mat.end(), dim, dim, false);
+    copy_sub_mat(va_cov_mat.memptr(), va_vcov, offset, dim, n_vars);
+    copy_sub_mat(d_va_cov_mat.memptr(), d_va_vcov, offset, dim, n_vars);
+
+    if(!arma::inv_sympd(inv_mat, va_cov_mat))
+      throw std::runtime_error("inv(va_cov_mat) failed");
+
+    term = inv_mat * d_va_cov_mat * inv_mat;
+    lp_joint::mat_add(res + idx.va_vcov(), term.memptr(), dim, n_vars,
+                      offset, .5);
+  };
+
+  if(which_terms == lb_terms::markers && n_shared_surv)
+    handle_sub_part(0, n_shared);
+  else if(which_terms == lb_terms::surv && n_shared)
+    handle_sub_part(n_shared, n_shared_surv);
+  else
+    handle_sub_part(0, n_vars);
+
+  /* the gradient terms are (S - S.A.S) / 2, S / 2, and S.mu where S is the
+   * inverse of the covariance matrix and A is the sum of the VA covariance
+   * matrix and mu.mu^T */
+  auto add_vcov_term =
+    [&]
+    (vajoint_uint const dim, vajoint_uint const offset,
+     vajoint_uint const idx_par, cfaad::CholFactorization const &fact){
+    arma::mat S(wk_mem, dim, dim, false),
+             dS(S.end(), dim, dim, false),
+              A(dS.end(), dim, dim, false),
+             dA(A.end(), dim, dim, false),
+           term(dA.end(), dim, dim, false);
+
+    // copy the upper triangular matrix to the full matrix
+    {
+      double const * v_inv_ele(fact.get_inv());
+      for(vajoint_uint j = 0; j < dim; ++j){
+        for(vajoint_uint i = 0; i < j; ++i, ++v_inv_ele){
+          S.at(i, j) = *v_inv_ele;
+          S.at(j, i) = *v_inv_ele;
+        }
+        S.at(j, j) = *v_inv_ele++;
+      }
+    }
+
+    arma::mat const d_vcov(const_cast<double*>(dir + idx_par), dim, dim,
+                           false);
+    dS = -S * d_vcov * S;
+
+    arma::vec const mu(const_cast<double*>(va_mean + offset), dim, false),
+                  d_mu(const_cast<double*>(d_va_mean + offset), dim, false);
+    copy_sub_mat(A.memptr(), va_vcov, offset, dim, n_vars);
+    A += mu * mu.t();
+    copy_sub_mat(dA.memptr(), d_va_vcov, offset, dim, n_vars);
+    dA += d_mu * mu.t() + mu * d_mu.t();
+
+    // the derivatives w.r.t. the model covariance matrix
+    term = dS - dS * A * S - S * dA * S - S * A * dS;
+    lp_joint::add(res + idx_par, term.memptr(), dim * dim, .5);
+
+    // the derivatives w.r.t. the VA covariance matrix and the VA mean
+    lp_joint::mat_add(res + idx.va_vcov(), dS.memptr(), dim, n_vars, offset,
+                      .5);
+
+    arma::vec d_mean(term.memptr(), dim, false);
+    d_mean = dS * mu + S * d_mu;
+    lp_joint::add(res + idx.va_mean() + offset, d_mean.memptr(), dim, 1);
+  };
+
+  if(has_vcov)
+    add_vcov_term(n_shared, 0, idx.vcov_vary(), *vcov_fac);
+  if(has_vcov_surv)
+    add_vcov_term(n_shared_surv, n_shared, idx.vcov_surv(), *vcov_surv_fac);
+}
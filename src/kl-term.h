@@ -18,6 +18,7 @@ class kl_term {
   subset_params idx;
   vajoint_uint n_vars;
   vajoint_uint n_wmem_v{2 * n_vars * n_vars};
+  vajoint_uint n_wmem_hess_v{5 * n_vars * n_vars};
 
   /// objects used by setup
   std::unique_ptr<cfaad::CholFactorization> vcov_fac, vcov_surv_fac;
@@ -47,9 +48,22 @@ public:
    */
   double grad(double *g, double const *param, double *wk_mem) const;
 
+  /**
+   * adds the directional derivative of the gradient in the direction dir to
+   * res. That is, the Hessian times dir. The directions of the covariance
+   * matrices have to be symmetric. The required working memory is given by
+   * n_wmem_hess().
+   */
+  void hess_vec(double *res, double const *param, double const *dir,
+                double *wk_mem) const;
+
   size_t n_wmem() const {
     return n_wmem_v;
   }
+
+  size_t n_wmem_hess() const {
+    return n_wmem_hess_v;
+  }
 };
 
 #endif
@@ -0,0 +1,61 @@
+#ifndef LOAD_BALANCE_H
+#define LOAD_BALANCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+/**
+ * returns an order of the tasks with the given costs such that n_blocks
+ * threads get about the same amount of work when the tasks are split into
+ * contiguous blocks with the same number of tasks like with a static OpenMP
+ * schedule. The first n_tasks % n_blocks blocks have one more task.
+ *
+ * The tasks are assigned in decreasing order of the cost to the block with the
+ * least work which is not full (longest-processing-time-first). The original
+ * order is kept within each block. Element i of the returned vector is the
+ * index of the task which is at position i.
+ */
+inline std::vector<size_t> lpt_order
+  (std::vector<double> const &costs, size_t const n_blocks){
+  size_t const n_tasks{costs.size()};
+  std::vector<size_t> out(n_tasks);
+  std::iota(out.begin(), out.end(), 0);
+  if(n_blocks < 2 || n_tasks <= n_blocks)
+    return out;
+
+  std::stable_sort
+    (out.begin(), out.end(),
+     [&](size_t const i, size_t const j){ return costs[i] > costs[j]; });
+
+  size_t const n_per_block{n_tasks / n_blocks},
+               n_extra{n_tasks % n_blocks};
+  std::vector<std::vector<size_t> > blocks(n_blocks);
+  std::vector<double> work(n_blocks, 0);
+  for(size_t b = 0; b < n_blocks; ++b)
+    blocks[b].reserve(n_per_block + 1);
+
+  for(size_t task : out){
+    size_t best{n_blocks};
+    for(size_t b = 0; b < n_blocks; ++b){
+      size_t const capacity{n_per_block + (b < n_extra)};
+      if(blocks[b].size() < capacity &&
+           (best == n_blocks || work[b] < work[best]))
+        best = b;
+    }
+
+    blocks[best].emplace_back(task);
+    work[best] += costs[task];
+  }
+
+  auto it = out.begin();
+  for(auto &block : blocks){
+    std::sort(block.begin(), block.end());
+    it = std::copy(block.begin(), block.end(), it);
+  }
+
+  return out;
+}
+
+#endif
@@ -89,6 +89,77 @@ struct dpd_mat {
     get(theta, dim, res, derivs, wmem::get_double_mem(n_wmem(dim)));
   }
 };
+
+struct d2pd_mat {
+  /// return the required memory for dir and get
+  static size_t n_wmem(vajoint_uint const dim){
+    return 4 * dim * dim;
+  }
+
+  /**
+   * sets L and the directional derivative of L w.r.t. theta in the direction
+   * v. The latter has the same layout as theta.
+   */
+  static void fill(double const *theta, double const *v,
+                   vajoint_uint const dim, arma::mat &L, arma::mat &dL){
+    L.zeros();
+    dL.zeros();
+
+    for(vajoint_uint j = 0; j < dim; ++j){
+      for(vajoint_uint i = 0; i < j; ++i){
+        L.at(i, j) = *theta++;
+        dL.at(i, j) = *v++;
+      }
+      L.at(j, j) = std::exp(*theta++);
+      dL.at(j, j) = L.at(j, j) * *v++;
+    }
+  }
+
+  /**
+   * computes the directional derivative of L^top L w.r.t. theta in the
+   * direction v and writes it to res.
+   */
+  static void dir(double const *theta, vajoint_uint const dim,
+                  double const *v, double * __restrict__ res,
+                  double * __restrict__ wk_mem){
+    arma::mat L(wk_mem, dim, dim, false),
+             dL(L.end(), dim, dim, false);
+    fill(theta, v, dim, L, dL);
+
+    arma::mat res_mat(res, dim, dim, false),
+                inter(dL.end(), dim, dim, false);
+    inter = dL.t() * L;
+    res_mat = inter + inter.t();
+  }
+
+  /**
+   * adds the directional derivative in the direction v of what dpd_mat::get
+   * computes to res while derivs is kept fixed. Thus, the Hessian of
+   * f(L^top L) w.r.t. theta times v is given by the sum of this and
+   * dpd_mat::get applied to the directional derivative of derivs (see dir).
+   */
+  static void get(double const *theta, vajoint_uint const dim,
+                  double const *v, double * __restrict__ res,
+                  double const * derivs, double * __restrict__ wk_mem){
+    arma::mat L(wk_mem, dim, dim, false),
+             dL(L.end(), dim, dim, false);
+    fill(theta, v, dim, L, dL);
+
+    arma::mat dum(const_cast<double*>(derivs), dim, dim, false),
+                D(dL.end(), dim, dim, false);
+    D = arma::symmatu(dum);
+    arma::mat inter(D.end(), dim, dim, false);
+    inter = dL * D;
+
+    double * __restrict__ r = res;
+    for(vajoint_uint j = 0; j < dim; ++j){
+      for(vajoint_uint i = 0; i < j; ++i)
+        *r++ += 2 * inter.at(i, j);
+      double const L_D_jj{arma::dot(L.row(j), D.col(j))};
+      *r++ += 2 * (inter.at(j, j) * L.at(j, j) + L_D_jj * dL.at(j, j));
+    }
+  }
+};
 } // namespace log_chol
 
 #endif
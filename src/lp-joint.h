@@ -16,6 +16,23 @@ extern "C" {
      int const *k, double const *A, int const *lda, double const *tau,
      double *C, int const *ldc, double *work, int *lwork, int *info,
      size_t, size_t);
+
+  void F77_NAME(dsyrk)
+    (char const *uplo, char const *trans, int const *n, int const *k,
+     double const *alpha, double const *A, int const *lda,
+     double const *beta, double *C, int const *ldc, size_t, size_t);
+
+  void F77_NAME(dsymm)
+    (char const *side, char const *uplo, int const *m, int const *n,
+     double const *alpha, double const *A, int const *lda, double const *B,
+     int const *ldb, double const *beta, double *C, int const *ldc, size_t,
+     size_t);
+
+  void F77_NAME(dgemm)
+    (char const *transa, char const *transb, int const *m, int const *n,
+     int const *k, double const *alpha, double const *A, int const *lda,
+     double const *B, int const *ldb, double const *beta, double *C,
+     int const *ldc, size_t, size_t);
 }
 
 namespace lp_joint {
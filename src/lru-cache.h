@@ -0,0 +1,109 @@
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+/**
+ * least recently used cache of arrays of doubles with a bound on the number of
+ * bytes used by the arrays. The object is not thread-safe so the caller has to
+ * lock the cache if it is shared by multiple threads.
+ */
+class lru_cache {
+  struct entry {
+    size_t key, n_ele;
+    std::unique_ptr<double[]> mem;
+  };
+  /// the entries with the most recently used entry first
+  std::list<entry> entries;
+  std::unordered_map<size_t, std::list<entry>::iterator> key_to_entry;
+
+  size_t max_bytes_v, bytes_v{}, n_hits_v{}, n_misses_v{};
+
+public:
+  lru_cache(size_t const max_bytes = 0): max_bytes_v{max_bytes} { }
+
+  /// copies are empty caches with the same bound
+  lru_cache(lru_cache const &o): max_bytes_v{o.max_bytes_v} { }
+  lru_cache& operator=(lru_cache const &o){
+    clear();
+    max_bytes_v = o.max_bytes_v;
+    return *this;
+  }
+
+  lru_cache(lru_cache &&o) = default;
+  lru_cache& operator=(lru_cache &&o) = default;
+
+  /**
+   * returns a pointer to the array with the key and marks it as the most
+   * recently used. Returns a nullptr if the key is not in the cache.
+   */
+  double const * find(size_t const key){
+    auto it = key_to_entry.find(key);
+    if(it == key_to_entry.end()){
+      ++n_misses_v;
+      return nullptr;
+    }
+
+    ++n_hits_v;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->mem.get();
+  }
+
+  /**
+   * adds an array with n_ele elements for a key which is not in the cache and
+   * returns a pointer to the array which the caller has to fill. The least
+   * recently used arrays are removed until there is room. Returns a nullptr if
+   * the array is larger than the bound.
+   */
+  double * insert(size_t const key, size_t const n_ele){
+    size_t const n_bytes{n_ele * sizeof(double)};
+    if(n_bytes > max_bytes_v)
+      return nullptr;
+
+    std::unique_ptr<double[]> mem;
+    while(bytes_v + n_bytes > max_bytes_v){
+      entry &last = entries.back();
+      bytes_v -= last.n_ele * sizeof(double);
+      key_to_entry.erase(last.key);
+      if(last.n_ele == n_ele)
+        // re-use the memory
+        mem = std::move(last.mem);
+      entries.pop_back();
+    }
+
+    if(!mem)
+      mem.reset(new double[n_ele]);
+    entries.push_front({key, n_ele, std::move(mem)});
+    key_to_entry[key] = entries.begin();
+    bytes_v += n_bytes;
+    return entries.front().mem.get();
+  }
+
+  /// removes all arrays but keeps the counters
+  void clear(){
+    entries.clear();
+    key_to_entry.clear();
+    bytes_v = 0;
+  }
+
+  /// the number of bytes used by the arrays
+  size_t bytes() const {
+    return bytes_v;
+  }
+  size_t max_bytes() const {
+    return max_bytes_v;
+  }
+  /// the number of calls to find where the key was in the cache
+  size_t n_hits() const {
+    return n_hits_v;
+  }
+  /// the number of calls to find where the key was not in the cache
+  size_t n_misses() const {
+    return n_misses_v;
+  }
+};
+
+#endif
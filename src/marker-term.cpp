@@ -1,8 +1,24 @@
 #include "marker-term.h"
+#include "lp-joint.h"
 #include <algorithm>
+#include <cmath>
 
 namespace marker {
 
+namespace {
+/// copies the subset of the covariance matrix of the observed markers
+void copy_vcov_subset
+  (double const *param, double *wk_mem, subset_params const &par_idx,
+   std::vector<vajoint_uint> const &indices){
+  vajoint_uint const n_markers = par_idx.marker_info().size();
+  double const * const sig = param + par_idx.vcov_marker();
+  size_t const n_indices{indices.size()};
+  for(vajoint_uint j = 0; j < n_indices; ++j)
+    for(vajoint_uint i = 0; i < n_indices; ++i)
+      wk_mem[i + j * n_indices] = sig[indices[i] + n_markers * indices[j]];
+}
+} // namespace
+
 comp_dat::comp_dat
 (double const *param, double *wk_mem, subset_params const &par_idx,
  std::uint32_t const missingness_flag):
@@ -27,15 +43,8 @@ indices{([&]{
     return out;
 })()},
 vcov_factorization{([&]() -> cfaad::CholFactorization {
-  /// create the subset of the covariance matrix
-  vajoint_uint const n_markers = par_idx.marker_info().size();
-  double const * const sig = param + par_idx.vcov_marker();
-  size_t const n_indices{indices.size()};
-  for(vajoint_uint j = 0; j < n_indices; ++j)
-    for(vajoint_uint i = 0; i < n_indices; ++i)
-      wk_mem[i + j * n_indices] = sig[indices[i] + n_markers * indices[j]];
-
-  return { wk_mem, static_cast<int>(n_indices), true };
+  copy_vcov_subset(param, wk_mem, par_idx, indices);
+  return { wk_mem, static_cast<int>(indices.size()), true };
 })()},
 n_rngs{([&]{
   vajoint_uint out{};
@@ -44,6 +53,605 @@ n_rngs{([&]{
   return out;
 })()}{ }
 
+void comp_dat::update
+  (double const *param, double *wk_mem, subset_params const &par_idx){
+  copy_vcov_subset(param, wk_mem, par_idx, indices);
+  vcov_factorization.update(wk_mem);
+}
+
+double marker_dat::grad
+  (double const *param, double *gr, double *wk_mem,
+   const vajoint_uint idx) const {
+  comp_dat const &c_dat = pre_comp_dat[pattern_id[idx]];
+  const std::vector<vajoint_uint> &indices = c_dat.indices;
+  const cfaad::CholFactorization &vcov_factorization =
+    c_dat.vcov_factorization;
+  vajoint_uint const n_indices = indices.size(),
+                        n_rngs{n_basis_rng + par_idx.n_shared_surv()};
+
+  double * const delta{wk_mem},
+         * const Sig_inv_delta{delta + n_indices},
+         * const MT_Psi_M{Sig_inv_delta + n_indices},
+         * const Sig_inv_MT_Psi_M_Sig_inv{MT_Psi_M + n_indices * n_indices};
+
+  // compute the difference between the observed and expected outcome
+  double const * const design{design_mats.col(idx)};
+  for(vajoint_uint i = 0; i < n_indices; ++i){
+    delta[i] = outcomes.col(idx)[indices[i]];
+
+    { // fixed effects
+      vajoint_uint const offset{par_idx.fixef_marker(indices[i])};
+      double const * d{design + offset};
+      delta[i] -= cfaad::dotProd
+        (d, d + par_idx.marker_info()[indices[i]].n_fix, param + offset);
+    }
+    { // time-varying fixed effects
+      vajoint_uint const offset{par_idx.fixef_vary_marker(indices[i])};
+      double const * d{design + offset};
+      delta[i] -= cfaad::dotProd
+        (d, d + par_idx.marker_info()[indices[i]].n_variying,
+         param + offset);
+    }
+    { // time-varying random effects
+      vajoint_uint const offset{offsets_rng[indices[i]]};
+      double const * d{design + offset + n_fixed_effects + n_basis_fix};
+      delta[i] -= cfaad::dotProd
+        (d, d + par_idx.marker_info()[indices[i]].n_rng,
+         param + par_idx.va_mean() + offset);
+    }
+  }
+
+  std::copy(delta, delta + n_indices, Sig_inv_delta);
+  vcov_factorization.solve(Sig_inv_delta);
+
+  double out{};
+  for(vajoint_uint i = 0; i < n_indices; ++i)
+    out += delta[i] * Sig_inv_delta[i];
+
+  // add the log of the determinant term and the constant term
+  constexpr double log_2_pi{1.83787706640935};
+  out += static_cast<double>(n_indices) * log_2_pi;
+  out += std::log(vcov_factorization.determinant());
+
+  // compute M^T.Psi.M using the blocks of the VA covariance matrix
+  double const * const Psi{param + par_idx.va_vcov()};
+  auto rng_design = [&](vajoint_uint const i){
+    return design + offsets_rng[indices[i]] + n_fixed_effects + n_basis_fix;
+  };
+
+  for(vajoint_uint j = 0; j < n_indices; ++j){
+    vajoint_uint const offset_j{offsets_rng[indices[j]]},
+                       n_rng_j{par_idx.marker_info()[indices[j]].n_rng};
+    double const * const d_j{rng_design(j)};
+
+    for(vajoint_uint i = 0; i <= j; ++i){
+      vajoint_uint const offset_i{offsets_rng[indices[i]]},
+                         n_rng_i{par_idx.marker_info()[indices[i]].n_rng};
+      double const * const d_i{rng_design(i)};
+
+      double val{};
+      for(vajoint_uint l = 0; l < n_rng_j; ++l){
+        double const * const Psi_l{Psi + (offset_j + l) * n_rngs + offset_i};
+        double inner{};
+        for(vajoint_uint k = 0; k < n_rng_i; ++k)
+          inner += Psi_l[k] * d_i[k];
+        val += inner * d_j[l];
+      }
+
+      MT_Psi_M[i + j * n_indices] = val;
+      MT_Psi_M[j + i * n_indices] = val;
+    }
+  }
+
+  // compute the trace term and Sig^{-1}.M^T.Psi.M.Sig^{-1}
+  for(vajoint_uint i = 0; i < n_indices; ++i)
+    vcov_factorization.solve(MT_Psi_M + i * n_indices);
+  for(vajoint_uint i = 0; i < n_indices; ++i)
+    out += MT_Psi_M[i * (n_indices + 1)];
+
+  for(vajoint_uint j = 0; j < n_indices; ++j)
+    for(vajoint_uint i = 0; i < n_indices; ++i)
+      Sig_inv_MT_Psi_M_Sig_inv[i + j * n_indices] =
+        MT_Psi_M[j + i * n_indices];
+  for(vajoint_uint i = 0; i < n_indices; ++i)
+    vcov_factorization.solve(Sig_inv_MT_Psi_M_Sig_inv + i * n_indices);
+
+  // the derivatives w.r.t. the mean parameters
+  for(vajoint_uint i = 0; i < n_indices; ++i){
+    double const d_delta{Sig_inv_delta[i]};
+    auto add_grad = [&](vajoint_uint const n_ele, double const *d,
+                        double *g){
+      for(vajoint_uint k = 0; k < n_ele; ++k)
+        g[k] -= d_delta * d[k];
+    };
+
+    vajoint_uint const offset_fix{par_idx.fixef_marker(indices[i])},
+                  offset_fix_vary{par_idx.fixef_vary_marker(indices[i])},
+                       offset_rng{offsets_rng[indices[i]]};
+    auto const &info = par_idx.marker_info()[indices[i]];
+    add_grad(info.n_fix, design + offset_fix, gr + offset_fix);
+    add_grad(info.n_variying, design + offset_fix_vary, gr + offset_fix_vary);
+    add_grad(info.n_rng, rng_design(i), gr + par_idx.va_mean() + offset_rng);
+  }
+
+  /* the derivatives w.r.t. the covariance matrices. Sig^{-1} is stored in
+   * packed form (upper triangle) */
+  double const * const Sig_inv{vcov_factorization.get_inv()};
+  double * const d_Sig{gr + par_idx.vcov_marker()},
+         * const d_Psi{gr + par_idx.va_vcov()};
+  for(vajoint_uint j = 0; j < n_indices; ++j){
+    vajoint_uint const offset_j{offsets_rng[indices[j]]},
+                       n_rng_j{par_idx.marker_info()[indices[j]].n_rng};
+    double const * const d_j{rng_design(j)};
+
+    for(vajoint_uint i = 0; i < n_indices; ++i){
+      double const Sig_inv_ij
+        {i <= j ? Sig_inv[i + (j * (j + 1)) / 2]
+                : Sig_inv[j + (i * (i + 1)) / 2]};
+
+      d_Sig[indices[i] + n_markers_v * indices[j]] +=
+        (Sig_inv_ij - Sig_inv_delta[i] * Sig_inv_delta[j]
+          - Sig_inv_MT_Psi_M_Sig_inv[i + j * n_indices]) / 2;
+
+      vajoint_uint const offset_i{offsets_rng[indices[i]]},
+                         n_rng_i{par_idx.marker_info()[indices[i]].n_rng};
+      double const * const d_i{rng_design(i)};
+      for(vajoint_uint l = 0; l < n_rng_j; ++l){
+        double * const d_Psi_l{d_Psi + (offset_j + l) * n_rngs + offset_i};
+        double const fac{Sig_inv_ij * d_j[l] / 2};
+        for(vajoint_uint k = 0; k < n_rng_i; ++k)
+          d_Psi_l[k] += fac * d_i[k];
+      }
+    }
+  }
+
+  return out / 2;
+}
+
+template<bool comp_grad>
+double marker_dat::cluster_term
+  (double const *param, double *gr, double *wk_mem,
+   vajoint_uint const *obs_begin, vajoint_uint const *obs_end) const {
+  vajoint_uint const n_rngs_va{n_basis_rng + par_idx.n_shared_surv()};
+  double const * const Psi{param + par_idx.va_vcov()};
+  constexpr double log_2_pi{1.83787706640935};
+
+  double * const Delta{wk_mem},
+         * const Sig_inv_Delta{Delta + n_markers_v * n_obs_block},
+         * const Z{Sig_inv_Delta + n_markers_v * n_obs_block},
+         * const D{Z + n_basis_rng * n_obs_block},
+         * const Sig_inv{D + n_markers_v * n_markers_v},
+         * const D_Sig_inv{Sig_inv + n_markers_v * n_markers_v},
+         * const C{D_Sig_inv + n_markers_v * n_markers_v};
+
+  double const d_one{1}, d_zero{0};
+  char const c_U{'U'}, c_N{'N'};
+
+  double out{};
+  for(vajoint_uint const *group_begin{obs_begin}; group_begin != obs_end;){
+    // find the observations with the same missingness pattern
+    vajoint_uint const pattern{pattern_id[*group_begin]};
+    vajoint_uint const *group_end{group_begin + 1};
+    while(group_end != obs_end && pattern_id[*group_end] == pattern)
+      ++group_end;
+
+    comp_dat const &c_dat = pre_comp_dat[pattern];
+    const std::vector<vajoint_uint> &indices = c_dat.indices;
+    const cfaad::CholFactorization &vcov_factorization =
+      c_dat.vcov_factorization;
+    vajoint_uint const n_indices = indices.size(),
+                          n_rngs{c_dat.n_rngs},
+                     n_obs_group(group_end - group_begin);
+    if(n_indices < 1){
+      group_begin = group_end;
+      continue;
+    }
+
+    // fill in the inverse of the covariance matrix
+    {
+      double const *inv{vcov_factorization.get_inv()};
+      for(vajoint_uint j = 0; j < n_indices; ++j)
+        for(vajoint_uint i = 0; i <= j; ++i, ++inv){
+          Sig_inv[i + j * n_indices] = *inv;
+          Sig_inv[j + i * n_indices] = *inv;
+        }
+    }
+
+    /* compute D = sum_i delta_i.delta_i^T and C = sum_i m_i.m_i^T where m_i
+     * is the stacked random effect design vectors */
+    std::fill(D, D + n_indices * n_indices, 0);
+    std::fill(C, C + n_rngs * n_rngs, 0);
+
+    int const n_indices_i = n_indices,
+                 n_rngs_i = n_rngs;
+    for(vajoint_uint const *block_begin{group_begin};
+        block_begin != group_end;){
+      vajoint_uint const n_block
+        {std::min<vajoint_uint>(n_obs_block, group_end - block_begin)};
+
+      for(vajoint_uint k = 0; k < n_block; ++k){
+        double const * const design{design_mats.col(block_begin[k])},
+                     * const outcome{outcomes.col(block_begin[k])};
+        double * const delta{Delta + k * n_indices};
+        double * z{Z + k * n_rngs};
+
+        for(vajoint_uint i = 0; i < n_indices; ++i){
+          auto const &info = par_idx.marker_info()[indices[i]];
+          delta[i] = outcome[indices[i]];
+
+          { // fixed effects
+            vajoint_uint const offset{par_idx.fixef_marker(indices[i])};
+            double const * d{design + offset};
+            delta[i] -= cfaad::dotProd(d, d + info.n_fix, param + offset);
+          }
+          { // time-varying fixed effects
+            vajoint_uint const offset{par_idx.fixef_vary_marker(indices[i])};
+            double const * d{design + offset};
+            delta[i] -= cfaad::dotProd
+              (d, d + info.n_variying, param + offset);
+          }
+          { // time-varying random effects
+            vajoint_uint const offset{offsets_rng[indices[i]]};
+            double const * d{design + offset + n_fixed_effects + n_basis_fix};
+            delta[i] -= cfaad::dotProd
+              (d, d + info.n_rng, param + par_idx.va_mean() + offset);
+            z = std::copy(d, d + info.n_rng, z);
+          }
+        }
+      }
+
+      int const n_block_i = n_block;
+      F77_CALL(dsyrk)
+        (&c_U, &c_N, &n_indices_i, &n_block_i, &d_one, Delta, &n_indices_i,
+         &d_one, D, &n_indices_i, 1, 1);
+      if(n_rngs > 0)
+        F77_CALL(dsyrk)
+          (&c_U, &c_N, &n_rngs_i, &n_block_i, &d_one, Z, &n_rngs_i,
+           &d_one, C, &n_rngs_i, 1, 1);
+
+      if constexpr (comp_grad){
+        // the derivatives w.r.t. the mean parameters
+        F77_CALL(dgemm)
+          (&c_N, &c_N, &n_indices_i, &n_block_i, &n_indices_i, &d_one,
+           Sig_inv, &n_indices_i, Delta, &n_indices_i, &d_zero,
+           Sig_inv_Delta, &n_indices_i, 1, 1);
+
+        for(vajoint_uint k = 0; k < n_block; ++k){
+          double const * const design{design_mats.col(block_begin[k])},
+                       * const d_delta{Sig_inv_Delta + k * n_indices};
+          for(vajoint_uint i = 0; i < n_indices; ++i){
+            auto const &info = par_idx.marker_info()[indices[i]];
+            auto add_grad = [&](vajoint_uint const n_ele, double const *d,
+                                double *g){
+              for(vajoint_uint l = 0; l < n_ele; ++l)
+                g[l] -= d_delta[i] * d[l];
+            };
+
+            vajoint_uint const offset_fix{par_idx.fixef_marker(indices[i])},
+                          offset_fix_vary
+                            {par_idx.fixef_vary_marker(indices[i])},
+                               offset_rng{offsets_rng[indices[i]]};
+            add_grad(info.n_fix, design + offset_fix, gr + offset_fix);
+            add_grad(info.n_variying, design + offset_fix_vary,
+                     gr + offset_fix_vary);
+            add_grad(info.n_rng,
+                     design + offset_rng + n_fixed_effects + n_basis_fix,
+                     gr + par_idx.va_mean() + offset_rng);
+          }
+        }
+      }
+
+      block_begin += n_block;
+    }
+
+    // only the upper triangles are computed
+    for(vajoint_uint j = 0; j < n_indices; ++j)
+      for(vajoint_uint i = 0; i < j; ++i)
+        D[j + i * n_indices] = D[i + j * n_indices];
+    for(vajoint_uint j = 0; j < n_rngs; ++j)
+      for(vajoint_uint i = 0; i < j; ++i)
+        C[j + i * n_rngs] = C[i + j * n_rngs];
+
+    // add sum_i M_i^T.Psi.M_i to D
+    for(vajoint_uint j = 0, jj = 0; j < n_indices; ++j){
+      vajoint_uint const offset_j{offsets_rng[indices[j]]},
+                          n_rng_j{par_idx.marker_info()[indices[j]].n_rng};
+
+      for(vajoint_uint i = 0, ii = 0; i < n_indices; ++i){
+        vajoint_uint const offset_i{offsets_rng[indices[i]]},
+                            n_rng_i{par_idx.marker_info()[indices[i]].n_rng};
+
+        double val{};
+        for(vajoint_uint l = 0; l < n_rng_j; ++l){
+          double const * const Psi_l
+            {Psi + (offset_j + l) * n_rngs_va + offset_i},
+                       * const C_l{C + (jj + l) * n_rngs + ii};
+          for(vajoint_uint k = 0; k < n_rng_i; ++k)
+            val += Psi_l[k] * C_l[k];
+        }
+        D[i + j * n_indices] += val;
+
+        ii += n_rng_i;
+      }
+      jj += n_rng_j;
+    }
+
+    double trace{};
+    for(vajoint_uint i = 0; i < n_indices * n_indices; ++i)
+      trace += Sig_inv[i] * D[i];
+    out += trace + static_cast<double>(n_obs_group) *
+      (static_cast<double>(n_indices) * log_2_pi +
+        std::log(vcov_factorization.determinant()));
+
+    if constexpr (comp_grad){
+      // compute Sig^{-1}.D.Sig^{-1} and store it in D
+      F77_CALL(dgemm)
+        (&c_N, &c_N, &n_indices_i, &n_indices_i, &n_indices_i, &d_one,
+         D, &n_indices_i, Sig_inv, &n_indices_i, &d_zero, D_Sig_inv,
+         &n_indices_i, 1, 1);
+      F77_CALL(dgemm)
+        (&c_N, &c_N, &n_indices_i, &n_indices_i, &n_indices_i, &d_one,
+         Sig_inv, &n_indices_i, D_Sig_inv, &n_indices_i, &d_zero, D,
+         &n_indices_i, 1, 1);
+
+      // the derivatives w.r.t. the covariance matrices
+      double * const d_Sig{gr + par_idx.vcov_marker()},
+             * const d_Psi{gr + par_idx.va_vcov()};
+      for(vajoint_uint j = 0, jj = 0; j < n_indices; ++j){
+        vajoint_uint const offset_j{offsets_rng[indices[j]]},
+                            n_rng_j{par_idx.marker_info()[indices[j]].n_rng};
+
+        for(vajoint_uint i = 0, ii = 0; i < n_indices; ++i){
+          double const Sig_inv_ij{Sig_inv[i + j * n_indices]};
+          d_Sig[indices[i] + n_markers_v * indices[j]] +=
+            (static_cast<double>(n_obs_group) * Sig_inv_ij
+               - D[i + j * n_indices]) / 2;
+
+          vajoint_uint const offset_i{offsets_rng[indices[i]]},
+                              n_rng_i{par_idx.marker_info()[indices[i]].n_rng};
+          for(vajoint_uint l = 0; l < n_rng_j; ++l){
+            double * const d_Psi_l
+              {d_Psi + (offset_j + l) * n_rngs_va + offset_i};
+            double const * const C_l{C + (jj + l) * n_rngs + ii};
+            for(vajoint_uint k = 0; k < n_rng_i; ++k)
+              d_Psi_l[k] += Sig_inv_ij * C_l[k] / 2;
+          }
+
+          ii += n_rng_i;
+        }
+        jj += n_rng_j;
+      }
+    }
+
+    group_begin = group_end;
+  }
+
+  return out / 2;
+}
+
+double marker_dat::eval_cluster
+  (double const *param, double *wk_mem, vajoint_uint const *obs_begin,
+   vajoint_uint const *obs_end) const {
+  return cluster_term<false>(param, nullptr, wk_mem, obs_begin, obs_end);
+}
+
+double marker_dat::grad_cluster
+  (double const *param, double *gr, double *wk_mem,
+   vajoint_uint const *obs_begin, vajoint_uint const *obs_end) const {
+  return cluster_term<true>(param, gr, wk_mem, obs_begin, obs_end);
+}
+
+void marker_dat::hess_vec_cluster
+  (double const *param, double const *dir, double *res, double *wk_mem,
+   vajoint_uint const *obs_begin, vajoint_uint const *obs_end) const {
+  vajoint_uint const n_rngs_va{n_basis_rng + par_idx.n_shared_surv()};
+  double const * const Psi{param + par_idx.va_vcov()},
+               * const d_Psi{dir + par_idx.va_vcov()};
+
+  vajoint_uint const n_mat{n_markers_v * n_markers_v};
+  double * const Sig_inv{wk_mem},
+         * const d_Sig_inv{Sig_inv + n_mat},
+         * const D{d_Sig_inv + n_mat},
+         * const d_D{D + n_mat},
+         * const wk1{d_D + n_mat},
+         * const wk2{wk1 + n_mat},
+         * const C{wk2 + n_mat},
+         * const delta{C + n_basis_rng * n_basis_rng},
+         * const d_delta{delta + n_markers_v},
+         * const d_Sig_inv_delta{d_delta + n_markers_v},
+         * const z{d_Sig_inv_delta + n_markers_v};
+
+  double const d_one{1}, d_m_one{-1}, d_zero{0};
+  char const c_N{'N'};
+
+  /* the gradient terms are -S.delta_i for the mean parameters,
+   * (n.S - S.D.S) / 2 for the covariance matrix, and S_ij.C_ij / 2 for the
+   * VA covariance matrix where S is the inverse of the covariance matrix */
+  for(vajoint_uint const *group_begin{obs_begin}; group_begin != obs_end;){
+    // find the observations with the same missingness pattern
+    vajoint_uint const pattern{pattern_id[*group_begin]};
+    vajoint_uint const *group_end{group_begin + 1};
+    while(group_end != obs_end && pattern_id[*group_end] == pattern)
+      ++group_end;
+
+    comp_dat const &c_dat = pre_comp_dat[pattern];
+    const std::vector<vajoint_uint> &indices = c_dat.indices;
+    vajoint_uint const n_indices = indices.size(),
+                          n_rngs{c_dat.n_rngs},
+                     n_obs_group(group_end - group_begin);
+    if(n_indices < 1){
+      group_begin = group_end;
+      continue;
+    }
+
+    // fill in the inverse of the covariance matrix and its derivative
+    {
+      double const *inv{c_dat.vcov_factorization.get_inv()};
+      for(vajoint_uint j = 0; j < n_indices; ++j)
+        for(vajoint_uint i = 0; i <= j; ++i, ++inv){
+          Sig_inv[i + j * n_indices] = *inv;
+          Sig_inv[j + i * n_indices] = *inv;
+        }
+    }
+    copy_vcov_subset(dir, wk1, par_idx, indices);
+
+    int const n_indices_i = n_indices;
+    auto mat_mult = [&](double const *A, double const *B, double *out,
+                        double const *alpha){
+      F77_CALL(dgemm)
+        (&c_N, &c_N, &n_indices_i, &n_indices_i, &n_indices_i, alpha, A,
+         &n_indices_i, B, &n_indices_i, &d_zero, out, &n_indices_i, 1, 1);
+    };
+    mat_mult(wk1, Sig_inv, wk2, &d_one);
+    mat_mult(Sig_inv, wk2, d_Sig_inv, &d_m_one);
+
+    std::fill(D, D + n_indices * n_indices, 0);
+    std::fill(d_D, d_D + n_indices * n_indices, 0);
+    std::fill(C, C + n_rngs * n_rngs, 0);
+
+    for(vajoint_uint const *obs{group_begin}; obs != group_end; ++obs){
+      double const * const design{design_mats.col(*obs)},
+                   * const outcome{outcomes.col(*obs)};
+      double * z_i{z};
+
+      for(vajoint_uint i = 0; i < n_indices; ++i){
+        auto const &info = par_idx.marker_info()[indices[i]];
+        delta[i] = outcome[indices[i]];
+        d_delta[i] = 0;
+
+        auto add_term = [&](vajoint_uint const n_ele, double const *d,
+                            vajoint_uint const offset){
+          delta[i] -= cfaad::dotProd(d, d + n_ele, param + offset);
+          d_delta[i] -= cfaad::dotProd(d, d + n_ele, dir + offset);
+        };
+
+        vajoint_uint const offset_fix{par_idx.fixef_marker(indices[i])},
+                      offset_fix_vary{par_idx.fixef_vary_marker(indices[i])},
+                           offset_rng{offsets_rng[indices[i]]};
+        double const * const d_rng
+          {design + offset_rng + n_fixed_effects + n_basis_fix};
+        add_term(info.n_fix, design + offset_fix, offset_fix);
+        add_term(info.n_variying, design + offset_fix_vary, offset_fix_vary);
+        add_term(info.n_rng, d_rng, par_idx.va_mean() + offset_rng);
+        z_i = std::copy(d_rng, d_rng + info.n_rng, z_i);
+      }
+
+      for(vajoint_uint j = 0; j < n_indices; ++j)
+        for(vajoint_uint i = 0; i < n_indices; ++i){
+          D[i + j * n_indices] += delta[i] * delta[j];
+          d_D[i + j * n_indices] +=
+            d_delta[i] * delta[j] + delta[i] * d_delta[j];
+        }
+      for(vajoint_uint j = 0; j < n_rngs; ++j)
+        for(vajoint_uint i = 0; i < n_rngs; ++i)
+          C[i + j * n_rngs] += z[i] * z[j];
+
+      // the derivatives w.r.t. the mean parameters
+      for(vajoint_uint i = 0; i < n_indices; ++i){
+        d_Sig_inv_delta[i] = 0;
+        for(vajoint_uint k = 0; k < n_indices; ++k)
+          d_Sig_inv_delta[i] +=
+            d_Sig_inv[i + k * n_indices] * delta[k] +
+              Sig_inv[i + k * n_indices] * d_delta[k];
+      }
+
+      for(vajoint_uint i = 0; i < n_indices; ++i){
+        auto const &info = par_idx.marker_info()[indices[i]];
+        auto add_hess = [&](vajoint_uint const n_ele, double const *d,
+                            double *r){
+          for(vajoint_uint l = 0; l < n_ele; ++l)
+            r[l] -= d_Sig_inv_delta[i] * d[l];
+        };
+
+        vajoint_uint const offset_fix{par_idx.fixef_marker(indices[i])},
+                      offset_fix_vary{par_idx.fixef_vary_marker(indices[i])},
+                           offset_rng{offsets_rng[indices[i]]};
+        add_hess(info.n_fix, design + offset_fix, res + offset_fix);
+        add_hess(info.n_variying, design + offset_fix_vary,
+                 res + offset_fix_vary);
+        add_hess(info.n_rng,
+                 design + offset_rng + n_fixed_effects + n_basis_fix,
+                 res + par_idx.va_mean() + offset_rng);
+      }
+    }
+
+    // add sum_i M_i^T.Psi.M_i to D and the derivative to d_D
+    for(vajoint_uint j = 0, jj = 0; j < n_indices; ++j){
+      vajoint_uint const offset_j{offsets_rng[indices[j]]},
+                          n_rng_j{par_idx.marker_info()[indices[j]].n_rng};
+
+      for(vajoint_uint i = 0, ii = 0; i < n_indices; ++i){
+        vajoint_uint const offset_i{offsets_rng[indices[i]]},
+                            n_rng_i{par_idx.marker_info()[indices[i]].n_rng};
+
+        double val{}, d_val{};
+        for(vajoint_uint l = 0; l < n_rng_j; ++l){
+          size_t const idx_l{(offset_j + l) * n_rngs_va + offset_i};
+          double const * const C_l{C + (jj + l) * n_rngs + ii};
+          for(vajoint_uint k = 0; k < n_rng_i; ++k){
+            val += Psi[idx_l + k] * C_l[k];
+            d_val += d_Psi[idx_l + k] * C_l[k];
+          }
+        }
+        D[i + j * n_indices] += val;
+        d_D[i + j * n_indices] += d_val;
+
+        ii += n_rng_i;
+      }
+      jj += n_rng_j;
+    }
+
+    /* the derivatives w.r.t. the covariance matrix. The derivative of S.D.S
+     * is dS.D.S + S.dD.S + (dS.D.S)^T */
+    double * const d_Sig{res + par_idx.vcov_marker()};
+    auto add_d_Sig = [&](double const *val, bool const add_transpose){
+      for(vajoint_uint j = 0; j < n_indices; ++j)
+        for(vajoint_uint i = 0; i < n_indices; ++i){
+          double term{val[i + j * n_indices]};
+          if(add_transpose)
+            term += val[j + i * n_indices];
+          d_Sig[indices[i] + n_markers_v * indices[j]] -= term / 2;
+        }
+    };
+
+    mat_mult(D, Sig_inv, wk1, &d_one);
+    mat_mult(d_Sig_inv, wk1, wk2, &d_one);
+    add_d_Sig(wk2, true);
+
+    mat_mult(d_D, Sig_inv, wk1, &d_one);
+    mat_mult(Sig_inv, wk1, wk2, &d_one);
+    add_d_Sig(wk2, false);
+
+    // the terms from n.dS and the derivatives w.r.t. the VA covariance matrix
+    double * const d_Psi_res{res + par_idx.va_vcov()};
+    for(vajoint_uint j = 0, jj = 0; j < n_indices; ++j){
+      vajoint_uint const offset_j{offsets_rng[indices[j]]},
+                          n_rng_j{par_idx.marker_info()[indices[j]].n_rng};
+
+      for(vajoint_uint i = 0, ii = 0; i < n_indices; ++i){
+        double const d_Sig_inv_ij{d_Sig_inv[i + j * n_indices]};
+        d_Sig[indices[i] + n_markers_v * indices[j]] +=
+          static_cast<double>(n_obs_group) * d_Sig_inv_ij / 2;
+
+        vajoint_uint const offset_i{offsets_rng[indices[i]]},
+                            n_rng_i{par_idx.marker_info()[indices[i]].n_rng};
+        for(vajoint_uint l = 0; l < n_rng_j; ++l){
+          double * const d_Psi_l
+            {d_Psi_res + (offset_j + l) * n_rngs_va + offset_i};
+          double const * const C_l{C + (jj + l) * n_rngs + ii};
+          for(vajoint_uint k = 0; k < n_rng_i; ++k)
+            d_Psi_l[k] += d_Sig_inv_ij * C_l[k] / 2;
+        }
+
+        ii += n_rng_i;
+      }
+      jj += n_rng_j;
+    }
+
+    group_begin = group_end;
+  }
+}
+
 comp_dat_return get_comp_dat
 (std::vector<setup_marker_dat_helper> &input_dat,
  subset_params const &par_idx,
@@ -23,7 +23,7 @@ struct comp_dat {
   /// the indices of the non-missing outcomes
   const std::vector<vajoint_uint> indices;
   /// the factorization of the covariance matrix
-  const cfaad::CholFactorization vcov_factorization;
+  cfaad::CholFactorization vcov_factorization;
   /// dimension of the random effect
   const vajoint_uint n_rngs;
 
@@ -33,6 +33,13 @@ struct comp_dat {
    */
   comp_dat(double const *param, double *wk_mem, subset_params const &par_idx,
            std::uint32_t const missingness_flag);
+
+  /**
+   * updates the factorization with new parameters without allocating any
+   * memory. The working memory must be the same as for the constructor.
+   */
+  void update(double const *param, double *wk_mem,
+              subset_params const &par_idx);
 };
 
 /// holds data for marker observations
@@ -91,10 +98,10 @@ private:
   /// bit flags for missing variables
   std::vector<std::uint32_t> missingness{std::vector<std::uint32_t>(n_obs_v)};
 
-  /// the unique values of missingness
-  std::unordered_set<std::uint32_t> missingness_unique;
+  /// the index of the missingness pattern in pre_comp_dat of each observation
+  std::vector<vajoint_uint> pattern_id{std::vector<vajoint_uint>(n_obs_v)};
 
-  /// is missingness_unique up to date?
+  /// are pattern_id and pre_comp_dat up to date?
   bool missingness_updated{false};
 
   /// the offsets between the time-varying random effects for each marker
@@ -104,12 +111,35 @@ private:
   size_t n_wmem_v{
     2 * n_markers_v * n_markers_v + n_basis_rng * n_basis_rng + n_markers_v +
       n_basis_rng * n_markers_v};
+  /// the needed working memory for grad
+  size_t n_wmem_grad_v{2 * n_markers_v * n_markers_v + 2 * n_markers_v};
+
+  /// the number of observations handled at a time by the cluster kernels
+  static constexpr vajoint_uint n_obs_block{32};
+
+  /// the needed working memory for eval_cluster and grad_cluster
+  size_t n_wmem_cluster_v{
+    (2 * n_markers_v + n_basis_rng) * n_obs_block +
+      3 * n_markers_v * n_markers_v + n_basis_rng * n_basis_rng};
+
+  /// the needed working memory for hess_vec_cluster
+  size_t n_wmem_hess_v{
+    6 * n_markers_v * n_markers_v + n_basis_rng * n_basis_rng +
+      3 * n_markers_v + n_basis_rng};
 
   /**
    * the pre-computed data for eval. We do not want to re-compute the matrix
    * factorization of the covariance matrix for each outcome. Thus, we do it
-   * once for all observed missingness patterns. See setup */
-  std::unordered_map<std::uint32_t, comp_dat> pre_comp_dat;
+   * once for all observed missingness patterns. The patterns are enumerated
+   * the first time setup is called after the outcomes are set and
+   * pattern_id holds the index of each observation's pattern. See setup */
+  std::vector<comp_dat> pre_comp_dat;
+
+  /// computes eval_cluster and possibly grad_cluster
+  template<bool comp_grad>
+  double cluster_term
+    (double const *param, double *gr, double *wk_mem,
+     vajoint_uint const *obs_begin, vajoint_uint const *obs_end) const;
 
 public:
   /// maximum number of possible markers per observation
@@ -230,25 +260,30 @@ public:
    * called prior to calling eval.
    */
   void setup(double const *param, double *wk_mem){
-    pre_comp_dat.clear();
-    // TODO: compute the unique patterns once
-    if(!missingness_updated){
-      for(std::uint32_t missingness_flag : missingness)
-        missingness_unique.insert(missingness_flag);
+    if(missingness_updated){
+      // only the factorizations need to be updated
+      for(comp_dat &x : pre_comp_dat)
+        x.update(param, wk_mem, par_idx);
+      return;
+    }
 
-      missingness_updated = true;
+    // enumerate the unique patterns
+    pre_comp_dat.clear();
+    std::unordered_map<std::uint32_t, vajoint_uint> pattern_map;
+    for(vajoint_uint i = 0; i < n_obs_v; ++i){
+      auto res = pattern_map.emplace(missingness[i], pre_comp_dat.size());
+      if(res.second)
+        pre_comp_dat.emplace_back(param, wk_mem, par_idx, missingness[i]);
+      pattern_id[i] = res.first->second;
     }
 
-    for(std::uint32_t missingness_flag : missingness_unique)
-      pre_comp_dat.emplace(
-        missingness_flag, comp_dat{param, wk_mem, par_idx, missingness_flag});
+    missingness_updated = true;
   }
 
   /// computes the expected log conditional density of a given observation
   template<class T>
   T operator()(T const *param, T *wk_mem, const vajoint_uint idx) const {
-    std::uint32_t const missingness_flag = missingness[idx];
-    comp_dat const &c_dat = pre_comp_dat.at(missingness_flag);
+    comp_dat const &c_dat = pre_comp_dat[pattern_id[idx]];
     const std::vector<vajoint_uint> &indices = c_dat.indices;
     const cfaad::CholFactorization &vcov_factorization =
       c_dat.vcov_factorization;
@@ -384,10 +419,77 @@ public:
     return out / 2;
   }
 
+  /**
+   * computes the expected log conditional density of a given observation
+   * like operator() and adds the gradient to gr. The computation is done
+   * without the AD tape and uses the pre-computed factorizations from setup.
+   *
+   * The lower bound uses grad_cluster. This version is only used in the tests
+   * as a reference for one observation at a time.
+   */
+  double grad(double const *param, double *gr, double *wk_mem,
+              const vajoint_uint idx) const;
+
+  /**
+   * orders the indices of a cluster's observations such that observations
+   * with the same missingness pattern are consecutive as required by
+   * eval_cluster and grad_cluster.
+   */
+  void sort_by_pattern(std::vector<vajoint_uint> &indices) const {
+    std::stable_sort
+      (indices.begin(), indices.end(),
+       [&](vajoint_uint const i, vajoint_uint const j){
+         return missingness[i] < missingness[j];
+       });
+  }
+
+  /**
+   * computes the sum of the expected log conditional densities of the
+   * observations in [obs_begin, obs_end). Consecutive observations with the
+   * same missingness pattern are handled together. The terms are then given by
+   *
+   *   tr(Sig^{-1}(sum_i delta_i.delta_i^T + M_i^T.Psi.M_i)) / 2 + constant
+   *
+   * and the sums are computed in blocks of observations with level-3 BLAS.
+   * Thus, the indices should be ordered with sort_by_pattern.
+   */
+  double eval_cluster
+    (double const *param, double *wk_mem, vajoint_uint const *obs_begin,
+     vajoint_uint const *obs_end) const;
+
+  /// same as eval_cluster but also adds the gradient to gr
+  double grad_cluster
+    (double const *param, double *gr, double *wk_mem,
+     vajoint_uint const *obs_begin, vajoint_uint const *obs_end) const;
+
+  /**
+   * adds the directional derivative in the direction dir of what
+   * grad_cluster adds to the gradient to res. That is, the Hessian times dir.
+   * The directions of the covariance matrices have to be symmetric.
+   */
+  void hess_vec_cluster
+    (double const *param, double const *dir, double *res, double *wk_mem,
+     vajoint_uint const *obs_begin, vajoint_uint const *obs_end) const;
+
   size_t n_wmem() const {
     return n_wmem_v;
   }
 
+  /// the needed working memory for grad
+  size_t n_wmem_grad() const {
+    return n_wmem_grad_v;
+  }
+
+  /// the needed working memory for eval_cluster and grad_cluster
+  size_t n_wmem_cluster() const {
+    return n_wmem_cluster_v;
+  }
+
+  /// the needed working memory for hess_vec_cluster
+  size_t n_wmem_hess() const {
+    return n_wmem_hess_v;
+  }
+
   vajoint_uint n_obs() const {
     return n_obs_v;
   }
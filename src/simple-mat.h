@@ -20,7 +20,7 @@ public:
 
   /// allocates memory for a given size matrix
   simple_mat(vajoint_uint const n_rows, vajoint_uint const n_cols):
-  mem{new double[n_cols * n_rows]},
+  mem{new T[n_cols * n_rows]},
   n_rows_v{n_rows}, n_cols_v{n_cols}, external{nullptr} { }
 
   /// copy constructor which always copies
@@ -62,32 +62,32 @@ public:
   }
 
   /// returns a pointer to the memory
-  double * get(){
+  T * get(){
     return external ? external : mem.get();
   }
-  double const * get() const {
+  T const * get() const {
     return external ? external : mem.get();
   }
 
   /// begin and end end functions
-  double * begin() {
+  T * begin() {
     return get();
   }
-  double const * begin() const {
+  T const * begin() const {
     return get();
   }
-  double * end() {
+  T * end() {
     return get() + n_rows() * n_cols();
   }
-  double const * end() const {
+  T const * end() const {
     return get() + n_rows() * n_cols();
   }
 
   /// returns the pointer to a given column
-  double * col(vajoint_uint const idx){
+  T * col(vajoint_uint const idx){
     return get() + idx * n_rows();
   }
-  double const * col(vajoint_uint const idx) const {
+  T const * col(vajoint_uint const idx) const {
     return get() + idx * n_rows();
   }
 };
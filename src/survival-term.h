@@ -5,7 +5,11 @@
 #include "bases.h"
 #include "cfaad/AAD.h"
 #include <array>
+#include <cstddef>
+#include <map>
+#include <mutex>
 #include "simple-mat.h"
+#include "lru-cache.h"
 #include "VA-parameter.h"
 #include <stdexcept>
 #include "JointSurv-misc.h"
@@ -96,15 +100,216 @@ class expected_cum_hazzard {
 
       out[0] += n_basis_rng_p1;
       out[1] += max_base_dim;
+      out[1] = std::max(out[1], n_wmem_block());
       return out;
     })()
   };
 
+  /// the required working memory of grad
+  size_t n_wmem_grad_v
+    {2 * n_basis_rng_p1 + n_wmem_v[1] + cache_mem_per_node()};
+
+  /// the required working memory of hess_vec
+  size_t n_wmem_hess_v
+    {5 * n_basis_rng_p1 + n_wmem_v[1] + cache_mem_per_node()};
+
   double scale_node_val
     (double const lower, double const upper, double const node) const {
     return (upper - lower) * node + lower;
   }
 
+  /// the number of nodes that are handled at a time with cached expansions
+  static constexpr vajoint_uint n_node_block{16};
+
+  /// the working memory of the node-batched kernels
+  size_t n_wmem_block() const {
+    return 3 * n_basis_rng_p1 * n_node_block + 2 * n_node_block;
+  }
+
+  /**
+   * computes the log hazard terms without the time-invariant fixed effects
+   * for n_nodes nodes with cached expansions. association_M is set to a
+   * n_basis_rng_p1 x n_nodes matrix with (association^T, 1).hat(M)(s) for each
+   * node and V_M to VA_vcov times the first n_vars rows of association_M. Only
+   * the upper triangle of VA_vcov is used as in cfaad::quadFormSym. The
+   * cached expansions may be stored as floats in which case they are widened
+   * when they are read.
+   */
+  template<class S>
+  void log_haz_block
+    (S const * cached_expansions, vajoint_uint const n_nodes,
+     double const * fixef_vary, double const * association,
+     double const *VA_mean, double const * VA_vcov, double * log_haz,
+     double * association_M, double * V_M) const {
+    vajoint_uint const n_vars
+      {with_frailty() ? n_basis_rng_p1 : n_basis_rng_p1 - 1},
+      n_cache_node{cache_mem_per_node()};
+
+    for(vajoint_uint i = 0; i < n_nodes; ++i){
+      S const * const basis_i{cached_expansions + i * n_cache_node};
+      log_haz[i] =
+        cfaad::dotProd(fixef_vary, fixef_vary + b_n_basis(), basis_i);
+
+      // construct the (association^T, 1).hat(M)(s) vector
+      double * const association_M_i{association_M + i * n_basis_rng_p1};
+      S const * rng_basis_j{basis_i + b_n_basis()};
+      vajoint_uint idx{}, idx_association{};
+      for(vajoint_uint j = 0; j < bases_rng.size(); ++j){
+        std::fill(association_M_i + idx,
+                  association_M_i + idx + rng_n_basis(j), 0);
+
+        for(size_t l = 0; l < ders()[j].size(); ++l, ++idx_association)
+          for(vajoint_uint k = 0; k < rng_n_basis(j); ++k)
+            association_M_i[idx + k] +=
+              association[idx_association] * *rng_basis_j++;
+
+        idx += rng_n_basis(j);
+      }
+      association_M_i[idx] = 1;
+
+      log_haz[i] += cfaad::dotProd
+        (association_M_i, association_M_i + n_vars, VA_mean);
+    }
+
+    if(n_vars < 1)
+      return;
+
+    // add the quadratic terms
+    int const n_vars_i = n_vars,
+             n_nodes_i = n_nodes,
+          n_basis_rng_p1_i = n_basis_rng_p1;
+    double const d_one{1}, d_zero{0};
+    char const c_L{'L'}, c_U{'U'};
+    F77_CALL(dsymm)
+      (&c_L, &c_U, &n_vars_i, &n_nodes_i, &d_one, VA_vcov, &n_vars_i,
+       association_M, &n_basis_rng_p1_i, &d_zero, V_M, &n_vars_i, 1, 1);
+
+    for(vajoint_uint i = 0; i < n_nodes; ++i)
+      log_haz[i] += cfaad::dotProd
+        (V_M + i * n_vars, V_M + (i + 1) * n_vars,
+         association_M + i * n_basis_rng_p1) / 2;
+  }
+
+  /// operator() for doubles with cached expansions
+  template<class S>
+  double eval_cached
+    (node_weight const &nws, double const lower, double const upper,
+     double const *design, double const * fixef, double const * fixef_vary,
+     double const * association, double const *VA_mean,
+     double const * VA_vcov, double * wk_mem,
+     S const * cached_expansions) const {
+    double * const association_M{wk_mem},
+           * const V_M{association_M + n_basis_rng_p1 * n_node_block},
+           * const log_haz{V_M + n_basis_rng_p1 * n_node_block},
+           * const haz{log_haz + n_node_block};
+    vajoint_uint const n_cache_node{cache_mem_per_node()};
+
+    double out{0};
+    for(vajoint_uint start = 0; start < nws.n_nodes; start += n_node_block){
+      vajoint_uint const n_block
+        {std::min(n_node_block, nws.n_nodes - start)};
+      log_haz_block
+        (cached_expansions + start * n_cache_node, n_block, fixef_vary,
+         association, VA_mean, VA_vcov, log_haz, association_M, V_M);
+      vec_exp(log_haz, haz, n_block);
+
+      for(vajoint_uint i = 0; i < n_block; ++i)
+        out += nws.ws[start + i] * haz[i];
+    }
+
+    return (upper - lower) * out *
+      std::exp(cfaad::dotProd(design, design + n_fixef, fixef));
+  }
+
+  /// grad with cached expansions
+  template<class S>
+  double grad_cached
+    (node_weight const &nws, double const lower, double const upper,
+     double const *design, double const * fixef, double const * fixef_vary,
+     double const * association, double const *VA_mean,
+     double const * VA_vcov, double * d_fixef, double * d_fixef_vary,
+     double * d_association, double * d_VA_mean, double * d_VA_vcov,
+     double * wk_mem, S const * cached_expansions) const {
+    vajoint_uint const n_vars
+      {with_frailty() ? n_basis_rng_p1 : n_basis_rng_p1 - 1},
+      n_cache_node{cache_mem_per_node()};
+
+    double * const association_M{wk_mem},
+           * const V_M{association_M + n_basis_rng_p1 * n_node_block},
+           * const scaled_M{V_M + n_basis_rng_p1 * n_node_block},
+           * const log_haz{scaled_M + n_basis_rng_p1 * n_node_block},
+           * const haz{log_haz + n_node_block};
+
+    double const fac
+      {(upper - lower) *
+        std::exp(cfaad::dotProd(design, design + n_fixef, fixef))};
+
+    double out{0};
+    for(vajoint_uint start = 0; start < nws.n_nodes; start += n_node_block){
+      vajoint_uint const n_block
+        {std::min(n_node_block, nws.n_nodes - start)};
+      S const * const cached_block{cached_expansions + start * n_cache_node};
+      log_haz_block
+        (cached_block, n_block, fixef_vary, association, VA_mean, VA_vcov,
+         log_haz, association_M, V_M);
+      vec_exp(log_haz, haz, n_block);
+
+      for(vajoint_uint i = 0; i < n_block; ++i){
+        haz[i] *= fac * nws.ws[start + i];
+        out += haz[i];
+      }
+
+      // add the derivatives
+      for(vajoint_uint i = 0; i < n_block; ++i){
+        S const * const basis_i{cached_block + i * n_cache_node};
+        for(vajoint_uint k = 0; k < b_n_basis(); ++k)
+          d_fixef_vary[k] += haz[i] * basis_i[k];
+
+        double const * const association_M_i
+          {association_M + i * n_basis_rng_p1};
+        double * const scaled_M_i{scaled_M + i * n_vars};
+        for(vajoint_uint k = 0; k < n_vars; ++k){
+          scaled_M_i[k] = haz[i] * association_M_i[k];
+          d_VA_mean[k] += scaled_M_i[k];
+        }
+
+        S const * rng_basis_j{basis_i + b_n_basis()};
+        double const * const V_M_i{V_M + i * n_vars};
+        vajoint_uint idx{}, idx_association{};
+        for(vajoint_uint j = 0; j < bases_rng.size(); ++j){
+          for(size_t l = 0; l < ders()[j].size(); ++l, ++idx_association){
+            double d_association_l{};
+            for(vajoint_uint k = 0; k < rng_n_basis(j); ++k)
+              d_association_l +=
+                rng_basis_j[k] * (V_M_i[idx + k] + VA_mean[idx + k]);
+            d_association[idx_association] += haz[i] * d_association_l;
+            rng_basis_j += rng_n_basis(j);
+          }
+
+          idx += rng_n_basis(j);
+        }
+      }
+
+      if(n_vars > 0){
+        // d_VA_vcov += scaled_M.association_M^T / 2
+        int const n_vars_i = n_vars,
+                 n_block_i = n_block,
+              n_basis_rng_p1_i = n_basis_rng_p1;
+        double const d_half{.5}, d_one{1};
+        char const c_N{'N'}, c_T{'T'};
+        F77_CALL(dgemm)
+          (&c_N, &c_T, &n_vars_i, &n_vars_i, &n_block_i, &d_half, scaled_M,
+           &n_vars_i, association_M, &n_basis_rng_p1_i, &d_one, d_VA_vcov,
+           &n_vars_i, 1, 1);
+      }
+    }
+
+    for(vajoint_uint k = 0; k < n_fixef; ++k)
+      d_fixef[k] += out * design[k];
+
+    return out;
+  }
+
 public:
   expected_cum_hazzard
   (basisMixin const &b_in, bases_vector const &bases_rng,
@@ -132,16 +337,23 @@ public:
   /**
    * evaluates the approximate expected cumulative hazard between
    * lower and upper times minus 1. The wk_mem and dwk_mem arguments are
-   * for working memory. The last argument is possibly cached basis expansions.
-   * Use a null pointer if there is no caching
+   * for working memory. The last argument is possibly cached basis expansions
+   * which are stored as doubles or floats. Use a null pointer if there is no
+   * caching
    */
-  template<class T>
+  template<class T, class S>
   T operator()
     (node_weight const &nws, double const lower, double const upper,
      double const *design, double const * const fixef_design_varying,
      double const * const rng_design_varying, T const * fixef, T const * fixef_vary,
      T const * association, T const *VA_mean, T const * VA_vcov,
-     T * wk_mem, double * dwk_mem, double const * cached_expansions) const {
+     T * wk_mem, double * dwk_mem, S const * cached_expansions) const {
+    if constexpr (std::is_same<T, double>::value)
+      if(cached_expansions)
+        return eval_cached
+          (nws, lower, upper, design, fixef, fixef_vary, association, VA_mean,
+           VA_vcov, dwk_mem, cached_expansions);
+
     T out{0};
     bool const use_cache = cached_expansions;
 
@@ -158,8 +370,8 @@ public:
       if(use_cache){
         // compute the term from the time-varying fixed effects
         fixef_term =
-          cfaad::dotProd(cached_expansions,
-                         cached_expansions + b_n_basis(), fixef_vary);
+          cfaad::dotProd(fixef_vary, fixef_vary + b_n_basis(),
+                         cached_expansions);
         cached_expansions += b_n_basis();
 
         // construct the (association^T, 1).hat(M)(s) vector
@@ -206,16 +418,11 @@ public:
         association_M[idx] = 1;
       }
 
-      // add the mean log hazard term
-      auto mean_term = cfaad::dotProd
-        (association_M, association_M + n_vars, VA_mean);
-
-      // add the quadratic term
-      auto quad_term = cfaad::quadFormSym
-        (VA_vcov, association_M, association_M + n_vars) / 2;
-
-      // add the hazard term multiplied by the weight
-      out += nws.ws[i] * exp(quad_term + mean_term + fixef_term);
+      // add the hazard term with the mean and the quadratic term multiplied
+      // by the weight
+      out += cfaad::expQuadMean
+        (nws.ws[i], fixef_term, VA_vcov, association_M,
+         association_M + n_vars, VA_mean);
     }
 
     // compute the fixed effect on the log hazard scale, add it, and return
@@ -223,6 +430,20 @@ public:
       exp(cfaad::dotProd(design, design + n_fixef, fixef));
   }
 
+  /// overload for the case without cached expansions
+  template<class T>
+  T operator()
+    (node_weight const &nws, double const lower, double const upper,
+     double const *design, double const * const fixef_design_varying,
+     double const * const rng_design_varying, T const * fixef, T const * fixef_vary,
+     T const * association, T const *VA_mean, T const * VA_vcov,
+     T * wk_mem, double * dwk_mem, std::nullptr_t) const {
+    return (*this)
+      (nws, lower, upper, design, fixef_design_varying, rng_design_varying,
+       fixef, fixef_vary, association, VA_mean, VA_vcov, wk_mem, dwk_mem,
+       static_cast<double const *>(nullptr));
+  }
+
   /**
    * returns the needed working memory of eval. The first elements is the
    * required T memory and the second element is the required double memory.
@@ -231,6 +452,314 @@ public:
     return n_wmem_v;
   }
 
+  /**
+   * computes the same as operator() with T = double and adds the gradient
+   * w.r.t. fixef, fixef_vary, association, VA_mean, and VA_vcov to d_fixef,
+   * d_fixef_vary, d_association, d_VA_mean, and d_VA_vcov. The derivatives are
+   * computed analytically rather than with the AD tape.
+   *
+   * The required working memory is given by n_wmem_grad().
+   */
+  template<class S>
+  double grad
+    (node_weight const &nws, double const lower, double const upper,
+     double const *design, double const * const fixef_design_varying,
+     double const * const rng_design_varying, double const * fixef,
+     double const * fixef_vary, double const * association,
+     double const *VA_mean, double const * VA_vcov, double * d_fixef,
+     double * d_fixef_vary, double * d_association, double * d_VA_mean,
+     double * d_VA_vcov, double * wk_mem,
+     S const * cached_expansions) const {
+    if(cached_expansions)
+      return grad_cached
+        (nws, lower, upper, design, fixef, fixef_vary, association, VA_mean,
+         VA_vcov, d_fixef, d_fixef_vary, d_association, d_VA_mean, d_VA_vcov,
+         wk_mem, cached_expansions);
+
+    vajoint_uint const n_vars
+      {with_frailty() ? n_basis_rng_p1 : n_basis_rng_p1 - 1},
+      n_cache_node{cache_mem_per_node()};
+
+    double * const association_M{wk_mem},
+           * const d_log_haz_d_M{association_M + n_basis_rng_p1},
+           * const node_basis{d_log_haz_d_M + n_basis_rng_p1},
+           * const basis_wk_mem{node_basis + n_cache_node};
+
+    double const fac
+      {(upper - lower) *
+        std::exp(cfaad::dotProd(design, design + n_fixef, fixef))};
+
+    double out{0};
+    for(vajoint_uint i = 0; i < nws.n_nodes; ++i){
+      // get the basis expansions at the node
+      cache_expansion_at
+        (scale_node_val(lower, upper, nws.ns[i]), node_basis, basis_wk_mem,
+         fixef_design_varying, rng_design_varying);
+      double const * const basis_i{node_basis};
+
+      // compute the term from the time-varying fixed effects
+      double const fixef_term
+        {cfaad::dotProd(basis_i, basis_i + b_n_basis(), fixef_vary)};
+      double const * const rng_basis{basis_i + b_n_basis()};
+
+      // construct the (association^T, 1).hat(M)(s) vector
+      {
+        double const * rng_basis_j{rng_basis};
+        vajoint_uint idx{}, idx_association{};
+        for(vajoint_uint j = 0; j < bases_rng.size(); ++j){
+          std::fill(association_M + idx,
+                    association_M + idx + rng_n_basis(j), 0);
+
+          for(size_t l = 0; l < ders()[j].size(); ++l, ++idx_association)
+            for(vajoint_uint k = 0; k < rng_n_basis(j); ++k)
+              association_M[idx + k] +=
+                association[idx_association] * *rng_basis_j++;
+
+          idx += rng_n_basis(j);
+        }
+        association_M[idx] = 1;
+      }
+
+      // compute the mean and quadratic term along with the derivative of the
+      // log hazard w.r.t. association_M. Only the upper triangle of VA_vcov is
+      // used as in cfaad::quadFormSym
+      double mean_term{}, quad_term{};
+      std::fill(d_log_haz_d_M, d_log_haz_d_M + n_vars, 0);
+      for(vajoint_uint k = 0; k < n_vars; ++k){
+        double const * const VA_vcov_k{VA_vcov + k * n_vars};
+        for(vajoint_uint l = 0; l < k; ++l){
+          d_log_haz_d_M[l] += VA_vcov_k[l] * association_M[k];
+          d_log_haz_d_M[k] += VA_vcov_k[l] * association_M[l];
+        }
+        d_log_haz_d_M[k] += VA_vcov_k[k] * association_M[k];
+      }
+      for(vajoint_uint k = 0; k < n_vars; ++k){
+        quad_term += association_M[k] * d_log_haz_d_M[k];
+        mean_term += association_M[k] * VA_mean[k];
+        d_log_haz_d_M[k] += VA_mean[k];
+      }
+      quad_term /= 2;
+
+      double const haz_term
+        {fac * nws.ws[i] * std::exp(quad_term + mean_term + fixef_term)};
+      out += haz_term;
+
+      // add the derivatives
+      for(vajoint_uint k = 0; k < b_n_basis(); ++k)
+        d_fixef_vary[k] += haz_term * basis_i[k];
+
+      for(vajoint_uint k = 0; k < n_vars; ++k){
+        double const scaled_M_k{haz_term * association_M[k]};
+        d_VA_mean[k] += scaled_M_k;
+
+        double * const d_VA_vcov_k{d_VA_vcov + k * n_vars};
+        for(vajoint_uint l = 0; l < n_vars; ++l)
+          d_VA_vcov_k[l] += .5 * scaled_M_k * association_M[l];
+      }
+
+      {
+        double const * rng_basis_j{rng_basis};
+        vajoint_uint idx{}, idx_association{};
+        for(vajoint_uint j = 0; j < bases_rng.size(); ++j){
+          for(size_t l = 0; l < ders()[j].size(); ++l, ++idx_association){
+            double const d_association_l
+              {cfaad::dotProd(rng_basis_j, rng_basis_j + rng_n_basis(j),
+                              d_log_haz_d_M + idx)};
+            d_association[idx_association] += haz_term * d_association_l;
+            rng_basis_j += rng_n_basis(j);
+          }
+
+          idx += rng_n_basis(j);
+        }
+      }
+    }
+
+    for(vajoint_uint k = 0; k < n_fixef; ++k)
+      d_fixef[k] += out * design[k];
+
+    return out;
+  }
+
+  /// overload for the case without cached expansions
+  double grad
+    (node_weight const &nws, double const lower, double const upper,
+     double const *design, double const * const fixef_design_varying,
+     double const * const rng_design_varying, double const * fixef,
+     double const * fixef_vary, double const * association,
+     double const *VA_mean, double const * VA_vcov, double * d_fixef,
+     double * d_fixef_vary, double * d_association, double * d_VA_mean,
+     double * d_VA_vcov, double * wk_mem, std::nullptr_t) const {
+    return grad
+      (nws, lower, upper, design, fixef_design_varying, rng_design_varying,
+       fixef, fixef_vary, association, VA_mean, VA_vcov, d_fixef,
+       d_fixef_vary, d_association, d_VA_mean, d_VA_vcov, wk_mem,
+       static_cast<double const *>(nullptr));
+  }
+
+  /**
+   * adds the directional derivative in the direction dir_fixef,
+   * dir_fixef_vary, dir_association, dir_VA_mean, and dir_VA_vcov of what grad
+   * adds to d_fixef, d_fixef_vary, d_association, d_VA_mean, and d_VA_vcov.
+   * That is, the Hessian times the direction. VA_vcov and dir_VA_vcov must be
+   * symmetric.
+   *
+   * The required working memory is given by n_wmem_hess().
+   */
+  template<class S>
+  void hess_vec
+    (node_weight const &nws, double const lower, double const upper,
+     double const *design, double const * const fixef_design_varying,
+     double const * const rng_design_varying, double const * fixef,
+     double const * fixef_vary, double const * association,
+     double const *VA_mean, double const * VA_vcov,
+     double const * dir_fixef, double const * dir_fixef_vary,
+     double const * dir_association, double const * dir_VA_mean,
+     double const * dir_VA_vcov, double * d_fixef, double * d_fixef_vary,
+     double * d_association, double * d_VA_mean, double * d_VA_vcov,
+     double * wk_mem, S const * cached_expansions) const {
+    vajoint_uint const n_vars
+      {with_frailty() ? n_basis_rng_p1 : n_basis_rng_p1 - 1},
+      n_cache_node{cache_mem_per_node()};
+
+    /* association_M is (association^T, 1).hat(M)(s), V_M_mean is
+     * VA_vcov.association_M + VA_mean, and dir_ denotes the directional
+     * derivatives */
+    double * const association_M{wk_mem},
+           * const dir_association_M{association_M + n_basis_rng_p1},
+           * const V_M_mean{dir_association_M + n_basis_rng_p1},
+           * const dir_V_M_mean{V_M_mean + n_basis_rng_p1},
+           * const dir_V_M{dir_V_M_mean + n_basis_rng_p1},
+           * const node_basis{dir_V_M + n_basis_rng_p1},
+           * const basis_wk_mem{node_basis + n_cache_node};
+
+    double const fac
+      {(upper - lower) *
+        std::exp(cfaad::dotProd(design, design + n_fixef, fixef))},
+                 dir_fixef_term
+      {cfaad::dotProd(design, design + n_fixef, dir_fixef)};
+
+    double d_out{0};
+    for(vajoint_uint i = 0; i < nws.n_nodes; ++i){
+      // get the basis expansions at the node
+      if(cached_expansions)
+        std::copy(cached_expansions + i * n_cache_node,
+                  cached_expansions + (i + 1) * n_cache_node, node_basis);
+      else
+        cache_expansion_at
+          (scale_node_val(lower, upper, nws.ns[i]), node_basis, basis_wk_mem,
+           fixef_design_varying, rng_design_varying);
+      double const * const basis_i{node_basis},
+                   * const rng_basis{basis_i + b_n_basis()};
+
+      // construct the (association^T, 1).hat(M)(s) vector and its derivative
+      {
+        double const * rng_basis_j{rng_basis};
+        vajoint_uint idx{}, idx_association{};
+        for(vajoint_uint j = 0; j < bases_rng.size(); ++j){
+          std::fill(association_M + idx,
+                    association_M + idx + rng_n_basis(j), 0);
+          std::fill(dir_association_M + idx,
+                    dir_association_M + idx + rng_n_basis(j), 0);
+
+          for(size_t l = 0; l < ders()[j].size(); ++l, ++idx_association)
+            for(vajoint_uint k = 0; k < rng_n_basis(j); ++k, ++rng_basis_j){
+              association_M[idx + k] +=
+                association[idx_association] * *rng_basis_j;
+              dir_association_M[idx + k] +=
+                dir_association[idx_association] * *rng_basis_j;
+            }
+
+          idx += rng_n_basis(j);
+        }
+        association_M[idx] = 1;
+        dir_association_M[idx] = 0;
+      }
+
+      for(vajoint_uint k = 0; k < n_vars; ++k){
+        V_M_mean[k] = VA_mean[k];
+        dir_V_M_mean[k] = dir_VA_mean[k];
+        dir_V_M[k] = 0;
+        for(vajoint_uint l = 0; l < n_vars; ++l){
+          V_M_mean[k] += VA_vcov[k + l * n_vars] * association_M[l];
+          dir_V_M[k] += dir_VA_vcov[k + l * n_vars] * association_M[l];
+          dir_V_M_mean[k] += VA_vcov[k + l * n_vars] * dir_association_M[l];
+        }
+        dir_V_M_mean[k] += dir_V_M[k];
+      }
+
+      // the log hazard and its directional derivative
+      double const fixef_term
+        {cfaad::dotProd(basis_i, basis_i + b_n_basis(), fixef_vary)},
+                    mean_term
+        {cfaad::dotProd(association_M, association_M + n_vars, VA_mean)},
+                    V_M_mean_term
+        {cfaad::dotProd(association_M, association_M + n_vars, V_M_mean)};
+
+      double const dir_log_haz
+        {dir_fixef_term +
+          cfaad::dotProd(basis_i, basis_i + b_n_basis(), dir_fixef_vary) +
+          cfaad::dotProd
+            (dir_association_M, dir_association_M + n_vars, V_M_mean) +
+          cfaad::dotProd(association_M, association_M + n_vars, dir_VA_mean) +
+          cfaad::dotProd(association_M, association_M + n_vars, dir_V_M) / 2};
+
+      double const haz_term
+        {fac * nws.ws[i] *
+          std::exp(fixef_term + (V_M_mean_term + mean_term) / 2)},
+               dir_haz_term{haz_term * dir_log_haz};
+      d_out += dir_haz_term;
+
+      // add the derivatives
+      for(vajoint_uint k = 0; k < b_n_basis(); ++k)
+        d_fixef_vary[k] += dir_haz_term * basis_i[k];
+
+      for(vajoint_uint k = 0; k < n_vars; ++k){
+        d_VA_mean[k] +=
+          dir_haz_term * association_M[k] +
+          haz_term * dir_association_M[k];
+
+        double * const d_VA_vcov_k{d_VA_vcov + k * n_vars};
+        for(vajoint_uint l = 0; l < n_vars; ++l)
+          d_VA_vcov_k[l] += .5 *
+            (dir_haz_term * association_M[k] * association_M[l] +
+              haz_term * (dir_association_M[k] * association_M[l] +
+                          association_M[k] * dir_association_M[l]));
+      }
+
+      {
+        double const * rng_basis_j{rng_basis};
+        vajoint_uint idx{}, idx_association{};
+        for(vajoint_uint j = 0; j < bases_rng.size(); ++j){
+          for(size_t l = 0; l < ders()[j].size(); ++l, ++idx_association){
+            d_association[idx_association] +=
+              dir_haz_term *
+                cfaad::dotProd(rng_basis_j, rng_basis_j + rng_n_basis(j),
+                               V_M_mean + idx) +
+              haz_term *
+                cfaad::dotProd(rng_basis_j, rng_basis_j + rng_n_basis(j),
+                               dir_V_M_mean + idx);
+            rng_basis_j += rng_n_basis(j);
+          }
+
+          idx += rng_n_basis(j);
+        }
+      }
+    }
+
+    for(vajoint_uint k = 0; k < n_fixef; ++k)
+      d_fixef[k] += d_out * design[k];
+  }
+
+  /// returns the needed double working memory of grad
+  size_t n_wmem_grad() const {
+    return n_wmem_grad_v;
+  }
+
+  /// returns the needed double working memory of hess_vec
+  size_t n_wmem_hess() const {
+    return n_wmem_hess_v;
+  }
+
   std::vector<std::vector<int> > const & ders() const {
     return ders_v;
   }
@@ -240,7 +769,7 @@ public:
     (double const lower, double const upper, double * cache_mem,
      double * wk_mem, node_weight const &nws,
      double const * const fixef_design_varying,
-     double const * const rng_design_varying){
+     double const * const rng_design_varying) const {
     // evaluates the cached expansions
     for(vajoint_uint i = 0; i < nws.n_nodes; ++i)
       cache_mem = cache_expansion_at
@@ -254,7 +783,8 @@ public:
    */
   double * cache_expansion_at
     (double const at, double * cache_mem, double * wk_mem,
-     double const *fixef_design_varying, double const * rng_design_varying){
+     double const *fixef_design_varying,
+     double const * rng_design_varying) const {
     (*b)(cache_mem, wk_mem, at, fixef_design_varying);
     cache_mem += b_n_basis();
 
@@ -333,15 +863,262 @@ class survival_dat {
   vajoint_uint n_outcomes_v = bases_fix.size();
   /// the required working memory
   std::array<size_t, 2> wmem_w;
+  /// the required working memory for grad
+  size_t wmem_grad;
+  /// the required working memory for hess_vec
+  size_t wmem_hess;
 
   /// holds memory for the cached expansions
   std::vector<simple_mat<double> > cached_expansions;
+  /// holds memory for the cached expansions if they are stored as floats
+  std::vector<simple_mat<float> > cached_expansions_float;
+  /// true if the cached expansions are stored as floats
+  bool cache_as_float{false};
+
+  /// a least recently used cache of expansions and the lock of the cache
+  struct lazy_shard {
+    lru_cache cache;
+    std::mutex lock;
+  };
+  /**
+   * the shards of the least recently used cache of the expansions which is
+   * shared by all threads. It is used instead of cached_expansions if the
+   * expansions are computed when they are first needed subject to a bound on
+   * the memory. An observation always belongs to the same shard which is
+   * locked while its expansions are used.
+   */
+  mutable std::vector<lazy_shard> lazy_shards;
+  /// the number of shards of the lazy cache per thread
+  static constexpr unsigned n_lazy_shards_per_thread{8};
 
   /// the cached quadrature nodes and weights
   std::vector<double> cached_nodes, cached_weights;
 
+  /**
+   * the tolerance of the heuristic used to select the number of nodes for
+   * each observation. Zero if the cached quadrature rule is used for all
+   */
+  double cached_node_selection_tol{0};
+
+  /**
+   * Gauss-Legendre rules with fewer nodes than the cached quadrature rule
+   * which are used for some observations if cached_node_selection_tol is
+   * positive
+   */
+  std::vector<std::vector<double> > reduced_nodes, reduced_weights;
+
+  /**
+   * the composite rules of the observations with cached expansions for each
+   * type of outcome if the split rules are used
+   */
+  std::vector<std::vector<double> > cached_split_nodes, cached_split_weights;
+
+  /// the first column in cached_expansions and the rule of an observation
+  struct cache_info_obj {
+    size_t col;
+    node_weight rule;
+  };
+  /// the cache_info_obj for each type of outcome and each observation
+  std::vector<std::vector<cache_info_obj> > cache_info;
+
+  /// the sorted break points of the bases for each type of outcome
+  std::vector<std::vector<double> > break_points_v;
+
+  /// the rule that is applied to each piece with the split rules
+  std::vector<double> split_piece_nodes, split_piece_weights;
+  /**
+   * the working memory for the composite rule of an observation with the
+   * split rules. It is added to the working memory of eval, grad, and
+   * hess_vec.
+   */
+  size_t split_wmem{};
+
   bool has_cached_expansions() const {
-    return cached_expansions.size() > 0;
+    return cache_info.size() > 0;
+  }
+
+  bool has_lazy_cache() const {
+    return lazy_shards.size() > 0;
+  }
+
+  /// returns true if nws is the same as the cached quadrature rule
+  bool is_cached_rule(node_weight const &nws) const {
+    bool out
+      {nws.n_nodes == cached_nodes.size() &&
+        nws.n_nodes == cached_weights.size()};
+    for(vajoint_uint i = 0; i < nws.n_nodes && out; ++i)
+      out &= nws.ns[i] == cached_nodes[i] && nws.ws[i] == cached_weights[i];
+    return out;
+  }
+
+  /// returns the key of an observation in the lazy cache
+  size_t lazy_key(vajoint_uint const idx, vajoint_uint const type) const {
+    return static_cast<size_t>(idx) * n_outcomes() + type;
+  }
+
+  /// returns the shard of the lazy cache with an observation
+  lazy_shard& get_lazy_shard
+    (vajoint_uint const idx, vajoint_uint const type) const {
+    return lazy_shards[lazy_key(idx, type) % lazy_shards.size()];
+  }
+
+  /**
+   * returns the expansions of an observation from its shard of the lazy cache
+   * using the passed rule. The expansions are computed and added if they are
+   * not in the cache. The shard has to be locked while the expansions are
+   * used. wk_mem needs room for the working memory of the bases. Returns a
+   * nullptr if the expansions are too large.
+   */
+  double const * lazy_expansions
+    (vajoint_uint const idx, vajoint_uint const type, node_weight const &nws,
+     double * wk_mem, lru_cache &cache) const {
+    size_t const key{lazy_key(idx, type)};
+    double const * out{cache.find(key)};
+    if(out)
+      return out;
+
+    obs_info_obj const &info{obs_info[type][idx]};
+    expected_cum_hazzard const &haz{cum_hazs[type]};
+    double * cache_mem
+      {cache.insert
+        (key, haz.cache_mem_per_node() * (nws.n_nodes + info.event))};
+    if(!cache_mem)
+      return nullptr;
+    out = cache_mem;
+
+    double const * const fixef_design_varying
+      {fixef_design_varying_mats[type].col(idx)},
+                 * const rng_design_varying
+      {rng_design_varying_mats[type].col(idx)};
+    if(info.event)
+      cache_mem = haz.cache_expansion_at
+        (info.ub, cache_mem, wk_mem, fixef_design_varying, rng_design_varying);
+    haz.cache_expansions
+      (info.lb, info.ub, cache_mem, wk_mem, nws, fixef_design_varying,
+       rng_design_varying);
+
+    return out;
+  }
+
+  bool has_split_rules() const {
+    return split_piece_nodes.size() > 0;
+  }
+
+  /**
+   * returns the rule to use for an observation given the passed rule. With
+   * split rules, the composite rule is written to split_mem which needs
+   * split_wmem elements.
+   */
+  node_weight obs_rule
+    (size_t const type, size_t const obs, node_weight const &nws,
+     double * split_mem) const {
+    if(!has_split_rules())
+      return nws;
+
+    obs_info_obj const &info{obs_info[type][obs]};
+    auto const &breaks = break_points_v[type];
+    double * const ns{split_mem},
+           * const ws{split_mem + split_wmem / 2};
+    vajoint_uint const n_nodes
+      {split_rule(info.lb, info.ub, breaks.data(),
+                  breaks.data() + breaks.size(),
+                  {split_piece_nodes.data(), split_piece_weights.data(),
+                   static_cast<vajoint_uint>(split_piece_nodes.size())},
+                  ns, ws)};
+    return { ns, ws, n_nodes };
+  }
+
+  /**
+   * returns the rule with index rule in reduced_nodes. With split rules, the
+   * composite rule is written to ns and ws which must have room for the
+   * number of pieces times the number of nodes.
+   */
+  node_weight reduced_rule
+    (size_t const type, size_t const obs, vajoint_uint const rule, double *ns,
+     double *ws) const {
+    node_weight const piece
+      {reduced_nodes[rule].data(), reduced_weights[rule].data(),
+       static_cast<vajoint_uint>(reduced_nodes[rule].size())};
+    if(!has_split_rules())
+      return piece;
+
+    obs_info_obj const &info{obs_info[type][obs]};
+    auto const &breaks = break_points_v[type];
+    vajoint_uint const n_nodes
+      {split_rule(info.lb, info.ub, breaks.data(),
+                  breaks.data() + breaks.size(), piece, ns, ws)};
+    return { ns, ws, n_nodes };
+  }
+
+  /**
+   * selects the rule with the fewest nodes for an observation such that the
+   * integrals over [lb, ub] of exp(+/-e_k) and e_l * exp(+/-e_k) for all
+   * cached expansions e_k and e_l are within cached_node_selection_tol times
+   * the integral of their absolute value computed with full_rule. These mimic
+   * the integrands of the expected cumulative hazard and its gradient as the
+   * log hazard is a linear combination of the expansions. split_mem is passed
+   * to reduced_rule and needs room for 2 x full_rule.n_nodes elements.
+   */
+  vajoint_uint select_rule
+    (size_t const type, size_t const obs, node_weight const &full_rule,
+     double * wk_mem, double * split_mem) const {
+    expected_cum_hazzard const &haz{cum_hazs[type]};
+    obs_info_obj const &info{obs_info[type][obs]};
+    vajoint_uint const n_cache{haz.cache_mem_per_node()},
+                       n_terms{2 * n_cache * (n_cache + 1)};
+
+    double * const integrals{wk_mem},
+           * const integrals_full{integrals + n_terms},
+           * const abs_integrals_full{integrals_full + n_terms},
+           * const expansion{abs_integrals_full + n_terms},
+           * const basis_wk_mem{expansion + n_cache};
+
+    auto comp_integrals = [&](node_weight const &nws, double *res,
+                              double *abs_res){
+      std::fill(res, res + n_terms, 0);
+      if(abs_res)
+        std::fill(abs_res, abs_res + n_terms, 0);
+
+      for(vajoint_uint i = 0; i < nws.n_nodes; ++i){
+        haz.cache_expansion_at
+          ((info.ub - info.lb) * nws.ns[i] + info.lb, expansion,
+           basis_wk_mem, fixef_design_varying_mats[type].col(obs),
+           rng_design_varying_mats[type].col(obs));
+
+        vajoint_uint idx{};
+        auto add_term = [&](double const val){
+          res[idx] += nws.ws[i] * val;
+          if(abs_res)
+            abs_res[idx] += nws.ws[i] * std::abs(val);
+          ++idx;
+        };
+        for(vajoint_uint k = 0; k < n_cache; ++k)
+          for(double const sign : {-1., 1.}){
+            double const exp_term{std::exp(sign * expansion[k])};
+            add_term(exp_term);
+            for(vajoint_uint l = 0; l < n_cache; ++l)
+              add_term(expansion[l] * exp_term);
+          }
+      }
+    };
+
+    comp_integrals(full_rule, integrals_full, abs_integrals_full);
+
+    for(vajoint_uint rule = 0; rule < reduced_nodes.size(); ++rule){
+      comp_integrals
+        (reduced_rule(type, obs, rule, split_mem,
+                      split_mem + full_rule.n_nodes),
+         integrals, nullptr);
+
+      bool passed{true};
+      for(vajoint_uint k = 0; k < n_terms && passed; ++k)
+        passed = std::abs(integrals[k] - integrals_full[k]) <=
+          cached_node_selection_tol * abs_integrals_full[k];
+      if(passed)
+        return rule;
+    }
+
+    return reduced_nodes.size();
   }
 
 public:
@@ -399,10 +1176,30 @@ public:
     vajoint_uint const n_shared_p1{par_idx.n_shared() + 1};
     wmem_w[0] += n_shared_p1 * (n_shared_p1 + 1);
 
+    wmem_grad = 0;
+    for(auto &ch : cum_hazs)
+      wmem_grad = std::max(wmem_grad, ch.n_wmem_grad());
+
     max_basis_dim = n_shared_p1;
     for(auto &b : bases_fix)
       max_basis_dim = std::max<vajoint_uint>(b->n_basis(), max_basis_dim);
     wmem_w[1] += max_basis_dim;
+    wmem_grad += 2 * n_shared_p1 * (n_shared_p1 + 1);
+
+    wmem_hess = 0;
+    for(auto &ch : cum_hazs)
+      wmem_hess = std::max(wmem_hess, ch.n_wmem_hess());
+    wmem_hess += 3 * n_shared_p1 * (n_shared_p1 + 1);
+
+    // find the break points of the bases
+    break_points_v.resize(n_outcomes_v);
+    for(vajoint_uint type = 0; type < n_outcomes_v; ++type){
+      auto &breaks = break_points_v[type];
+      bases_fix[type]->break_points(breaks);
+      for(auto &b : bases_rng)
+        b->break_points(breaks);
+      joint_bases::sort_unique_break_points(breaks);
+    }
 
     // add the observations
     obs_info.resize(n_outcomes_v);
@@ -441,68 +1238,374 @@ public:
     }
   }
 
-  void set_cached_expansions(node_weight const &nws){
-    if(has_cached_expansions()){
-      /// check if we already use the same quadrature rule
-      bool is_same_rule
-        {nws.n_nodes == cached_nodes.size() &&
-          nws.n_nodes == cached_weights.size()};
-      for(vajoint_uint i = 0; i < nws.n_nodes && is_same_rule; ++i)
-        is_same_rule &= nws.ns[i] == cached_nodes[i] &&
-          nws.ws[i] == cached_weights[i];
-
-      if(is_same_rule)
-        return;
-    }
+  /**
+   * sets the cached expansions. If node_selection_tol is positive then the
+   * number of nodes is selected for each observation from Gauss-Legendre rules with
+   * fewer nodes than nws (see select_rule). Otherwise, nws is used for all.
+   * The split rules are used in place of nws if they are set and the
+   * Gauss-Legendre rules are then applied to each piece. Observations with
+   * the same interval, outcome indicator, and time-varying design matrices
+   * share the same columns. The expansions are stored as floats if as_float
+   * is true. This halves the memory but the results are only accurate to
+   * roughly single precision. The rules are selected and the expansions are
+   * computed with n_threads threads.
+   */
+  void set_cached_expansions
+    (node_weight const &nws, double const node_selection_tol = 0,
+     bool const as_float = false, unsigned const n_threads = 1){
+    if(has_cached_expansions() && is_cached_rule(nws) &&
+         node_selection_tol == cached_node_selection_tol &&
+         as_float == cache_as_float)
+      // we already use the same quadrature rule
+      return;
+    lazy_shards.clear();
 
     vajoint_uint const n_nodes{nws.n_nodes};
     cached_weights.resize(n_nodes);
     std::copy(nws.ws, nws.ws + n_nodes, cached_weights.begin());
     cached_nodes.resize(n_nodes);
     std::copy(nws.ns, nws.ns + n_nodes, cached_nodes.begin());
+    cached_node_selection_tol = node_selection_tol;
+    cache_as_float = as_float;
+
+    // the candidate rules with fewer nodes
+    reduced_nodes.clear();
+    reduced_weights.clear();
+    if(node_selection_tol > 0){
+      constexpr vajoint_uint candidates[]
+        {2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128};
+      for(vajoint_uint n_nodes_cand : candidates){
+        if(n_nodes_cand >= n_nodes)
+          break;
+        reduced_nodes.emplace_back(n_nodes_cand);
+        reduced_weights.emplace_back(n_nodes_cand);
+        gauss_legendre_rule(n_nodes_cand, reduced_nodes.back().data(),
+                            reduced_weights.back().data());
+      }
+    }
 
     cached_expansions.clear();
-    cached_expansions.reserve(obs_info.size());
+    cached_expansions_float.clear();
+    (as_float ? cached_expansions_float.reserve(obs_info.size())
+              : cached_expansions.reserve(obs_info.size()));
+    cache_info.resize(obs_info.size());
+    cached_split_nodes.assign(obs_info.size(), {});
+    cached_split_weights.assign(obs_info.size(), {});
     for(size_t type = 0; type < obs_info.size(); ++type){
       auto &info_objs = obs_info[type];
       auto &haz_type = cum_hazs[type];
       auto const &fixef_design_varying_mat = fixef_design_varying_mats[type];
       auto const &rng_design_varying_mat = rng_design_varying_mats[type];
 
-      size_t const n_basis_cols{(n_nodes + 1) * info_objs.size()};
-      std::vector<double> wk_mem(haz_type.n_wmem()[1]);
+      vajoint_uint const n_cache{haz_type.cache_mem_per_node()};
+      size_t const n_wk_mem
+        {haz_type.n_wmem()[1] + 6 * n_cache * (n_cache + 1) + n_cache},
+                   n_split_mem
+        {has_split_rules()
+           ? 2 * (break_points_v[type].size() + 1) * n_nodes : 0};
+
+      auto &info_type = cache_info[type];
+      info_type.resize(info_objs.size());
+      auto &split_nodes_type = cached_split_nodes[type],
+           &split_weights_type = cached_split_weights[type];
+      std::vector<double> split_mem(n_split_mem), full_mem(split_wmem);
+
+      // find the first observation with the same interval, outcome indicator,
+      // and design matrices. These share the cached expansions
+      std::vector<size_t> first_obs(info_objs.size());
+      {
+        std::map<std::vector<double>, size_t> key_to_obs;
+        vajoint_uint const n_fix_vary{fixef_design_varying_mat.n_rows()},
+                           n_rng_vary{rng_design_varying_mat.n_rows()};
+        std::vector<double> key(3 + n_fix_vary + n_rng_vary);
+        for(size_t obs = 0; obs < info_objs.size(); ++obs){
+          key[0] = info_objs[obs].lb;
+          key[1] = info_objs[obs].ub;
+          key[2] = info_objs[obs].event;
+          std::copy(fixef_design_varying_mat.col(obs),
+                    fixef_design_varying_mat.col(obs) + n_fix_vary,
+                    key.begin() + 3);
+          std::copy(rng_design_varying_mat.col(obs),
+                    rng_design_varying_mat.col(obs) + n_rng_vary,
+                    key.begin() + 3 + n_fix_vary);
+          first_obs[obs] = key_to_obs.emplace(key, obs).first->second;
+        }
+      }
+
+      // select the rule of each observation. Each thread needs its own
+      // working memory for the bases
+      std::vector<vajoint_uint> rules
+        (info_objs.size(), static_cast<vajoint_uint>(reduced_nodes.size()));
+      if(node_selection_tol > 0){
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+        {
+          std::vector<double> wk_mem(n_wk_mem), split_mem_thread(n_split_mem),
+                              full_mem_thread(split_wmem);
 
-      cached_expansions.emplace_back
-        (haz_type.cache_mem_per_node(), n_basis_cols);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+          for(size_t obs = 0; obs < info_objs.size(); ++obs)
+            if(first_obs[obs] == obs)
+              rules[obs] = select_rule
+                (type, obs, obs_rule(type, obs, nws, full_mem_thread.data()),
+                 wk_mem.data(), split_mem_thread.data());
+        }
+      }
+
+      // find the number of columns. The composite rules are stored as offsets
+      // until all are added
+      std::vector<size_t> split_offsets(info_objs.size());
+      size_t n_basis_cols{};
       for(size_t obs = 0; obs < info_objs.size(); ++obs){
-        double * cache_mem{cached_expansions.back().col(obs * (n_nodes + 1))};
+        if(first_obs[obs] != obs){
+          info_type[obs] = info_type[first_obs[obs]];
+          split_offsets[obs] = split_offsets[first_obs[obs]];
+          continue;
+        }
+
+        vajoint_uint const rule{rules[obs]};
+
+        node_weight rule_obs
+          {rule < reduced_nodes.size()
+             ? reduced_rule
+               (type, obs, rule, split_mem.data(),
+                split_mem.data() + split_mem.size() / 2)
+             : obs_rule
+               (type, obs,
+                { cached_nodes.data(), cached_weights.data(), n_nodes },
+                full_mem.data())};
+        if(has_split_rules()){
+          // store a copy of the composite rule
+          split_offsets[obs] = split_nodes_type.size();
+          split_nodes_type.insert
+            (split_nodes_type.end(), rule_obs.ns,
+             rule_obs.ns + rule_obs.n_nodes);
+          split_weights_type.insert
+            (split_weights_type.end(), rule_obs.ws,
+             rule_obs.ws + rule_obs.n_nodes);
+          rule_obs.ns = rule_obs.ws = nullptr;
+        }
+
+        info_type[obs] = { n_basis_cols, rule_obs };
+        n_basis_cols += rule_obs.n_nodes + info_objs[obs].event;
+      }
+
+      for(size_t obs = 0; obs < info_objs.size(); ++obs)
+        if(!info_type[obs].rule.ns){
+          info_type[obs].rule.ns = split_nodes_type.data() + split_offsets[obs];
+          info_type[obs].rule.ws =
+            split_weights_type.data() + split_offsets[obs];
+        }
+
+      // the expansions are computed in double precision and then narrowed if
+      // they are stored as floats
+      if(as_float)
+        cached_expansions_float.emplace_back(n_cache, n_basis_cols);
+      else
+        cached_expansions.emplace_back(n_cache, n_basis_cols);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+      {
+        std::vector<double> wk_mem(n_wk_mem), obs_mem;
 
-        // store the event time as the first column
-        if(info_objs[obs].event)
-          cache_mem = haz_type.cache_expansion_at
-            (info_objs[obs].ub, cache_mem, wk_mem.data(),
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+        for(size_t obs = 0; obs < info_objs.size(); ++obs){
+          if(first_obs[obs] != obs)
+            continue;
+          size_t const n_obs_mem
+            {n_cache * (info_type[obs].rule.n_nodes + info_objs[obs].event)};
+          if(as_float)
+            obs_mem.resize(n_obs_mem);
+          double * const cache_mem_start
+            {as_float ? obs_mem.data()
+                      : cached_expansions.back().col(info_type[obs].col)};
+          double * cache_mem{cache_mem_start};
+
+          // store the event time as the first column
+          if(info_objs[obs].event)
+            cache_mem = haz_type.cache_expansion_at
+              (info_objs[obs].ub, cache_mem, wk_mem.data(),
+               fixef_design_varying_mat.col(obs),
+               rng_design_varying_mat.col(obs));
+
+          // use the remaining columns for the terms from the cumulative hazard
+          haz_type.cache_expansions
+            (info_objs[obs].lb, info_objs[obs].ub, cache_mem, wk_mem.data(),
+             info_type[obs].rule,
              fixef_design_varying_mat.col(obs),
              rng_design_varying_mat.col(obs));
 
-        // use the rest of the columns for the terms from the cumulative hazard
-        haz_type.cache_expansions
-          (info_objs[obs].lb, info_objs[obs].ub, cache_mem, wk_mem.data(), nws,
-           fixef_design_varying_mat.col(obs),
-           rng_design_varying_mat.col(obs));
+          if(as_float)
+            std::copy
+              (cache_mem_start, cache_mem_start + n_obs_mem,
+               cached_expansions_float.back().col(info_type[obs].col));
+        }
       }
     }
   }
 
+  /// returns the total number of cached quadrature nodes
+  size_t n_cached_nodes() const {
+    size_t out{};
+    for(auto &info_type : cache_info)
+      for(auto &info : info_type)
+        out += info.rule.n_nodes;
+    return out;
+  }
+
+  /// returns the number of stored columns with cached expansions
+  size_t n_cached_columns() const {
+    size_t out{};
+    for(auto &expansions : cached_expansions)
+      out += expansions.n_cols();
+    for(auto &expansions : cached_expansions_float)
+      out += expansions.n_cols();
+    return out;
+  }
+
+  /**
+   * sets up a lazy cache with the rule nws which is shared by n_threads
+   * threads. The expansions of an observation are computed when they are
+   * first needed and kept in a least recently used cache. The cache is split
+   * into shards with a lock to reduce the contention between the threads.
+   * The arrays in the shards use at most max_bytes bytes in total. The number
+   * of nodes is not selected for each observation and the expansions are
+   * stored as doubles.
+   */
+  void set_lazy_cache
+    (node_weight const &nws, size_t const max_bytes,
+     unsigned const n_threads){
+    size_t const n_shards
+      {n_lazy_shards_per_thread * std::max(n_threads, 1U)},
+                 max_bytes_shard{max_bytes / n_shards};
+    if(has_lazy_cache() && is_cached_rule(nws) &&
+         lazy_shards.size() == n_shards &&
+         lazy_shards[0].cache.max_bytes() == max_bytes_shard)
+      // keep the current cache
+      return;
+
+    clear_cached_expansions();
+    vajoint_uint const n_nodes{nws.n_nodes};
+    cached_weights.assign(nws.ws, nws.ws + n_nodes);
+    cached_nodes.assign(nws.ns, nws.ns + n_nodes);
+    lazy_shards = std::vector<lazy_shard>(n_shards);
+    for(auto &shard : lazy_shards)
+      shard.cache = lru_cache{max_bytes_shard};
+  }
+
+  /**
+   * returns the number of hits, the number of misses, and the number of bytes
+   * used by the lazy caches
+   */
+  std::array<size_t, 3> lazy_cache_stats() const {
+    std::array<size_t, 3> out{};
+    for(auto &shard : lazy_shards){
+      out[0] += shard.cache.n_hits();
+      out[1] += shard.cache.n_misses();
+      out[2] += shard.cache.bytes();
+    }
+    return out;
+  }
+
   /// clears the cached expansions
   void clear_cached_expansions(){
+    // the shards cannot be moved so shrink_to_fit cannot be used
+    lazy_shards = std::vector<lazy_shard>();
+
     cached_expansions.clear();
     cached_expansions.shrink_to_fit();
+    cached_expansions_float.clear();
+    cached_expansions_float.shrink_to_fit();
 
     cached_nodes.clear();
     cached_nodes.shrink_to_fit();
 
     cached_weights.clear();
     cached_weights.shrink_to_fit();
+
+    reduced_nodes.clear();
+    reduced_weights.clear();
+    cached_split_nodes.clear();
+    cached_split_weights.clear();
+    cache_info.clear();
+    cached_node_selection_tol = 0;
+    cache_as_float = false;
+  }
+
+  /**
+   * sets composite rules for each observation which split [lb, ub] at the
+   * break points (e.g. the knots) of the bases and apply nws to each piece.
+   * These are used in place of the passed quadrature rule afterwards and when
+   * the cached expansions are set. The latter are cleared if the split rules
+   * change. The composite rules are computed when needed and only stored for
+   * the cached expansions. Thus, the required working memory increases.
+   */
+  void set_split_rules(node_weight const &nws){
+    if(has_split_rules()){
+      bool is_same_rule
+        {nws.n_nodes == split_piece_nodes.size() &&
+          nws.n_nodes == split_piece_weights.size()};
+      for(vajoint_uint i = 0; i < nws.n_nodes && is_same_rule; ++i)
+        is_same_rule &= nws.ns[i] == split_piece_nodes[i] &&
+          nws.ws[i] == split_piece_weights[i];
+
+      if(is_same_rule)
+        return;
+    }
+
+    clear_cached_expansions();
+    split_piece_nodes.assign(nws.ns, nws.ns + nws.n_nodes);
+    split_piece_weights.assign(nws.ws, nws.ws + nws.n_nodes);
+
+    // room for the nodes and weights with the most pieces
+    size_t max_breaks{};
+    for(auto const &breaks : break_points_v)
+      max_breaks = std::max(max_breaks, breaks.size());
+    split_wmem = 2 * (max_breaks + 1) * nws.n_nodes;
+  }
+
+  /// clears the split rules and the cached expansions if there are split rules
+  void clear_split_rules(){
+    if(!has_split_rules())
+      return;
+
+    clear_cached_expansions();
+    split_piece_nodes.clear();
+    split_piece_weights.clear();
+    split_wmem = 0;
+  }
+
+  /**
+   * returns the mean number of pieces of the intervals of the observations
+   * when the intervals are split at the break points. One if there are no
+   * observations.
+   */
+  double mean_n_pieces() const {
+    size_t n_pieces{}, n_obs{};
+    for(size_t type = 0; type < obs_info.size(); ++type){
+      auto const &breaks = break_points_v[type];
+      for(auto const &info : obs_info[type]){
+        auto const first =
+          std::upper_bound(breaks.begin(), breaks.end(), info.lb);
+        n_pieces += 1 + std::distance
+          (first, std::lower_bound(first, breaks.end(), info.ub));
+      }
+      n_obs += obs_info[type].size();
+    }
+
+    return n_obs > 0 ? static_cast<double>(n_pieces) / n_obs : 1;
+  }
+
+  /// returns the sorted break points of the bases for a type of outcome
+  std::vector<double> const & break_points(vajoint_uint const type) const {
+    return break_points_v[type];
   }
 
   /// returns the number of lower bound terms of a given type
@@ -515,25 +1618,22 @@ public:
     return n_outcomes_v;
   }
 
-  /// evaluates the lower bound of observation idx for the type of outcome
-  template<class T>
-  T operator()
+private:
+  /**
+   * evaluates the lower bound of observation idx for the type of outcome with
+   * the cached expansions stored as S. cached_expansions_pass is a null
+   * pointer if the expansions are not cached.
+   */
+  template<class T, class S>
+  T eval_obs
     (T const *param, T *wk_mem, const vajoint_uint idx, const vajoint_uint type,
-     double * dwk_mem, node_weight nws) const {
+     double * dwk_mem, node_weight const &nws,
+     S const * cached_expansions_pass) const {
     // get the information for the outcome and event type
     obs_info_obj const &info{obs_info[type][idx]};
     expected_cum_hazzard const &haz{cum_hazs[type]};
     auto const &surv_info{par_idx.surv_info()[type]};
-
-    double const * cached_expansions_pass{nullptr};
-    bool const use_cache{has_cached_expansions()};
-    if(use_cache){
-      nws = { cached_nodes.data(), cached_weights.data(),
-              static_cast<vajoint_uint>(cached_nodes.size()) };
-
-      cached_expansions_pass = cached_expansions[type].col
-        ((nws.n_nodes + 1) * idx);
-    }
+    bool const use_cache{cached_expansions_pass != nullptr};
 
     // compute the approximate expected log hazard if needed
     T out{0};
@@ -552,17 +1652,18 @@ public:
 
       if(use_cache){
         out -= cfaad::dotProd
-          (cached_expansions_pass, cached_expansions_pass + haz.b_n_basis(),
-           param + surv_info.idx_varying);
+          (param + surv_info.idx_varying,
+           param + surv_info.idx_varying + haz.b_n_basis(),
+           cached_expansions_pass);
         cached_expansions_pass += haz.b_n_basis();
 
         vajoint_uint offset{}, idx_association{surv_info.idx_association};
         for(size_t i = 0; i < bases_rng.size(); ++i){
           for(size_t j = 0; j  < haz.ders()[i].size(); ++j){
             auto M_VA_mean = cfaad::dotProd
-              (cached_expansions_pass,
-               cached_expansions_pass + haz.rng_n_basis(i),
-               param + par_idx.va_mean() + offset);
+              (param + par_idx.va_mean() + offset,
+               param + par_idx.va_mean() + offset + haz.rng_n_basis(i),
+               cached_expansions_pass);
             cached_expansions_pass += haz.rng_n_basis(i);
             out -= param[idx_association++] * M_VA_mean;
           }
@@ -648,12 +1749,389 @@ public:
     return out;
   }
 
+  /// the same as eval_obs but for grad
+  template<class S>
+  double grad_obs
+    (double const *param, double *gr, double *wk_mem, const vajoint_uint idx,
+     const vajoint_uint type, node_weight const &nws,
+     S const * cached_expansions_pass) const {
+    // get the information for the outcome and event type
+    obs_info_obj const &info{obs_info[type][idx]};
+    expected_cum_hazzard const &haz{cum_hazs[type]};
+    auto const &surv_info{par_idx.surv_info()[type]};
+    bool const use_cache{cached_expansions_pass != nullptr};
+
+    double const * const design{design_mats[type].col(idx)},
+                 * const fixef_design_varying
+                  {fixef_design_varying_mats[type].col(idx)},
+                 * const rng_design_varying
+                 {rng_design_varying_mats[type].col(idx)};
+    vajoint_uint const n_shared{par_idx.n_shared()},
+                    n_shared_p1{n_shared + 1},
+                    va_mean_idx{par_idx.va_mean()},
+                    frailty_idx
+                      {va_mean_idx + n_shared + par_idx.frailty_offset(type)};
+
+    // compute the approximate expected log hazard if needed
+    double out{0};
+    if(info.event){
+      out -= cfaad::dotProd(design, design + surv_info.n_fix,
+                            param + surv_info.idx_fix);
+      for(vajoint_uint i = 0; i < surv_info.n_fix; ++i)
+        gr[surv_info.idx_fix + i] -= design[i];
+
+      // the pointer is either to the cached expansions or to wk_mem
+      double const *basis{wk_mem};
+      if(!use_cache)
+        haz.cache_expansion_at
+          (info.ub, wk_mem, wk_mem + haz.cache_mem_per_node(),
+           fixef_design_varying, rng_design_varying);
+      else {
+        if constexpr (std::is_same<S, double>::value)
+          basis = cached_expansions_pass;
+        else
+          std::copy(cached_expansions_pass,
+                    cached_expansions_pass + haz.cache_mem_per_node(), wk_mem);
+        cached_expansions_pass += haz.cache_mem_per_node();
+      }
+
+      out -= cfaad::dotProd
+        (basis, basis + haz.b_n_basis(), param + surv_info.idx_varying);
+      for(vajoint_uint i = 0; i < haz.b_n_basis(); ++i)
+        gr[surv_info.idx_varying + i] -= basis[i];
+      basis += haz.b_n_basis();
+
+      vajoint_uint offset{}, idx_association{surv_info.idx_association};
+      for(size_t i = 0; i < bases_rng.size(); ++i){
+        for(size_t j = 0; j  < haz.ders()[i].size(); ++j){
+          double const M_VA_mean = cfaad::dotProd
+            (basis, basis + haz.rng_n_basis(i),
+             param + va_mean_idx + offset);
+          double const association{param[idx_association]};
+          out -= association * M_VA_mean;
+
+          gr[idx_association++] -= M_VA_mean;
+          for(vajoint_uint k = 0; k < haz.rng_n_basis(i); ++k)
+            gr[va_mean_idx + offset + k] -= association * basis[k];
+          basis += haz.rng_n_basis(i);
+        }
+
+        offset += haz.rng_n_basis(i);
+      }
+
+      // the frailty term
+      if(haz.with_frailty()){
+        out -= param[frailty_idx];
+        gr[frailty_idx] -= 1;
+      }
+    }
+
+    // add the term from the approximate expected cumulative hazard
+    double * const VA_mean{wk_mem};
+    wk_mem += n_shared_p1;
+    double * const VA_vcov{wk_mem};
+    wk_mem += n_shared_p1 * n_shared_p1;
+    double * const d_VA_mean{wk_mem};
+    wk_mem += n_shared_p1;
+    double * const d_VA_vcov{wk_mem};
+    wk_mem += n_shared_p1 * n_shared_p1;
+
+    std::fill(d_VA_mean, wk_mem, 0);
+
+    std::copy(param + va_mean_idx, param + va_mean_idx + n_shared, VA_mean);
+    if(haz.with_frailty())
+      VA_mean[n_shared] = param[frailty_idx];
+
+    // the VA_vcov is either n_shared_p1 x n_shared_p1 or n_shared x n_shared
+    vajoint_uint const rng_dim{n_shared + par_idx.n_shared_surv()},
+                     frailty_offset{n_shared + par_idx.frailty_offset(type)},
+                     n_vcov
+                       {haz.with_frailty() ? n_shared_p1 : n_shared};
+    // maps from the index in VA_vcov to the index in the full covariance
+    // matrix
+    auto vcov_full_idx = [&](vajoint_uint const i){
+      return i < n_shared ? i : frailty_offset;
+    };
+
+    double const * const vcov_full{param + par_idx.va_vcov()};
+    for(vajoint_uint j = 0; j < n_vcov; ++j)
+      for(vajoint_uint i = 0; i < n_vcov; ++i)
+        VA_vcov[i + j * n_vcov] =
+          vcov_full[vcov_full_idx(i) + vcov_full_idx(j) * rng_dim];
+
+    out += haz.grad
+      (nws, info.lb, info.ub, design, fixef_design_varying, rng_design_varying,
+       param + surv_info.idx_fix, param + surv_info.idx_varying,
+       param + surv_info.idx_association, VA_mean, VA_vcov,
+       gr + surv_info.idx_fix, gr + surv_info.idx_varying,
+       gr + surv_info.idx_association, d_VA_mean, d_VA_vcov, wk_mem,
+       cached_expansions_pass);
+
+    // add the derivatives w.r.t. the VA parameters
+    for(vajoint_uint i = 0; i < n_shared; ++i)
+      gr[va_mean_idx + i] += d_VA_mean[i];
+    if(haz.with_frailty())
+      gr[frailty_idx] += d_VA_mean[n_shared];
+
+    double * const d_vcov_full{gr + par_idx.va_vcov()};
+    for(vajoint_uint j = 0; j < n_vcov; ++j)
+      for(vajoint_uint i = 0; i < n_vcov; ++i)
+        d_vcov_full[vcov_full_idx(i) + vcov_full_idx(j) * rng_dim] +=
+          d_VA_vcov[i + j * n_vcov];
+
+    return out;
+  }
+
+  /// the same as grad_obs but for hess_vec
+  template<class S>
+  void hess_vec_obs
+    (double const *param, double const *dir, double *res, double *wk_mem,
+     const vajoint_uint idx, const vajoint_uint type, node_weight const &nws,
+     S const * cached_expansions_pass) const {
+    // get the information for the outcome and event type
+    obs_info_obj const &info{obs_info[type][idx]};
+    expected_cum_hazzard const &haz{cum_hazs[type]};
+    auto const &surv_info{par_idx.surv_info()[type]};
+    bool const use_cache{cached_expansions_pass != nullptr};
+
+    double const * const design{design_mats[type].col(idx)},
+                 * const fixef_design_varying
+                  {fixef_design_varying_mats[type].col(idx)},
+                 * const rng_design_varying
+                 {rng_design_varying_mats[type].col(idx)};
+    vajoint_uint const n_shared{par_idx.n_shared()},
+                    n_shared_p1{n_shared + 1},
+                    va_mean_idx{par_idx.va_mean()},
+                    frailty_idx
+                      {va_mean_idx + n_shared + par_idx.frailty_offset(type)};
+
+    // the expected log hazard is only non-linear in the association
+    // parameters and the VA mean
+    if(info.event){
+      // the pointer is either to the cached expansions or to wk_mem
+      double const *basis{wk_mem};
+      if(!use_cache)
+        haz.cache_expansion_at
+          (info.ub, wk_mem, wk_mem + haz.cache_mem_per_node(),
+           fixef_design_varying, rng_design_varying);
+      else {
+        if constexpr (std::is_same<S, double>::value)
+          basis = cached_expansions_pass;
+        else
+          std::copy(cached_expansions_pass,
+                    cached_expansions_pass + haz.cache_mem_per_node(), wk_mem);
+        cached_expansions_pass += haz.cache_mem_per_node();
+      }
+      basis += haz.b_n_basis();
+
+      vajoint_uint offset{}, idx_association{surv_info.idx_association};
+      for(size_t i = 0; i < bases_rng.size(); ++i){
+        for(size_t j = 0; j  < haz.ders()[i].size(); ++j){
+          res[idx_association] -= cfaad::dotProd
+            (basis, basis + haz.rng_n_basis(i), dir + va_mean_idx + offset);
+
+          double const dir_association{dir[idx_association++]};
+          for(vajoint_uint k = 0; k < haz.rng_n_basis(i); ++k)
+            res[va_mean_idx + offset + k] -= dir_association * basis[k];
+          basis += haz.rng_n_basis(i);
+        }
+
+        offset += haz.rng_n_basis(i);
+      }
+    }
+
+    // add the term from the approximate expected cumulative hazard
+    vajoint_uint const n_vcov_mem{n_shared_p1 * n_shared_p1};
+    double * const VA_mean{wk_mem},
+           * const VA_vcov{VA_mean + n_shared_p1},
+           * const dir_VA_mean{VA_vcov + n_vcov_mem},
+           * const dir_VA_vcov{dir_VA_mean + n_shared_p1},
+           * const d_VA_mean{dir_VA_vcov + n_vcov_mem},
+           * const d_VA_vcov{d_VA_mean + n_shared_p1};
+    wk_mem = d_VA_vcov + n_vcov_mem;
+
+    std::fill(d_VA_mean, wk_mem, 0);
+
+    std::copy(param + va_mean_idx, param + va_mean_idx + n_shared, VA_mean);
+    std::copy(dir + va_mean_idx, dir + va_mean_idx + n_shared, dir_VA_mean);
+    if(haz.with_frailty()){
+      VA_mean[n_shared] = param[frailty_idx];
+      dir_VA_mean[n_shared] = dir[frailty_idx];
+    }
+
+    // the VA_vcov is either n_shared_p1 x n_shared_p1 or n_shared x n_shared
+    vajoint_uint const rng_dim{n_shared + par_idx.n_shared_surv()},
+                     frailty_offset{n_shared + par_idx.frailty_offset(type)},
+                     n_vcov
+                       {haz.with_frailty() ? n_shared_p1 : n_shared};
+    // maps from the index in VA_vcov to the index in the full covariance
+    // matrix
+    auto vcov_full_idx = [&](vajoint_uint const i){
+      return i < n_shared ? i : frailty_offset;
+    };
+
+    double const * const vcov_full{param + par_idx.va_vcov()},
+                 * const dir_vcov_full{dir + par_idx.va_vcov()};
+    for(vajoint_uint j = 0; j < n_vcov; ++j)
+      for(vajoint_uint i = 0; i < n_vcov; ++i){
+        vajoint_uint const idx_full
+          {vcov_full_idx(i) + vcov_full_idx(j) * rng_dim};
+        VA_vcov[i + j * n_vcov] = vcov_full[idx_full];
+        dir_VA_vcov[i + j * n_vcov] = dir_vcov_full[idx_full];
+      }
+
+    haz.hess_vec
+      (nws, info.lb, info.ub, design, fixef_design_varying, rng_design_varying,
+       param + surv_info.idx_fix, param + surv_info.idx_varying,
+       param + surv_info.idx_association, VA_mean, VA_vcov,
+       dir + surv_info.idx_fix, dir + surv_info.idx_varying,
+       dir + surv_info.idx_association, dir_VA_mean, dir_VA_vcov,
+       res + surv_info.idx_fix, res + surv_info.idx_varying,
+       res + surv_info.idx_association, d_VA_mean, d_VA_vcov, wk_mem,
+       cached_expansions_pass);
+
+    // add the derivatives w.r.t. the VA parameters
+    for(vajoint_uint i = 0; i < n_shared; ++i)
+      res[va_mean_idx + i] += d_VA_mean[i];
+    if(haz.with_frailty())
+      res[frailty_idx] += d_VA_mean[n_shared];
+
+    double * const d_vcov_full{res + par_idx.va_vcov()};
+    for(vajoint_uint j = 0; j < n_vcov; ++j)
+      for(vajoint_uint i = 0; i < n_vcov; ++i)
+        d_vcov_full[vcov_full_idx(i) + vcov_full_idx(j) * rng_dim] +=
+          d_VA_vcov[i + j * n_vcov];
+  }
+
+public:
+  /// evaluates the lower bound of observation idx for the type of outcome
+  template<class T>
+  T operator()
+    (T const *param, T *wk_mem, const vajoint_uint idx, const vajoint_uint type,
+     double * dwk_mem, node_weight const &nws) const {
+    double * const split_mem{dwk_mem + wmem_w[1]};
+    if(has_lazy_cache()){
+      node_weight const rule
+        {obs_rule(type, idx, {cached_nodes.data(), cached_weights.data(),
+                              static_cast<vajoint_uint>(cached_nodes.size())},
+                  split_mem)};
+      lazy_shard &shard = get_lazy_shard(idx, type);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      return eval_obs
+        (param, wk_mem, idx, type, dwk_mem, rule,
+         lazy_expansions(idx, type, rule, dwk_mem, shard.cache));
+    }
+    if(!has_cached_expansions())
+      return eval_obs
+        (param, wk_mem, idx, type, dwk_mem,
+         obs_rule(type, idx, nws, split_mem),
+         static_cast<double const*>(nullptr));
+
+    cache_info_obj const &c_info{cache_info[type][idx]};
+    if(cache_as_float)
+      return eval_obs
+        (param, wk_mem, idx, type, dwk_mem, c_info.rule,
+         cached_expansions_float[type].col(c_info.col));
+    return eval_obs
+      (param, wk_mem, idx, type, dwk_mem, c_info.rule,
+       cached_expansions[type].col(c_info.col));
+  }
+
+  /**
+   * evaluates the lower bound of observation idx for the type of outcome and
+   * adds the gradient to gr (i.e. the pointer is not overwritten). This is the
+   * same as calling operator() with T = cfaad::Number but the gradient is
+   * computed analytically. The required working memory is given by
+   * n_wmem_grad().
+   */
+  double grad
+    (double const *param, double *gr, double *wk_mem, const vajoint_uint idx,
+     const vajoint_uint type, node_weight const &nws) const {
+    double * const split_mem{wk_mem + wmem_grad};
+    if(has_lazy_cache()){
+      node_weight const rule
+        {obs_rule(type, idx, {cached_nodes.data(), cached_weights.data(),
+                              static_cast<vajoint_uint>(cached_nodes.size())},
+                  split_mem)};
+      lazy_shard &shard = get_lazy_shard(idx, type);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      return grad_obs
+        (param, gr, wk_mem, idx, type, rule,
+         lazy_expansions(idx, type, rule, wk_mem, shard.cache));
+    }
+    if(!has_cached_expansions())
+      return grad_obs
+        (param, gr, wk_mem, idx, type, obs_rule(type, idx, nws, split_mem),
+         static_cast<double const*>(nullptr));
+
+    cache_info_obj const &c_info{cache_info[type][idx]};
+    if(cache_as_float)
+      return grad_obs
+        (param, gr, wk_mem, idx, type, c_info.rule,
+         cached_expansions_float[type].col(c_info.col));
+    return grad_obs
+      (param, gr, wk_mem, idx, type, c_info.rule,
+       cached_expansions[type].col(c_info.col));
+  }
+
+  /**
+   * adds the directional derivative in the direction dir of what grad adds
+   * to the gradient to res. That is, the Hessian times dir. The direction of
+   * the VA covariance matrix has to be symmetric. The required working
+   * memory is given by n_wmem_hess().
+   */
+  void hess_vec
+    (double const *param, double const *dir, double *res, double *wk_mem,
+     const vajoint_uint idx, const vajoint_uint type,
+     node_weight const &nws) const {
+    double * const split_mem{wk_mem + wmem_hess};
+    if(has_lazy_cache()){
+      node_weight const rule
+        {obs_rule(type, idx, {cached_nodes.data(), cached_weights.data(),
+                              static_cast<vajoint_uint>(cached_nodes.size())},
+                  split_mem)};
+      lazy_shard &shard = get_lazy_shard(idx, type);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      hess_vec_obs
+        (param, dir, res, wk_mem, idx, type, rule,
+         lazy_expansions(idx, type, rule, wk_mem, shard.cache));
+      return;
+    }
+    if(!has_cached_expansions()){
+      hess_vec_obs
+        (param, dir, res, wk_mem, idx, type,
+         obs_rule(type, idx, nws, split_mem),
+         static_cast<double const*>(nullptr));
+      return;
+    }
+
+    cache_info_obj const &c_info{cache_info[type][idx]};
+    if(cache_as_float)
+      hess_vec_obs
+        (param, dir, res, wk_mem, idx, type, c_info.rule,
+         cached_expansions_float[type].col(c_info.col));
+    else
+      hess_vec_obs
+        (param, dir, res, wk_mem, idx, type, c_info.rule,
+         cached_expansions[type].col(c_info.col));
+  }
+
   /**
    * returns the needed working memory of eval. The first elements is the
    * required T memory and the second element is the required double memory.
    */
-  std::array<size_t, 2> const & n_wmem() const {
-    return wmem_w;
+  std::array<size_t, 2> n_wmem() const {
+    return {wmem_w[0], wmem_w[1] + split_wmem};
+  }
+
+  /// returns the needed double working memory of grad
+  size_t n_wmem_grad() const {
+    return wmem_grad + split_wmem;
+  }
+
+  /// returns the needed double working memory of hess_vec
+  size_t n_wmem_hess() const {
+    return wmem_hess + split_wmem;
   }
 };
 
@@ -0,0 +1,166 @@
+#include "testthat-wrapper.h"
+#include "cfaad/AAD.h"
+#include <vector>
+
+using cfaad::Number;
+
+namespace {
+/// records the sum of exp(x[i] * x[i + 1]) and returns the gradient
+std::vector<double> record_n_grad(std::vector<double> const &x){
+  std::vector<Number> x_num(x.begin(), x.end());
+  Number out{0};
+  for(size_t i = 0; i + 1 < x.size(); ++i)
+    out += exp(x_num[i] * x_num[i + 1]);
+  out.propagateToStart();
+
+  std::vector<double> gr;
+  for(auto &xi : x_num)
+    gr.emplace_back(xi.adjoint());
+  return gr;
+}
+} // namespace
+
+context("the AD tape works as expected") {
+  test_that("the memory is kept in arena mode and the peak is reported") {
+    cfaad::Tape &tape = *Number::tape;
+    tape.clear();
+    tape.setArena(true);
+    tape.resetPeakBytes();
+
+    std::vector<double> x(20000);
+    for(size_t i = 0; i < x.size(); ++i)
+      x[i] = .001 * static_cast<double>(i % 100);
+
+    auto const gr = record_n_grad(x);
+    size_t const used{tape.usedBytes()},
+            allocated{tape.allocatedBytes()};
+    expect_true(used > 0);
+    expect_true(allocated >= used);
+
+    // the memory is kept when the tape is cleared
+    tape.clear();
+    expect_true(tape.usedBytes() < used);
+    expect_true(tape.allocatedBytes() == allocated);
+    expect_true(tape.peakBytes() == used);
+
+    // the same is recorded again without allocating more memory
+    auto const gr_again = record_n_grad(x);
+    expect_true(tape.allocatedBytes() == allocated);
+    expect_true(gr_again == gr);
+    tape.clear();
+
+    // a smaller recording does not change the peak
+    std::vector<double> const x_small(x.begin(), x.begin() + 10);
+    record_n_grad(x_small);
+    tape.clear();
+    expect_true(tape.peakBytes() == used);
+
+    // the memory is freed when the arena mode is turned off
+    tape.setArena(false);
+    expect_true(tape.allocatedBytes() < allocated);
+    tape.resetPeakBytes();
+    expect_true(tape.peakBytes() == tape.usedBytes());
+  }
+
+  test_that("the fused exponential of a quadratic form gives the same as the elementary operations") {
+    constexpr size_t n{3};
+    double const y_val[]{.15, -.95, 2.05},
+                 V_val[]{2, .5, -.3, .5, 1, .2, -.3, .2, .8},
+                 m_val[]{.1, -.4, .3},
+                 f_val{.2},
+                 w{1.3};
+
+    cfaad::Tape &tape = *Number::tape;
+    // records either the fused or the elementary operations and returns the
+    // value, the gradient, and the used memory
+    auto run = [&](bool const fused){
+      tape.rewind();
+      size_t const used_start{tape.usedBytes()};
+
+      Number f{f_val}, y[n], V[n * n], m[n];
+      for(size_t i = 0; i < n; ++i){
+        y[i] = y_val[i];
+        m[i] = m_val[i];
+      }
+      for(size_t i = 0; i < n * n; ++i)
+        V[i] = V_val[i];
+
+      Number res;
+      if(fused)
+        res = cfaad::expQuadMean(w, f, V, y, y + n, m);
+      else
+        res = w * exp(cfaad::quadFormSym(V, y, y + n) / 2 +
+          cfaad::dotProd(y, y + n, m) + f);
+      res.propagateToStart();
+
+      std::vector<double> out{res.value(), f.adjoint()};
+      for(size_t i = 0; i < n; ++i){
+        out.emplace_back(y[i].adjoint());
+        out.emplace_back(m[i].adjoint());
+      }
+      for(size_t i = 0; i < n * n; ++i)
+        out.emplace_back(V[i].adjoint());
+      out.emplace_back(tape.usedBytes() - used_start);
+      return out;
+    };
+
+    auto const res_fused = run(true),
+               res_elementary = run(false);
+    tape.rewind();
+
+    for(size_t i = 0; i + 1 < res_fused.size(); ++i)
+      expect_true
+        (std::abs(res_fused[i] - res_elementary[i]) <=
+          1e-12 * std::abs(res_elementary[i]));
+    expect_true(res_fused.back() < res_elementary.back());
+  }
+
+#if AADMULTIOUT
+  // requires that cfaad is compiled with multiple derivatives
+  test_that("the adjoints of multiple outputs are propagated in one pass") {
+    constexpr size_t n{4}, n_out{3};
+    double const x_val[]{.5, -.25, 1.5, .75};
+
+    cfaad::Tape &tape = *Number::tape;
+    // records the outputs
+    auto record = [&](Number *x, Number *out){
+      for(size_t i = 0; i < n; ++i)
+        x[i] = x_val[i];
+      out[0] = x[0] * exp(x[1]) + x[3];
+      out[1] = cfaad::dotProd(x, x + n, x);
+      out[2] = cfaad::sum(x, x + n) * x[2];
+    };
+
+    // the derivatives from one pass for each output
+    std::vector<double> gr_single;
+    for(size_t j = 0; j < n_out; ++j){
+      tape.rewind();
+      Number x[n], out[n_out];
+      record(x, out);
+      out[j].propagateToStart();
+      for(size_t i = 0; i < n; ++i)
+        gr_single.emplace_back(x[i].adjoint());
+    }
+
+    // the derivatives from one pass
+    std::vector<double> gr_multi;
+    tape.rewind();
+    {
+      auto resetter = cfaad::setNumResultsForAAD(true, n_out);
+      Number x[n], out[n_out];
+      record(x, out);
+      Number::propagateMultiToStart(out, out + n_out);
+      for(size_t j = 0; j < n_out; ++j)
+        for(size_t i = 0; i < n; ++i)
+          gr_multi.emplace_back(x[i].adjoint(j));
+    }
+    tape.rewind();
+
+    expect_true(gr_multi.size() == gr_single.size());
+    for(size_t i = 0; i < gr_single.size(); ++i)
+      expect_true
+        (std::abs(gr_multi[i] - gr_single[i]) <=
+          1e-14 * std::abs(gr_single[i]));
+  }
+#endif
+}
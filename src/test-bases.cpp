@@ -377,6 +377,31 @@ context("test ns") {
                0.0470333122847401 };
     run_test_use_log<joint_bases::ns>(xx_val, yy_val, dx_val, intercept);
   }
+
+  test_that("break_points gives the knots on the original scale") {
+    arma::vec const boundary_knots{1, 3}, interior_knots{1.5, 2.5};
+    std::vector<double> const expected
+      {std::exp(1), std::exp(1.5), std::exp(2.5), std::exp(3)};
+
+    auto check = [&](joint_bases::basisMixin const &basis){
+      std::vector<double> res;
+      basis.break_points(res);
+      joint_bases::sort_unique_break_points(res);
+      expect_true(res.size() == expected.size());
+      for(size_t i = 0; i < std::min(res.size(), expected.size()); ++i)
+        expect_true(pass_rel_err(res[i], expected[i], 1e-12));
+    };
+
+    check(joint_bases::ns(boundary_knots, interior_knots, true, 4, true));
+    check(joint_bases::bs(boundary_knots, interior_knots, true, 4, true));
+
+    // the polynomial has no break points
+    joint_bases::bases_vector bases;
+    bases.emplace_back(new joint_bases::orth_poly(2, true));
+    bases.emplace_back(new joint_bases::bs
+                         (boundary_knots, interior_knots, false, 4, true));
+    check(joint_bases::stacked_basis(bases));
+  }
 }
 
 context("test iSpline") {
@@ -1,6 +1,7 @@
 #include <testthat.h>
 #include "ghq-delayed-entry.h"
 #include <vector>
+#include <memory>
 
 /* The tests are run using this package
  *
@@ -52,7 +53,79 @@ constexpr size_t n_gl{30};
 constexpr double gl_nodes[]{0.998446742037325, 0.991834061639874, 0.980010932484154, 0.963100023714637, 0.941280267896026, 0.914782881191384, 0.883888716052413, 0.848925247396658, 0.810263091494621, 0.76831207407101, 0.723516884769045, 0.676352362765439, 0.627318463083945, 0.576934956804292, 0.525735921277659, 0.474264078722341, 0.423065043195708, 0.372681536916055, 0.323647637234561, 0.276483115230955, 0.23168792592899, 0.189736908505379, 0.151074752603342, 0.116111283947587, 0.0852171188086158, 0.0587197321039737, 0.0368999762853629, 0.0199890675158463, 0.00816593836012641, 0.00155325796267525},
               gl_wewights[]{0.0039840962480833, 0.00923323415554548, 0.0143923539416617, 0.0193995962848135, 0.024201336415297, 0.0287465781088095, 0.0329871149410902, 0.0368779873688526, 0.0403779476147101, 0.0434498936005415, 0.0460612611188931, 0.0481843685873221, 0.0497967102933976, 0.0508811948742027, 0.0514263264467794, 0.0514263264467794, 0.0508811948742027, 0.0497967102933976, 0.0481843685873221, 0.0460612611188931, 0.0434498936005415, 0.0403779476147101, 0.0368779873688526, 0.0329871149410902, 0.0287465781088095, 0.024201336415297, 0.0193995962848135, 0.0143923539416617, 0.00923323415554548, 0.0039840962480833};
 
-}
+
+/**
+ * a delayed entry term with spline bases whose entry times have a different
+ * number of knots before them. The intervals are split at the knots and the
+ * reference value and gradient are computed with many nodes.
+ */
+struct split_knots_dat {
+  ghqCpp::ghq_data const ghq_dat{ghq_nodes, ghq_weights, n_ghq};
+  ghqCpp::simple_mem_stack<double> mem;
+
+  arma::vec const bk{0, 3};
+  joint_bases::bases_vector bases_fix, bases_rng;
+  subset_params params;
+  std::vector<double> x;
+
+  double dsgn[2]{1, 1};
+  std::vector<simple_mat<double> > design_mats{{dsgn, 1, 2}},
+                          fixef_design_varying{{nullptr, 0, 2}},
+                          rng_design_varying{{nullptr, 0, 2}};
+  std::vector<std::vector<std::vector<int> > > ders{{{0}}};
+  std::vector<delayed_dat::cluster_info> info{{{0, 0, 2.4}, {0, 1, .8}}};
+  std::unique_ptr<survival::delayed_dat> cmp_dat;
+
+  survival::node_weight const gl_dat
+    {gl_nodes, gl_wewights, static_cast<vajoint_uint>(n_gl)};
+  std::vector<double> ns = std::vector<double>(6),
+                      ws = std::vector<double>(6);
+  survival::node_weight gl_few{};
+
+  // the reference values and the values with few nodes
+  double ref, res;
+  std::vector<double> gr_ref, gr_few;
+
+  split_knots_dat(){
+    bases_fix.emplace_back(new joint_bases::bs(bk, {.5, 1.2, 2}, false));
+    bases_rng.emplace_back(new joint_bases::bs(bk, {1, 1.7}, true));
+
+    params.add_marker({1L, 1L, bases_rng[0]->n_basis()});
+    params.add_surv({1L, bases_fix[0]->n_basis(), {1}, false});
+
+    x.resize(params.n_params());
+    for(size_t i = 0; i < x.size(); ++i)
+      x[i] = .25 * std::sin(static_cast<double>(i + 1));
+    {
+      vajoint_uint const dim{params.n_shared()};
+      double * const vcov{x.data() + params.vcov_vary()};
+      for(vajoint_uint j = 0; j < dim; ++j)
+        for(vajoint_uint i = 0; i < dim; ++i)
+          vcov[i + j * dim] = i == j ? .1 : 0;
+    }
+
+    cmp_dat.reset(new survival::delayed_dat
+      {bases_fix, bases_rng, design_mats, fixef_design_varying,
+       rng_design_varying, params, info, ders});
+
+    survival::gauss_legendre_rule(6, ns.data(), ws.data());
+    gl_few = {ns.data(), ws.data(), 6};
+
+    cmp_dat->set_split_at_knots(true);
+    ref = eval(gl_dat, gr_ref);
+    res = eval(gl_few, gr_few);
+  }
+
+  split_knots_dat(split_knots_dat const&) = delete;
+
+  double eval(survival::node_weight const &nws, std::vector<double> &gr){
+    gr.assign(params.n_params(), 0);
+    mem.reset();
+    return cmp_dat->grad(x.data(), gr.data(), mem, 0, nws, ghq_dat);
+  }
+};
+
+} // namespace
 
 context("delayed_dat functions") {
   test_that("works with two survival outcomes of the same type with fraitly") {
@@ -947,4 +1020,171 @@ context("delayed_dat functions") {
              < std::abs(d_vcov_surv[i]) * 1e-3);
     }
   }
+
+  test_that("splitting at the knots gives the same with fewer nodes") {
+    split_knots_dat dat;
+    survival::delayed_dat &cmp_dat = *dat.cmp_dat;
+    auto &gl_few = dat.gl_few;
+    auto &mem = dat.mem;
+    double const ref{dat.ref}, res{dat.res};
+    std::vector<double> gr;
+
+    expect_true(std::abs(res - ref) < std::abs(ref) * 1e-8);
+    for(size_t i = 0; i < dat.gr_few.size(); ++i)
+      expect_true
+        (std::abs(dat.gr_few[i] - dat.gr_ref[i]) <=
+           std::abs(dat.gr_ref[i]) * 1e-6);
+
+    // the same with caching
+    cmp_dat.set_cached_expansions(gl_few, mem);
+    expect_true(std::abs(dat.eval(gl_few, gr) - res) < std::abs(res) * 1e-12);
+    mem.reset();
+    expect_true
+      (std::abs(cmp_dat(dat.x.data(), mem, 0, gl_few, dat.ghq_dat) - res)
+         < std::abs(res) * 1e-12);
+
+    // roughly the same when the expansions are stored as floats
+    cmp_dat.set_cached_expansions(gl_few, mem, true);
+    expect_true(std::abs(dat.eval(gl_few, gr) - res) < std::abs(res) * 1e-6);
+    mem.reset();
+    expect_true
+      (std::abs(cmp_dat(dat.x.data(), mem, 0, gl_few, dat.ghq_dat) - res)
+         < std::abs(res) * 1e-6);
+    cmp_dat.clear_cached_expansions();
+
+    // the same when the expansions are cached with multiple threads
+    cmp_dat.set_cached_expansions(gl_few, mem, false, 3);
+    expect_true(std::abs(dat.eval(gl_few, gr) - res) < std::abs(res) * 1e-12);
+    cmp_dat.clear_cached_expansions();
+
+    // the error is larger without splitting
+    cmp_dat.set_split_at_knots(false);
+    expect_true
+      (std::abs(dat.eval(gl_few, gr) - ref) > 10 * std::abs(res - ref));
+  }
+
+  test_that("splitting the quadrature nodes between threads gives the same") {
+    split_knots_dat dat;
+    std::vector<double> gr;
+
+    dat.cmp_dat->set_nested_threads(3, 1);
+    expect_true
+      (std::abs(dat.eval(dat.gl_few, gr) - dat.res) < std::abs(dat.res) * 1e-8);
+    for(size_t i = 0; i < gr.size(); ++i)
+      expect_true
+        (std::abs(gr[i] - dat.gr_ref[i]) <= std::abs(dat.gr_ref[i]) * 1e-6);
+  }
+
+  test_that("integrating a batch of clusters gives the same") {
+    split_knots_dat dat;
+    std::vector<delayed_dat::cluster_info> infos
+      {{{0, 0, 2.4}, {0, 1, .8}}, {{0, 1, 1.1}}, {{0, 0, .3}, {0, 1, 2.9}}};
+    survival::delayed_dat cmp_dat
+      {dat.bases_fix, dat.bases_rng, dat.design_mats, dat.fixef_design_varying,
+       dat.rng_design_varying, dat.params, infos, dat.ders};
+    cmp_dat.set_split_at_knots(true);
+
+    // one of the clusters is in the batch twice
+    std::vector<vajoint_uint> const indices{0, 1, 2, 1};
+    size_t const n_par{dat.params.n_params()};
+    auto check = [&]{
+      std::vector<double> res_ref(indices.size()),
+                          gr_ref(indices.size() * n_par, 0);
+      for(size_t i = 0; i < indices.size(); ++i){
+        dat.mem.reset();
+        res_ref[i] = cmp_dat.grad
+          (dat.x.data(), gr_ref.data() + i * n_par, dat.mem, indices[i],
+           dat.gl_few, dat.ghq_dat);
+      }
+
+      std::vector<double> res(indices.size()), gr(indices.size() * n_par, 0);
+      std::vector<double*> grs;
+      for(size_t i = 0; i < indices.size(); ++i)
+        grs.emplace_back(gr.data() + i * n_par);
+      dat.mem.reset();
+      cmp_dat.eval_batch
+        (dat.x.data(), grs.data(), res.data(), dat.mem, indices.data(),
+         indices.size(), dat.gl_few, dat.ghq_dat);
+      for(size_t i = 0; i < indices.size(); ++i)
+        expect_true
+          (std::abs(res[i] - res_ref[i]) < std::abs(res_ref[i]) * 1e-10);
+      for(size_t i = 0; i < gr.size(); ++i)
+        expect_true
+          (std::abs(gr[i] - gr_ref[i]) <= std::abs(gr_ref[i]) * 1e-10);
+
+      // the same without the gradient
+      dat.mem.reset();
+      cmp_dat.eval_batch
+        (dat.x.data(), nullptr, res.data(), dat.mem, indices.data(),
+         indices.size(), dat.gl_few, dat.ghq_dat);
+      for(size_t i = 0; i < indices.size(); ++i)
+        expect_true
+          (std::abs(res[i] - res_ref[i]) < std::abs(res_ref[i]) * 1e-10);
+    };
+
+    check();
+
+    // the same with caching
+    cmp_dat.set_cached_expansions(dat.gl_few, dat.mem);
+    check();
+    cmp_dat.clear_cached_expansions();
+
+    // the same when the clusters are integrated one at a time
+    cmp_dat.set_nested_threads(2, 2);
+    check();
+  }
+
+  test_that("warm starts give the same") {
+    split_knots_dat dat;
+    survival::delayed_dat &cmp_dat = *dat.cmp_dat;
+    std::vector<double> gr;
+
+    cmp_dat.set_warm_start(true);
+    for(int k = 0; k < 2; ++k){
+      expect_true
+        (std::abs(dat.eval(dat.gl_few, gr) - dat.res) <
+           std::abs(dat.res) * 1e-8);
+      for(size_t i = 0; i < gr.size(); ++i)
+        expect_true
+          (std::abs(gr[i] - dat.gr_few[i]) <= std::abs(dat.gr_few[i]) * 1e-6);
+    }
+
+    // the mode is re-used after a small change of the parameters
+    cmp_dat.set_warm_start(true, 1e-3);
+    dat.x[dat.params.fixef_surv(0)] += 1e-5;
+    double const res_no_adapt{dat.eval(dat.gl_few, gr)};
+    cmp_dat.set_warm_start(false);
+    double const res_adapt{dat.eval(dat.gl_few, gr)};
+    expect_true(res_no_adapt != res_adapt);
+    expect_true
+      (std::abs(res_no_adapt - res_adapt) < std::abs(res_adapt) * 1e-6);
+  }
+
+  test_that("a sparse grid gives roughly the same") {
+    split_knots_dat dat;
+    std::vector<double> gr;
+
+    dat.cmp_dat->set_sparse_grid(5);
+    expect_true
+      (std::abs(dat.eval(dat.gl_few, gr) - dat.res) < std::abs(dat.res) * 1e-5);
+
+    // the product rule is used again when the level is zero
+    dat.cmp_dat->set_sparse_grid(0);
+    expect_true
+      (std::abs(dat.eval(dat.gl_few, gr) - dat.res) < std::abs(dat.res) * 1e-8);
+  }
+
+  test_that("randomized quasi-Monte Carlo gives roughly the same") {
+    split_knots_dat dat;
+    std::vector<double> gr;
+
+    dat.cmp_dat->set_rqmc(1024, 1);
+    expect_true
+      (std::abs(dat.eval(dat.gl_few, gr) - dat.res) < std::abs(dat.res) * 1e-4);
+
+    // the product rule is used with fewer than min_vars random effects
+    dat.cmp_dat->set_rqmc(1024, 100);
+    expect_true
+      (std::abs(dat.eval(dat.gl_few, gr) - dat.res) < std::abs(dat.res) * 1e-8);
+  }
 }
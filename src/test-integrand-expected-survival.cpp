@@ -1,6 +1,9 @@
 #include <testthat.h>
 #include "integrand-expected-survival.h"
+#include "ghq-vec-exp.h"
 #include <iterator>
+#include <limits>
+#include <vector>
 
 using namespace ghqCpp;
 
@@ -26,6 +29,24 @@ arma::mat const V
       return out;
     })()
   };
+
+/// the expectations of 1, x1^2, x1^2 x2^2, x1^4, and x1^3 x2 with 3 variables
+struct poly_problem final : public ghq_problem {
+  size_t n_vars() const { return 3; }
+  size_t n_out() const { return 5; }
+  void eval
+    (double const *points, size_t const n_points,
+     double * __restrict__ outs, simple_mem_stack<double> &mem) const {
+    for(size_t i = 0; i < n_points; ++i){
+      double const x1{points[i]}, x2{points[i + n_points]};
+      outs[i] = 1;
+      outs[i + n_points] = x1 * x1;
+      outs[i + 2 * n_points] = x1 * x1 * x2 * x2;
+      outs[i + 3 * n_points] = x1 * x1 * x1 * x1;
+      outs[i + 4 * n_points] = x1 * x1 * x1 * x2;
+    }
+  }
+};
 } // namespace
 
 /* the test data in R
@@ -37,6 +58,46 @@ arma::mat const V
  */
 
 context("expected_survival_term works as expected") {
+  test_that("vec_exp gives the same as std::exp") {
+    std::vector<double> xs;
+    for(double x = -708; x < 709; x += .371)
+      xs.emplace_back(x);
+    xs.emplace_back(0);
+    xs.emplace_back(-1e-300);
+
+    std::vector<double> res{xs};
+    vec_exp(res.data(), res.size());
+    for(size_t i = 0; i < xs.size(); ++i){
+      double const truth{std::exp(xs[i])};
+      expect_true(std::abs(res[i] - truth) <= 1e-15 * truth);
+    }
+
+    // std::exp is used with values out of the range
+    xs.emplace_back(-720);
+    xs.emplace_back(720);
+    xs.emplace_back(std::numeric_limits<double>::infinity());
+    xs.emplace_back(-std::numeric_limits<double>::infinity());
+    xs.emplace_back(std::numeric_limits<double>::quiet_NaN());
+
+    res = xs;
+    vec_exp(res.data(), res.size());
+    for(size_t i = 0; i < xs.size() - 1; ++i)
+      expect_true(res[i] == std::exp(xs[i]));
+    expect_true(std::isnan(res.back()));
+
+    // the same when the result is stored elsewhere
+    std::vector<double> res_out(xs.size());
+    vec_exp(xs.data(), res_out.data(), xs.size());
+    for(size_t i = 0; i < xs.size() - 1; ++i)
+      expect_true(res_out[i] == res[i]);
+    expect_true(std::isnan(res_out.back()));
+
+    vec_exp(xs.data(), res_out.data(), xs.size() - 7);
+    for(size_t i = 0; i < xs.size() - 7; ++i)
+      expect_true(std::abs(res_out[i] - std::exp(xs[i])) <=
+        1e-15 * std::exp(xs[i]));
+  }
+
   test_that("log_integrand, log_integrand_grad, and log_integrand_x works") {
     /*
      log_integrand <- \(x){
@@ -144,5 +205,125 @@ context("expected_survival_term works as expected") {
     for(size_t i = 0; i < n_grad; ++i)
       expect_true
         (std::abs(res[i + 1] - true_gr[i]) < 1e-4 * std::abs(true_gr[i]));
+
+    // the same when the sweep over the nodes is split between threads
+    std::vector<double> res_threads(res.size());
+    ghq(res_threads.data(), dat, prob_adap, mem, 128, 3);
+    for(size_t i = 0; i < res.size(); ++i)
+      expect_true
+        (std::abs(res_threads[i] - res[i]) <= 1e-12 * std::abs(res[i]));
+
+    // the same when all the nodes are in one block and the points are split
+    ghq(res_threads.data(), dat, prob_adap, mem, 100000, 3);
+    for(size_t i = 0; i < res.size(); ++i)
+      expect_true
+        (std::abs(res_threads[i] - res[i]) <= 1e-12 * std::abs(res[i]));
+  }
+
+  test_that("eval works with more linear predictors than in one chunk") {
+    // repeat the linear predictors such that there are more than two chunks
+    size_t const n_rep{2 * expected_survival_term<false>::n_lps_chunk / n_lps
+                         + 1},
+                 n_lps_large{n_rep * n_lps};
+    arma::vec etas_large(n_lps_large), ws_large(n_lps_large);
+    arma::mat M_large(n_lps_large, n_vars);
+    for(size_t i = 0; i < n_lps_large; ++i){
+      etas_large[i] = etas[i % n_lps];
+      ws_large[i] = ws[i % n_lps] / static_cast<double>(n_rep);
+      for(size_t j = 0; j < n_vars; ++j)
+        M_large(i, j) = M(i % n_lps, j);
+    }
+    expect_true(n_lps_large > 2 * expected_survival_term<false>::n_lps_chunk);
+
+    constexpr size_t n_points{7};
+    double points[n_points * n_vars];
+    for(size_t i = 0; i < n_points * n_vars; ++i)
+      points[i] = -1 + .05 * static_cast<double>(i);
+
+    simple_mem_stack<double> mem;
+    expected_survival_term<false> surv_term(etas, ws, M),
+                            surv_term_large(etas_large, ws_large, M_large);
+    double outs[n_points], outs_large[n_points];
+    surv_term.eval(points, n_points, outs, mem);
+    surv_term_large.eval(points, n_points, outs_large, mem);
+
+    for(size_t i = 0; i < n_points; ++i)
+      expect_true
+        (std::abs(outs_large[i] - outs[i]) < 1e-12 * std::abs(outs[i]));
+  }
+
+  test_that("the sparse grids are exact for polynomials and give accurate results") {
+    {
+      // the Gauss-Hermite rule
+      constexpr double true_nodes[]{-3.32425743355212, -1.88917587775371, -0.616706590192594, 0.616706590192594, 1.88917587775371, 3.32425743355212},
+                     true_weights[]{0.00255578440205624, 0.0886157460419145, 0.408828469556029, 0.408828469556029, 0.0886157460419145, 0.00255578440205624};
+      double nodes[6], weights[6];
+      gauss_hermite_rule(6, nodes, weights);
+      for(size_t i = 0; i < 6; ++i){
+        expect_true(std::abs(nodes[i] - true_nodes[i]) < 1e-8);
+        expect_true
+          (std::abs(weights[i] - true_weights[i]) < 1e-8 * true_weights[i]);
+      }
+    }
+
+    poly_problem poly_prob;
+    simple_mem_stack<double> mem;
+    sparse_grid grid(3, 3);
+    // the origin, 2 + 4 points on each axis, and 4 points in each plane
+    expect_true(grid.n_points() == 31);
+
+    auto res = ghq(grid, poly_prob, mem);
+    expect_true(res.size() == 5);
+    constexpr double truth[]{1, 1, 1, 3, 0};
+    for(size_t i = 0; i < 5; ++i)
+      expect_true(std::abs(res[i] - truth[i]) < 1e-12);
+
+    // the expected survival term
+    constexpr double true_fn{0.232477957568917},
+                      eps_fn{0.000145864854007574};
+    expected_survival_term<false> surv_term(etas, ws, M);
+    rescale_problem<false> prob(V, surv_term);
+    adaptive_problem prob_adap(prob, mem);
+
+    sparse_grid grid_surv(n_vars, 4);
+    res = ghq(grid_surv, prob_adap, mem);
+    expect_true(res.size() == 1);
+    expect_true(std::abs(res[0] - true_fn) < eps_fn);
+  }
+
+  test_that("rqmc gives accurate results with valid error estimates") {
+    simple_mem_stack<double> mem;
+    poly_problem poly_prob;
+    constexpr size_t n_out{5};
+    double res[n_out], std_err[n_out];
+    rqmc(res, std_err, poly_prob, mem, 1024, 8, 1, 100);
+
+    constexpr double truth[]{1, 1, 1, 3, 0};
+    for(size_t i = 0; i < n_out; ++i){
+      expect_true(std::abs(res[i] - truth[i]) <= 4 * std_err[i] + 1e-12);
+      expect_true(std_err[i] < .05);
+    }
+    // the standard error with Monte Carlo is sqrt(2 / 8192) ~ 0.0156
+    expect_true(std_err[1] < .002);
+
+    // the result is deterministic given the seed
+    double res_again[n_out], res_other_seed[n_out];
+    rqmc(res_again, nullptr, poly_prob, mem, 1024, 8, 1);
+    rqmc(res_other_seed, nullptr, poly_prob, mem, 1024, 8, 2);
+    for(size_t i = 0; i < n_out; ++i)
+      expect_true(std::abs(res_again[i] - res[i]) < 1e-12);
+    expect_true(res_other_seed[1] != res[1]);
+
+    // the expected survival term
+    constexpr double true_fn{0.232477957568917},
+                      eps_fn{0.000145864854007574};
+    expected_survival_term<false> surv_term(etas, ws, M);
+    rescale_problem<false> prob(V, surv_term);
+    adaptive_problem prob_adap(prob, mem);
+
+    double res_surv, std_err_surv;
+    rqmc(&res_surv, &std_err_surv, prob_adap, mem, 512, 8);
+    expect_true(std::abs(res_surv - true_fn) < eps_fn);
+    expect_true(std_err_surv < eps_fn);
   }
 }
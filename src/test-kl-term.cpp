@@ -1,6 +1,8 @@
 #include "testthat-wrapper.h"
 #include "kl-term.h"
 #include <memory>
+#include <vector>
+#include <cmath>
 #include "log-cholesky.h"
 
 namespace {
@@ -146,6 +148,53 @@ constexpr double true_kl_term_no_marker{7.47606508560383},
                                        2.19167623243605},
                  zeta_deriv_no_m[] = {0, 0, -1.3800903909731, -0.682457259664746, 0.46533056191001};
 
+/**
+ * checks kl_term::hess_vec against central differences of kl_term::grad in
+ * a direction which is symmetric for the covariance matrices. The term is
+ * setup again with par afterwards.
+ */
+void test_hess_vec(kl_term &term, subset_params const &params,
+                   double const *par, lb_terms const which){
+  vajoint_uint const n_params_w_va = params.n_params_w_va();
+  std::vector<double> dir(n_params_w_va);
+  for(vajoint_uint i = 0; i < n_params_w_va; ++i)
+    dir[i] = std::sin(static_cast<double>(i + 1)) / 4;
+
+  auto symmetrize = [&](vajoint_uint const start, vajoint_uint const dim){
+    for(vajoint_uint j = 0; j < dim; ++j)
+      for(vajoint_uint i = 0; i < j; ++i)
+        dir[start + i + j * dim] = dir[start + j + i * dim];
+  };
+  symmetrize(params.vcov_vary(), params.n_shared());
+  symmetrize(params.vcov_surv(), params.n_shared_surv());
+  symmetrize(params.va_vcov(),
+             params.n_shared() + params.n_shared_surv());
+
+  std::unique_ptr<double[]> mem(new double[term.n_wmem()]),
+                       mem_hess(new double[term.n_wmem_hess()]);
+  term.setup(par, mem.get(), which);
+  std::vector<double> res(n_params_w_va, 0.);
+  term.hess_vec(res.data(), par, dir.data(), mem_hess.get());
+
+  // compute the central difference
+  constexpr double h{1e-5};
+  std::vector<double> par_h(n_params_w_va), gr_p(n_params_w_va, 0.),
+                      gr_m(n_params_w_va, 0.);
+  for(vajoint_uint i = 0; i < n_params_w_va; ++i)
+    par_h[i] = par[i] + h * dir[i];
+  term.setup(par_h.data(), mem.get(), which);
+  term.grad(gr_p.data(), par_h.data(), mem.get());
+
+  for(vajoint_uint i = 0; i < n_params_w_va; ++i)
+    par_h[i] = par[i] - h * dir[i];
+  term.setup(par_h.data(), mem.get(), which);
+  term.grad(gr_m.data(), par_h.data(), mem.get());
+
+  for(vajoint_uint i = 0; i < n_params_w_va; ++i)
+    expect_true(pass_rel_err(res[i], (gr_p[i] - gr_m[i]) / (2 * h), 1e-6));
+
+  term.setup(par, mem.get(), which);
+}
 } // namespace
 
 context("testing kl-terms") {
@@ -246,6 +295,9 @@ context("testing kl-terms") {
     expect_true(
       pass_rel_err(term.eval(par.get(), mem.get()), true_kl_term_no_marker));
 
+    // check the Hessian vector products
+    for(lb_terms which : {lb_terms::all, lb_terms::markers, lb_terms::surv})
+      test_hess_vec(term, params, par.get(), which);
 
     // clean up
     wmem::clear_all();
@@ -350,6 +402,9 @@ context("testing kl-terms") {
     expect_true(
       pass_rel_err(term.eval(par.get(), mem.get()), true_kl_term_no_marker));
 
+    // check the Hessian vector products
+    for(lb_terms which : {lb_terms::all, lb_terms::markers, lb_terms::surv})
+      test_hess_vec(term, params, par.get(), which);
 
     // clean up
     wmem::clear_all();
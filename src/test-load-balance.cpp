@@ -0,0 +1,56 @@
+#include "testthat-wrapper.h"
+#include "load-balance.h"
+
+context("load-balance functions work as expected") {
+  test_that("lpt_order gives a permutation with balanced blocks") {
+    // one expensive task and many cheap tasks
+    std::vector<double> costs(23, 1);
+    costs[0] = 20;
+    costs[5] = 10;
+    costs[6] = 10;
+    costs[20] = 5;
+
+    constexpr size_t n_blocks{4};
+    auto const order = lpt_order(costs, n_blocks);
+    expect_true(order.size() == costs.size());
+
+    std::vector<size_t> sorted{order};
+    std::sort(sorted.begin(), sorted.end());
+    for(size_t i = 0; i < sorted.size(); ++i)
+      expect_true(sorted[i] == i);
+
+    // the blocks have 6, 6, 6, and 5 tasks with a static schedule. The
+    // expensive tasks are in different blocks and the cheap tasks are added
+    // to the blocks with the least work. The first block would have a work of
+    // 34 with the original order
+    std::vector<double> work(n_blocks, 0);
+    size_t idx{};
+    for(size_t b = 0; b < n_blocks; ++b){
+      size_t const n_tasks{costs.size() / n_blocks +
+        (b < costs.size() % n_blocks)};
+      for(size_t i = 0; i < n_tasks; ++i, ++idx){
+        work[b] += costs[order[idx]];
+        // the order is kept within the blocks
+        if(i > 0)
+          expect_true(order[idx - 1] < order[idx]);
+      }
+    }
+
+    // the first block has the most expensive task and the last block is full
+    // before it gets to 10
+    expect_true(work[0] == 25);
+    expect_true(work[1] == 15);
+    expect_true(work[2] == 15);
+    expect_true(work[3] == 9);
+
+    // the identity is returned with one block or few tasks
+    auto const order_one = lpt_order(costs, 1);
+    for(size_t i = 0; i < order_one.size(); ++i)
+      expect_true(order_one[i] == i);
+
+    std::vector<double> const few_costs{3, 1, 2};
+    auto const order_few = lpt_order(few_costs, 4);
+    for(size_t i = 0; i < order_few.size(); ++i)
+      expect_true(order_few[i] == i);
+  }
+}
@@ -2,6 +2,7 @@
 #include "log-cholesky.h"
 #include <algorithm>
 #include <iterator>
+#include <cmath>
 
 context("log-cholesky works as expected") {
   test_that("log_chol::pd_mat works as expected") {
@@ -98,4 +99,68 @@ context("log-cholesky works as expected") {
     // clean up
     wmem::clear_all();
   }
+
+  test_that("log_chol::d2pd_mat works as expected") {
+    /*
+     checks the directional derivatives against central differences of
+     pd_mat and of the gradient of sum(exp(L^top L)) computed with dpd_mat
+     */
+    constexpr vajoint_uint dim = 4,
+                      dim_ltri = dim_tri(dim);
+    constexpr double theta[dim_ltri] = { 0.253929615612238, 1.2724293214294, 0.856338430490728, -1.53995004190371, -0.928567034713538, 0.25711649595832, -0.00576717274753696, 2.40465338885795, 0.763593461140459, -0.441421449571498 },
+                         v[dim_ltri] = { -0.626453810742332, 0.183643324222082, -0.835628612410047, 1.59528080213779, 0.329507771815361, -0.820468384118015, 0.487429052428485, 0.738324705129217, 0.575781351653492, -0.305388387156356 };
+
+    // the gradient of sum(exp(L^top L)) w.r.t. theta
+    auto gr = [&](double const *x, double *res){
+      double X[dim * dim];
+      log_chol::pd_mat::get(x, dim, X);
+      for(double &z : X)
+        z = std::exp(z);
+      std::fill(res, res + dim_ltri, 0);
+      log_chol::dpd_mat::get(x, dim, res, X);
+    };
+
+    constexpr double h{1e-5};
+    double theta_p[dim_ltri], theta_m[dim_ltri];
+    for(vajoint_uint i = 0; i < dim_ltri; ++i){
+      theta_p[i] = theta[i] + h * v[i];
+      theta_m[i] = theta[i] - h * v[i];
+    }
+
+    std::unique_ptr<double[]>
+      mem(new double[log_chol::d2pd_mat::n_wmem(dim)]);
+
+    // the directional derivative of L^top L
+    double dX[dim * dim];
+    log_chol::d2pd_mat::dir(theta, dim, v, dX, mem.get());
+    {
+      double X_p[dim * dim], X_m[dim * dim];
+      log_chol::pd_mat::get(theta_p, dim, X_p);
+      log_chol::pd_mat::get(theta_m, dim, X_m);
+      for(vajoint_uint i = 0; i < dim * dim; ++i)
+        expect_true(pass_rel_err(dX[i], (X_p[i] - X_m[i]) / (2 * h), 1e-6));
+    }
+
+    // the Hessian times v
+    double X[dim * dim], dderivs[dim * dim], output[dim_ltri];
+    log_chol::pd_mat::get(theta, dim, X);
+    for(vajoint_uint i = 0; i < dim * dim; ++i){
+      X[i] = std::exp(X[i]);
+      dderivs[i] = X[i] * dX[i];
+    }
+
+    std::fill(std::begin(output), std::end(output), 0);
+    log_chol::dpd_mat::get(theta, dim, output, dderivs);
+    log_chol::d2pd_mat::get(theta, dim, v, output, X, mem.get());
+
+    double gr_p[dim_ltri], gr_m[dim_ltri];
+    gr(theta_p, gr_p);
+    gr(theta_m, gr_m);
+    for(vajoint_uint i = 0; i < dim_ltri; ++i)
+      expect_true
+        (pass_rel_err(output[i], (gr_p[i] - gr_m[i]) / (2 * h), 1e-6));
+
+    // clean up
+    wmem::clear_all();
+  }
 }
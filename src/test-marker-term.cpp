@@ -2,10 +2,119 @@
 #include "testthat-wrapper.h"
 #include "wmem.h"
 #include <iterator>
+#include <cmath>
+#include <algorithm>
 
 using std::begin;
 using std::end;
 
+namespace {
+/**
+ * checks the value and the gradient from marker_dat::grad summed over the
+ * observations.
+ */
+void test_analytic_grad
+  (marker::marker_dat const &comp_obj, std::vector<double> const &par,
+   double const true_val, double const *true_derivs, double const rel_eps){
+  std::vector<double> gr(par.size(), 0);
+  double * wk_mem = wmem::get_double_mem(comp_obj.n_wmem_grad());
+
+  double res{};
+  for(vajoint_uint i = 0; i < comp_obj.n_obs(); ++i)
+    res += comp_obj.grad(par.data(), gr.data(), wk_mem, i);
+  expect_true(pass_rel_err(res, true_val, 1e-6));
+
+  for(size_t i = 0; i < gr.size(); ++i)
+    expect_true(pass_rel_err(gr[i], true_derivs[i], rel_eps));
+}
+
+/**
+ * checks marker_dat::eval_cluster and marker_dat::grad_cluster. Each
+ * observation is repeated to get more than one block of observations.
+ */
+void test_cluster
+  (marker::marker_dat const &comp_obj, std::vector<double> const &par,
+   double const true_val, double const *true_derivs, double const rel_eps){
+  constexpr vajoint_uint n_rep{40};
+  std::vector<vajoint_uint> indices;
+  for(vajoint_uint k = 0; k < n_rep; ++k)
+    for(vajoint_uint i = 0; i < comp_obj.n_obs(); ++i)
+      indices.emplace_back(i);
+  comp_obj.sort_by_pattern(indices);
+
+  double * wk_mem = wmem::get_double_mem(comp_obj.n_wmem_cluster());
+  double const res_eval = comp_obj.eval_cluster
+    (par.data(), wk_mem, indices.data(), indices.data() + indices.size());
+  expect_true(pass_rel_err(res_eval, n_rep * true_val, 1e-6));
+
+  std::vector<double> gr(par.size(), 0);
+  double const res_grad = comp_obj.grad_cluster
+    (par.data(), gr.data(), wk_mem, indices.data(),
+     indices.data() + indices.size());
+  expect_true(pass_rel_err(res_grad, n_rep * true_val, 1e-6));
+
+  for(size_t i = 0; i < gr.size(); ++i)
+    expect_true(pass_rel_err(gr[i], n_rep * true_derivs[i], rel_eps));
+}
+
+/**
+ * checks marker_dat::hess_vec_cluster against central differences of
+ * marker_dat::grad_cluster in a direction which is symmetric for the
+ * covariance matrices. The object is setup again with par afterwards.
+ */
+void test_hess_vec
+  (marker::marker_dat &comp_obj, subset_params const &par_idx,
+   std::vector<double> const &par, double const rel_eps){
+  constexpr vajoint_uint n_rep{3};
+  std::vector<vajoint_uint> indices;
+  for(vajoint_uint k = 0; k < n_rep; ++k)
+    for(vajoint_uint i = 0; i < comp_obj.n_obs(); ++i)
+      indices.emplace_back(i);
+  comp_obj.sort_by_pattern(indices);
+
+  std::vector<double> dir(par.size());
+  for(size_t i = 0; i < par.size(); ++i)
+    dir[i] = std::sin(static_cast<double>(i + 1)) / 4;
+
+  auto symmetrize = [&](vajoint_uint const start, vajoint_uint const dim){
+    for(vajoint_uint j = 0; j < dim; ++j)
+      for(vajoint_uint i = 0; i < j; ++i)
+        dir[start + i + j * dim] = dir[start + j + i * dim];
+  };
+  symmetrize(par_idx.vcov_marker(), comp_obj.n_markers());
+  symmetrize(par_idx.va_vcov(), par_idx.n_shared() + par_idx.n_shared_surv());
+
+  double * wk_mem = wmem::get_double_mem
+    (std::max({comp_obj.n_wmem(), comp_obj.n_wmem_cluster(),
+               comp_obj.n_wmem_hess()}));
+  comp_obj.setup(par.data(), wk_mem);
+  std::vector<double> res(par.size(), 0);
+  comp_obj.hess_vec_cluster
+    (par.data(), dir.data(), res.data(), wk_mem, indices.data(),
+     indices.data() + indices.size());
+
+  // compute the central difference
+  constexpr double h{1e-5};
+  auto grad_at = [&](double const step){
+    std::vector<double> par_h(par), gr(par.size(), 0);
+    for(size_t i = 0; i < par.size(); ++i)
+      par_h[i] += step * dir[i];
+    comp_obj.setup(par_h.data(), wk_mem);
+    comp_obj.grad_cluster
+      (par_h.data(), gr.data(), wk_mem, indices.data(),
+       indices.data() + indices.size());
+    return gr;
+  };
+  auto const gr_p = grad_at(h),
+             gr_m = grad_at(-h);
+
+  for(size_t i = 0; i < par.size(); ++i)
+    expect_true(pass_rel_err(res[i], (gr_p[i] - gr_m[i]) / (2 * h), rel_eps));
+
+  comp_obj.setup(par.data(), wk_mem);
+}
+} // namespace
+
 context("marker_term is correct") {
   test_that("marker_term gives the correct result in the univariate case"){
     /* R code to reproduce the result
@@ -172,6 +281,15 @@ context("marker_term is correct") {
     for(size_t i = 0; i < ad_par.size(); ++i)
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_derivs[i], 1e-6));
 
+    // test the analytic gradient
+    test_analytic_grad(comp_obj, par, true_val, true_derivs, 1e-6);
+
+    // test the cluster versions
+    test_cluster(comp_obj, par, true_val, true_derivs, 1e-6);
+
+    // test the Hessian vector products
+    test_hess_vec(comp_obj, par_idx, par, 1e-6);
+
     // clean up
     wmem::clear_all();
   }
@@ -406,6 +524,23 @@ context("marker_term is correct") {
       for(vajoint_uint i = 0; i < comp_obj.n_obs(); ++i)
         res += comp_obj(par.data(), wk_mem, i);
       expect_true(pass_rel_err(res, true_val, 1e-7));
+
+      // the factorizations are updated when setup is called again
+      std::vector<double> par_other(par);
+      for(vajoint_uint i = 0; i < comp_obj.n_markers(); ++i)
+        par_other[par_idx.vcov_marker() + i * (comp_obj.n_markers() + 1)] *= 2;
+      comp_obj.setup(par_other.data(), wk_mem);
+
+      res = 0;
+      for(vajoint_uint i = 0; i < comp_obj.n_obs(); ++i)
+        res += comp_obj(par_other.data(), wk_mem, i);
+      expect_true(std::abs(res - true_val) > 1e-3 * std::abs(true_val));
+
+      comp_obj.setup(par.data(), wk_mem);
+      res = 0;
+      for(vajoint_uint i = 0; i < comp_obj.n_obs(); ++i)
+        res += comp_obj(par.data(), wk_mem, i);
+      expect_true(pass_rel_err(res, true_val, 1e-7));
     }
 
     // test the gradient
@@ -428,6 +563,15 @@ context("marker_term is correct") {
     for(size_t i = 0; i < ad_par.size(); ++i)
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_derivs[i], 1e-6));
 
+    // test the analytic gradient
+    test_analytic_grad(comp_obj, par, true_val, true_derivs, 1e-6);
+
+    // test the cluster versions
+    test_cluster(comp_obj, par, true_val, true_derivs, 1e-6);
+
+    // test the Hessian vector products
+    test_hess_vec(comp_obj, par_idx, par, 1e-6);
+
     // clean up
     wmem::clear_all();
   }
@@ -746,6 +890,15 @@ context("marker_term is correct") {
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_derivs[i], 1e-5));
     }
 
+    // test the analytic gradient
+    test_analytic_grad(comp_obj, par, true_val, true_derivs, 1e-5);
+
+    // test the cluster versions
+    test_cluster(comp_obj, par, true_val, true_derivs, 1e-5);
+
+    // test the Hessian vector products
+    test_hess_vec(comp_obj, par_idx, par, 1e-5);
+
     // clean up
     wmem::clear_all();
   }
@@ -897,6 +1050,15 @@ context("marker_term is correct") {
     for(size_t i = 0; i < ad_par.size(); ++i)
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_derivs[i], 1e-6));
 
+    // test the analytic gradient
+    test_analytic_grad(comp_obj, par, true_val, true_derivs, 1e-6);
+
+    // test the cluster versions
+    test_cluster(comp_obj, par, true_val, true_derivs, 1e-6);
+
+    // test the Hessian vector products
+    test_hess_vec(comp_obj, par_idx, par, 1e-6);
+
     // clean up
     wmem::clear_all();
   }
@@ -2,6 +2,7 @@
 #include "testthat-wrapper.h"
 #include "wmem.h"
 #include <iterator>
+#include <cmath>
 
 using std::begin;
 using std::end;
@@ -19,8 +20,122 @@ constexpr vajoint_uint n_nodes{100};
   constexpr double ns[n_nodes] {0.999856863386721, 0.999245975319798, 0.998147567366563, 0.996562468518722, 0.994492197621496, 0.991938770353028, 0.988904679243459, 0.985392887881853, 0.981406827127908, 0.976950391462746, 0.972027935068128, 0.96664426752154, 0.960804649072667, 0.954514785491265, 0.947780822485363, 0.940609339692509, 0.933007344248582, 0.924982263939796, 0.9165419399442, 0.907694619169588, 0.898448946195157, 0.888813954824748, 0.878799059259854, 0.86841404490101, 0.857669058786528, 0.846574599677901, 0.835141507801571, 0.823380954257065, 0.811304430101854, 0.798923735123589, 0.786250966310691, 0.773298506032547, 0.760079009940882, 0.746605394604095, 0.732890824886679, 0.718948701086016, 0.704792645839151, 0.690436490812315, 0.675894263186211, 0.661180171950264, 0.646308594019236, 0.631294060185752, 0.616151240922487, 0.600894932047868, 0.585540040269302, 0.570101568618057, 0.55459460179003, 0.539034291406718, 0.523435841210796, 0.507814492210772, 0.492185507789228, 0.476564158789204, 0.460965708593282, 0.445405398209969, 0.429898431381943, 0.414459959730698, 0.399105067952132, 0.383848759077513, 0.368705939814248, 0.353691405980764, 0.338819828049735, 0.324105736813789, 0.309563509187685, 0.295207354160849, 0.281051298913984, 0.267109175113321, 0.253394605395905, 0.239920990059119, 0.226701493967453, 0.213749033689309, 0.201076264876411, 0.188695569898146, 0.176619045742935, 0.16485849219843, 0.153425400322099, 0.142330941213472, 0.13158595509899, 0.121200940740146, 0.111186045175252, 0.101551053804843, 0.0923053808304122, 0.0834580600557998, 0.0750177360602048, 0.0669926557514177, 0.059390660307491, 0.0522191775146367, 0.045485214508735, 0.0391953509273331, 0.0333557324784605, 0.0279720649318723, 0.0230496085372542, 0.0185931728720925, 0.0146071121181469, 0.0110953207565408, 0.00806122964697142, 0.00550780237850412, 0.00343753148127823, 0.0018524326334376, 0.000754024680202081, 0.000143136613279637},
                    ws[n_nodes] {0.00036731724525283, 0.00085469632675904, 0.00134196268577676, 0.0018279806006632, 0.00231222503171107, 0.00279421400193276, 0.00327347422542265, 0.0037495366277323, 0.00422193573483449, 0.00469020982684724, 0.00515390128743443, 0.00561255701159295, 0.00606572883148976, 0.00651297394648573, 0.00695385535185937, 0.00738794226372056, 0.00781481053877309, 0.00823404308807255, 0.00864523028416182, 0.00904797036106383, 0.0094418698066875, 0.00982654374721765, 0.0102016163231046, 0.010566721056264, 0.0109215012081237, 0.0112656101281682, 0.0115987115926271, 0.0119204801329841, 0.0122306013539787, 0.0125287722407897, 0.0128147014551038, 0.0130881096197728, 0.0133487295917854, 0.0135963067232884, 0.0138305991103962, 0.0140513778295507, 0.0142584271611973, 0.0144515448005625, 0.0146305420553188, 0.0147952440299562, 0.0149454897966664, 0.0150811325525845, 0.0152020397632271, 0.0153080932919901, 0.0153991895155767, 0.0154752394252457, 0.0155361687137837, 0.015581917848105, 0.0156124421274248, 0.0156277117269315, 0.0156277117269314, 0.0156124421274247, 0.0155819178481047, 0.0155361687137839, 0.0154752394252455, 0.0153991895155768, 0.0153080932919904, 0.0152020397632275, 0.0150811325525847, 0.0149454897966667, 0.0147952440299567, 0.014630542055319, 0.0144515448005628, 0.0142584271611974, 0.0140513778295502, 0.0138305991103963, 0.013596306723289, 0.0133487295917851, 0.0130881096197728, 0.0128147014551039, 0.0125287722407895, 0.0122306013539787, 0.0119204801329843, 0.011598711592627, 0.0112656101281685, 0.0109215012081232, 0.0105667210562641, 0.0102016163231051, 0.00982654374721767, 0.0094418698066878, 0.00904797036106456, 0.00864523028416149, 0.00823404308807257, 0.00781481053877307, 0.00738794226372049, 0.00695385535185915, 0.00651297394648541, 0.00606572883148956, 0.00561255701159312, 0.00515390128743413, 0.00469020982684725, 0.0042219357348343, 0.00374953662773162, 0.00327347422542264, 0.00279421400193271, 0.00231222503171171, 0.00182798060066296, 0.00134196268577661, 0.000854696326758952, 0.000367317245252787};
 
+/**
+ * checks the value and the gradient from expected_cum_hazzard::grad in the
+ * tests with three fixed effects, two time-varying fixed effects, three
+ * association parameters, and eight random effects.
+ */
+void test_analytic_grad
+  (survival::expected_cum_hazzard const &comp_obj, double const lb,
+   double const ub, double const *z, double const *delta,
+   double const *omega, double const *alpha, double const *zeta,
+   double const *Psi, double const true_val, double const *true_gr,
+   double const *cached_expansions){
+  std::vector<double> gr(3 + 2 + 3 + 8 + 64, 0);
+  double * const d_delta{gr.data()},
+         * const d_omega{d_delta + 3},
+         * const d_alpha{d_omega + 2},
+         * const d_zeta{d_alpha + 3},
+         * const d_Psi{d_zeta + 8};
+
+  double const res = comp_obj.grad
+    ({ns, ws, n_nodes}, lb, ub, z, nullptr, nullptr, delta, omega, alpha,
+     zeta, Psi, d_delta, d_omega, d_alpha, d_zeta, d_Psi,
+     wmem::get_double_mem(comp_obj.n_wmem_grad()), cached_expansions);
+
+  expect_true(pass_rel_err(res, true_val, 1e-6));
+  for(size_t i = 0; i < gr.size(); ++i)
+    expect_true(pass_rel_err(gr[i], true_gr[i], 1e-6));
+}
+
+/**
+ * checks the value and the gradient from survival_dat::grad summed over the
+ * observations.
+ */
+void test_analytic_grad
+  (survival::survival_dat const &comp_obj, std::vector<double> const &par,
+   double const true_val, double const *true_grad,
+   survival::node_weight const &nws){
+  std::vector<double> gr(par.size(), 0);
+  double res{};
+  for(vajoint_uint i = 0; i < comp_obj.n_outcomes(); ++i)
+    for(vajoint_uint j = 0; j < comp_obj.n_terms(i); ++j)
+      res += comp_obj.grad
+        (par.data(), gr.data(),
+         wmem::get_double_mem(comp_obj.n_wmem_grad()), j, i, nws);
+
+  expect_true(pass_rel_err(res, true_val, 1e-6));
+  for(size_t i = 0; i < gr.size(); ++i)
+    expect_true(pass_rel_err(gr[i], true_grad[i], 1e-6));
+}
+
+/**
+ * checks survival_dat::hess_vec against central differences of
+ * survival_dat::grad in a direction which is symmetric for the covariance
+ * matrices.
+ */
+void test_hess_vec
+  (survival::survival_dat const &comp_obj, subset_params const &par_idx,
+   std::vector<double> const &par, survival::node_weight const &nws,
+   double const rel_eps){
+  std::vector<double> dir(par.size());
+  for(size_t i = 0; i < par.size(); ++i)
+    dir[i] = std::sin(static_cast<double>(i + 1)) / 4;
+
+  vajoint_uint const n_va{par_idx.n_shared() + par_idx.n_shared_surv()};
+  for(vajoint_uint j = 0; j < n_va; ++j)
+    for(vajoint_uint i = 0; i < j; ++i)
+      dir[par_idx.va_vcov() + i + j * n_va] =
+        dir[par_idx.va_vcov() + j + i * n_va];
+
+  auto grad_at = [&](double const step){
+    std::vector<double> par_h(par), gr(par.size(), 0);
+    for(size_t i = 0; i < par.size(); ++i)
+      par_h[i] += step * dir[i];
+    for(vajoint_uint i = 0; i < comp_obj.n_outcomes(); ++i)
+      for(vajoint_uint j = 0; j < comp_obj.n_terms(i); ++j)
+        comp_obj.grad
+          (par_h.data(), gr.data(),
+           wmem::get_double_mem(comp_obj.n_wmem_grad()), j, i, nws);
+    return gr;
+  };
+
+  std::vector<double> res(par.size(), 0);
+  for(vajoint_uint i = 0; i < comp_obj.n_outcomes(); ++i)
+    for(vajoint_uint j = 0; j < comp_obj.n_terms(i); ++j)
+      comp_obj.hess_vec
+        (par.data(), dir.data(), res.data(),
+         wmem::get_double_mem(comp_obj.n_wmem_hess()), j, i, nws);
+
+  constexpr double h{1e-5};
+  auto const gr_p = grad_at(h),
+             gr_m = grad_at(-h);
+  for(size_t i = 0; i < par.size(); ++i)
+    expect_true(pass_rel_err(res[i], (gr_p[i] - gr_m[i]) / (2 * h), rel_eps));
+}
+
 } // namespace
 
+context("gauss_legendre_rule is correct") {
+  test_that("gauss_legendre_rule gives the correct result"){
+    double ns_res[n_nodes], ws_res[n_nodes];
+    survival::gauss_legendre_rule(n_nodes, ns_res, ws_res);
+    for(vajoint_uint i = 0; i < n_nodes; ++i){
+      expect_true(pass_rel_err(ns_res[i], ns[n_nodes - 1 - i], 1e-10));
+      expect_true(pass_rel_err(ws_res[i], ws[n_nodes - 1 - i], 1e-10));
+    }
+
+    // the 3-point rule on (0, 1)
+    survival::gauss_legendre_rule(3, ns_res, ws_res);
+    expect_true(pass_rel_err(ns_res[0], .5 - std::sqrt(.15), 1e-14));
+    expect_true(pass_rel_err(ns_res[1], .5, 1e-14));
+    expect_true(pass_rel_err(ns_res[2], .5 + std::sqrt(.15), 1e-14));
+    expect_true(pass_rel_err(ws_res[0], 5. / 18, 1e-14));
+    expect_true(pass_rel_err(ws_res[1], 8. / 18, 1e-14));
+    expect_true(pass_rel_err(ws_res[2], 5. / 18, 1e-14));
+  }
+}
+
 context("expected_cum_hazzard is correct") {
   test_that("expected_cum_hazzard gives the correct result"){
     /*
@@ -262,6 +377,22 @@ context("expected_cum_hazzard is correct") {
         expect_true(pass_rel_err(x.adjoint(), *g++, 1e-6));
     }
 
+    // the analytic gradient gives the same
+    test_analytic_grad
+      (comp_obj, lb1, ub1, z, delta, omega, alpha, zeta, Psi, true_val1, gr1,
+       nullptr);
+    test_analytic_grad
+      (comp_obj, lb2, ub2, z, delta, omega, alpha, zeta, Psi, true_val2, gr2,
+       nullptr);
+
+    comp_obj.cache_expansions
+      (lb1, ub1, expansions.data(),
+       wmem::get_double_mem(comp_obj.n_wmem()[1]), {ns, ws, n_nodes}, nullptr,
+       nullptr);
+    test_analytic_grad
+      (comp_obj, lb1, ub1, z, delta, omega, alpha, zeta, Psi, true_val1, gr1,
+       expansions.data());
+
     // clean-up
     wmem::clear_all();
   }
@@ -1044,6 +1175,22 @@ context("expected_cum_hazzard is correct") {
         expect_true(pass_rel_err(x.adjoint(), *g++, 1e-6));
     }
 
+    // the analytic gradient gives the same
+    test_analytic_grad
+      (comp_obj, lb1, ub1, z, delta, omega, alpha, zeta, Psi, true_val1, gr1,
+       nullptr);
+    test_analytic_grad
+      (comp_obj, lb2, ub2, z, delta, omega, alpha, zeta, Psi, true_val2, gr2,
+       nullptr);
+
+    comp_obj.cache_expansions
+      (lb1, ub1, expansions.data(),
+       wmem::get_double_mem(comp_obj.n_wmem()[1]), {ns, ws, n_nodes}, nullptr,
+       nullptr);
+    test_analytic_grad
+      (comp_obj, lb1, ub1, z, delta, omega, alpha, zeta, Psi, true_val1, gr1,
+       expansions.data());
+
     // clean-up
     wmem::clear_all();
   }
@@ -1337,6 +1484,60 @@ context("survival_dat is correct") {
     for(size_t i = 0; i < ad_par.size(); ++i)
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_grad[i], 1e-6));
 
+    // the analytic gradient gives the same with and without caching
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+    test_hess_vec(comp_obj, par_idx, par, {ns, ws, n_nodes}, 1e-6);
+    comp_obj.clear_cached_expansions();
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+    test_hess_vec(comp_obj, par_idx, par, {ns, ws, n_nodes}, 1e-6);
+
+    // fewer nodes are used when the number of nodes is selected
+    comp_obj.set_cached_expansions({ns, ws, n_nodes}, 1e-10);
+    {
+      size_t n_obs{};
+      for(vajoint_uint i = 0; i < 2; ++i)
+        n_obs += comp_obj.n_terms(i);
+      expect_true(comp_obj.n_cached_nodes() < n_obs * n_nodes);
+    }
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+
+    // the rules are selected without the parameters. Check the accuracy of
+    // the lower bound terms with other parameters than those above
+    {
+      auto eval_lb = [&](std::vector<double> const &x){
+        auto req_wmem = comp_obj.n_wmem();
+        double res{};
+        for(vajoint_uint i = 0; i < 2; ++i)
+          for(vajoint_uint j = 0; j < comp_obj.n_terms(i); ++j)
+            res += comp_obj
+              (x.data(), wmem::get_double_mem(req_wmem[0]), j, i,
+               wmem::get_double_mem(req_wmem[1]), {ns, ws, n_nodes});
+        return res;
+      };
+
+      std::vector<double> par_alt{par};
+      for(vajoint_uint i = 0; i < 2; ++i){
+        for(vajoint_uint j = 0; j < 3; ++j)
+          par_alt[par_idx.association(i) + j] *= 2;
+        par_alt[par_idx.fixef_vary_surv(i)] -= .5;
+      }
+      for(vajoint_uint j = par_idx.va_mean(); j < par_idx.va_mean_end(); ++j)
+        par_alt[j] = -par_alt[j] / 2;
+
+      for(auto &x : {par, par_alt}){
+        double const res_reduced{eval_lb(x)};
+        comp_obj.clear_cached_expansions();
+        double const res_full{eval_lb(x)};
+        comp_obj.set_cached_expansions({ns, ws, n_nodes}, 1e-10);
+
+        expect_true(pass_rel_err(res_reduced, res_full, 1e-8));
+      }
+    }
+    comp_obj.clear_cached_expansions();
+
     // clean up
     wmem::clear_all();
   }
@@ -1668,6 +1869,15 @@ context("survival_dat is correct") {
     for(size_t i = 0; i < ad_par.size(); ++i)
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_grad[i], 1e-6));
 
+    // the analytic gradient gives the same with and without caching
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+    test_hess_vec(comp_obj, par_idx, par, {ns, ws, n_nodes}, 1e-6);
+    comp_obj.clear_cached_expansions();
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+    test_hess_vec(comp_obj, par_idx, par, {ns, ws, n_nodes}, 1e-6);
+
     // clean up
     wmem::clear_all();
   }
@@ -1964,6 +2174,207 @@ context("survival_dat is correct") {
     for(size_t i = 0; i < ad_par.size(); ++i)
       expect_true(pass_rel_err(ad_par[i].adjoint(), true_grad[i], 1e-6));
 
+    // the analytic gradient gives the same with and without caching
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+    test_hess_vec(comp_obj, par_idx, par, {ns, ws, n_nodes}, 1e-6);
+    comp_obj.clear_cached_expansions();
+    test_analytic_grad
+      (comp_obj, par, true_val, true_grad, {ns, ws, n_nodes});
+    test_hess_vec(comp_obj, par_idx, par, {ns, ws, n_nodes}, 1e-6);
+
+    // clean up
+    wmem::clear_all();
+  }
+
+  test_that("survival_dat gives the correct result when the intervals are split at the knots"){
+    // the last two observations are the same as the first two
+    constexpr vajoint_uint n_obs{5};
+    double lbs[]{0, .3, .9, 0, .3},
+           ubs[]{2.5, 1.1, 2.8, 2.5, 1.1},
+           event[]{1, 0, 1, 1, 0},
+           Z[]{1, 1, 1, 1, 1};
+
+    arma::vec const bk{0, 3};
+    joint_bases::bases_vector bases_fix, bases_rng;
+    bases_fix.emplace_back(new joint_bases::bs(bk, {.5, 1.2, 2}, false));
+    bases_rng.emplace_back(new joint_bases::bs(bk, {1, 1.7}, true));
+
+    std::vector<survival::obs_input> surv_input;
+    surv_input.emplace_back(survival::obs_input{n_obs, lbs, ubs, event});
+
+    subset_params par_idx;
+    par_idx.add_marker({1, 1, bases_rng[0]->n_basis()});
+    par_idx.add_surv({1, bases_fix[0]->n_basis(), {1}, false});
+
+    std::vector<simple_mat<double> > design_mats,
+                                     design_mats_varying_fix,
+                                     design_mats_varying_rng;
+    design_mats.emplace_back(Z, 1, n_obs);
+    design_mats_varying_fix.emplace_back(nullptr, 0, n_obs);
+    design_mats_varying_rng.emplace_back(nullptr, 0, n_obs);
+
+    std::vector<std::vector<std::vector<int> > > ders{{{0}}};
+    survival::survival_dat comp_obj
+      (bases_fix, bases_rng, design_mats, design_mats_varying_fix,
+       design_mats_varying_rng, par_idx, surv_input, ders);
+
+    {
+      std::vector<double> const expected{0, .5, 1, 1.2, 1.7, 2, 3};
+      auto const &res = comp_obj.break_points(0);
+      expect_true(res.size() == expected.size());
+      for(size_t i = 0; i < std::min(res.size(), expected.size()); ++i)
+        expect_true(std::abs(res[i] - expected[i]) < 1e-12);
+    }
+
+    // set some parameters with a diagonal VA covariance matrix
+    std::vector<double> par(par_idx.n_params_w_va());
+    for(size_t i = 0; i < par.size(); ++i)
+      par[i] = .25 * std::sin(static_cast<double>(i + 1));
+    {
+      vajoint_uint const dim{par_idx.n_shared() + par_idx.n_shared_surv()};
+      double * const vcov{par.data() + par_idx.va_vcov()};
+      for(vajoint_uint j = 0; j < dim; ++j)
+        for(vajoint_uint i = 0; i < dim; ++i)
+          vcov[i + j * dim] = i == j ? .1 : 0;
+    }
+
+    auto eval = [&](vajoint_uint const n_nodes, std::vector<double> &gr){
+      std::vector<double> ns(n_nodes), ws(n_nodes);
+      survival::gauss_legendre_rule(n_nodes, ns.data(), ws.data());
+
+      gr.assign(par.size(), 0);
+      double res{};
+      for(vajoint_uint j = 0; j < comp_obj.n_terms(0); ++j)
+        res += comp_obj.grad
+          (par.data(), gr.data(),
+           wmem::get_double_mem(comp_obj.n_wmem_grad()), j, 0,
+           {ns.data(), ws.data(), n_nodes});
+      return res;
+    };
+
+    // the observations have 6, 3, 5, 6, and 3 pieces
+    expect_true(std::abs(comp_obj.mean_n_pieces() - 23. / 5) < 1e-12);
+
+    // a reference value with many nodes on each piece
+    std::vector<double> gr_ref, gr_split, gr;
+    {
+      std::vector<double> ns(40), ws(40);
+      survival::gauss_legendre_rule(40, ns.data(), ws.data());
+      comp_obj.set_split_rules({ns.data(), ws.data(), 40});
+    }
+    double const ref{eval(40, gr_ref)};
+
+    // few nodes on each piece suffice
+    std::vector<double> ns(6), ws(6);
+    survival::gauss_legendre_rule(6, ns.data(), ws.data());
+    comp_obj.set_split_rules({ns.data(), ws.data(), 6});
+    double const res_split{eval(6, gr_split)};
+    expect_true(pass_rel_err(res_split, ref, 1e-10));
+    for(size_t i = 0; i < gr_ref.size(); ++i)
+      expect_true(pass_rel_err(gr_split[i], gr_ref[i], 1e-8));
+
+    // the same with caching. The identical observations share the expansions
+    comp_obj.set_cached_expansions({ns.data(), ws.data(), 6});
+    // the first three observations have 6, 3, and 5 pieces and two events
+    expect_true(comp_obj.n_cached_columns() == (6 + 3 + 5) * 6 + 2);
+    expect_true(comp_obj.n_cached_nodes() == (6 + 3 + 5 + 6 + 3) * 6);
+    expect_true(pass_rel_err(eval(6, gr), res_split, 1e-14));
+    for(size_t i = 0; i < gr.size(); ++i)
+      expect_true(pass_rel_err(gr[i], gr_split[i], 1e-14));
+
+    // roughly the same when the expansions are stored as floats
+    comp_obj.set_cached_expansions({ns.data(), ws.data(), 6}, 0, true);
+    expect_true(comp_obj.n_cached_columns() == (6 + 3 + 5) * 6 + 2);
+    expect_true(pass_rel_err(eval(6, gr), res_split, 1e-6));
+    for(size_t i = 0; i < gr.size(); ++i)
+      expect_true(std::abs(gr[i] - gr_split[i]) <=
+        1e-5 * std::abs(gr_split[i]) + 1e-8);
+    {
+      double res{};
+      for(vajoint_uint j = 0; j < comp_obj.n_terms(0); ++j)
+        res += comp_obj
+          (par.data(), wmem::get_double_mem(comp_obj.n_wmem()[0]), j, 0,
+           wmem::get_double_mem(comp_obj.n_wmem()[1]),
+           {ns.data(), ws.data(), 6});
+      expect_true(pass_rel_err(res, res_split, 1e-6));
+    }
+    test_hess_vec(comp_obj, par_idx, par, {ns.data(), ws.data(), 6}, 1e-6);
+
+    // the same when the number of nodes is selected for each piece
+    comp_obj.set_cached_expansions({ns.data(), ws.data(), 6}, 1e-10);
+    expect_true(comp_obj.n_cached_nodes() <= n_obs * 6 * 7);
+    expect_true(pass_rel_err(eval(6, gr), res_split, 1e-8));
+    for(size_t i = 0; i < gr.size(); ++i)
+      expect_true(pass_rel_err(gr[i], gr_split[i], 1e-8));
+
+    // the same with lazy caches which are large enough for all observations
+    comp_obj.set_lazy_cache({ns.data(), ws.data(), 6}, 1000000, 1);
+    for(int i = 0; i < 2; ++i){
+      expect_true(pass_rel_err(eval(6, gr), res_split, 1e-14));
+      for(size_t i = 0; i < gr.size(); ++i)
+        expect_true(pass_rel_err(gr[i], gr_split[i], 1e-14));
+    }
+    size_t bytes_all{};
+    {
+      auto const stats = comp_obj.lazy_cache_stats();
+      expect_true(stats[0] == n_obs);
+      expect_true(stats[1] == n_obs);
+      bytes_all = stats[2];
+      expect_true(bytes_all > 0);
+    }
+    test_hess_vec(comp_obj, par_idx, par, {ns.data(), ws.data(), 6}, 1e-6);
+
+    // the same with a lazy cache with room for some of the observations
+    {
+      size_t const max_bytes{bytes_all / 2};
+      comp_obj.set_lazy_cache({ns.data(), ws.data(), 6}, max_bytes, 1);
+      for(int i = 0; i < 2; ++i){
+        expect_true(pass_rel_err(eval(6, gr), res_split, 1e-14));
+        for(size_t i = 0; i < gr.size(); ++i)
+          expect_true(pass_rel_err(gr[i], gr_split[i], 1e-14));
+      }
+
+      auto const stats = comp_obj.lazy_cache_stats();
+      expect_true(stats[0] + stats[1] == 2 * n_obs);
+      expect_true(stats[1] > n_obs);
+      expect_true(stats[2] <= max_bytes);
+    }
+
+    // the cache is shared by all threads
+    comp_obj.set_lazy_cache({ns.data(), ws.data(), 6}, 1000000, 3);
+    for(int i = 0; i < 2; ++i){
+      expect_true(pass_rel_err(eval(6, gr), res_split, 1e-14));
+      for(size_t i = 0; i < gr.size(); ++i)
+        expect_true(pass_rel_err(gr[i], gr_split[i], 1e-14));
+    }
+    {
+      auto const stats = comp_obj.lazy_cache_stats();
+      expect_true(stats[1] == n_obs);
+      expect_true(stats[2] == bytes_all);
+    }
+
+    // the same with multiple threads
+    {
+      comp_obj.set_cached_expansions({ns.data(), ws.data(), 6}, 1e-10);
+      std::vector<double> gr_one_thread;
+      double const res_one_thread{eval(6, gr_one_thread)};
+      size_t const n_cached_nodes{comp_obj.n_cached_nodes()};
+      comp_obj.clear_cached_expansions();
+      comp_obj.set_cached_expansions
+        ({ns.data(), ws.data(), 6}, 1e-10, false, 3);
+      expect_true(comp_obj.n_cached_nodes() == n_cached_nodes);
+      expect_true(eval(6, gr) == res_one_thread);
+      for(size_t i = 0; i < gr.size(); ++i)
+        expect_true(gr[i] == gr_one_thread[i]);
+    }
+
+    // the error is larger with more nodes without splitting
+    comp_obj.clear_split_rules();
+    double const res_no_split{eval(30, gr)};
+    expect_true
+      (std::abs(res_no_split - ref) > 10 * std::abs(res_split - ref));
+
     // clean up
     wmem::clear_all();
   }